@@ -0,0 +1,199 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pipeline.h"
+#include "savefile.h"
+
+struct LzDictionary;
+
+/*
+    A directory of saves stored by content.  Each save is cut into chunks,
+    either fixed 512 byte blocks or content-defined ones (a gear rolling
+    hash picks the cut points, so an insert only changes the chunks around
+    it), and each distinct chunk is kept once:
+
+        chunks.pack     every distinct chunk, back to back
+        chunks.idx      a 32 byte entry per chunk: its 128-bit hash, and
+                        where it sits in the pack
+        manifests/NAME  a save: its size and the index numbers of its
+                        chunks in order
+        dicts/N         a compression dictionary trained on one game's
+                        saves, never changed once chunks refer to it
+
+    Blank 0xFF blocks and the same few blocks repeated across dumps of one
+    game end up costing 4 bytes a time.  New chunks are appended to the pack
+    and synced before the index entries that point at them, and a manifest
+    only appears (by rename) once both are on disk, so a crash at any point
+    leaves an archive that opens cleanly; anything torn off the end of the
+    pack or index is dropped the next time it's opened for writing.  Only
+    one writer at a time, though: opening for writing locks the index until
+    close, so another writer waits rather than appending over it.  Chunks
+    are checked against their hashes as they're restored.
+
+    New chunks can also be compressed, on their own or against the newest
+    dictionary for the card they came from.  A 512 byte chunk has too
+    little in it to compress well by itself, but much of it is usually
+    in a dictionary of what that game's saves have in common.  The top 8
+    bits of an index entry's length say how its chunk is stored.
+*/
+class Archive {
+    public:
+        enum Chunking {
+            FIXED,      // 512 byte blocks, like the card's own
+            CDC         // content-defined, 256 bytes to 8kB
+        };
+
+        enum Compression {
+            STORE,      // chunks as they are
+            LZ,         // each chunk compressed by itself
+            DICTIONARY  // against the card's dictionary, or by itself without one
+        };
+
+        static bool parse_chunking(const std::string &name, Chunking &result);
+        static bool parse_compression(const std::string &name, Compression &result);
+        static bool valid_name(const std::string &name);
+
+        Archive();
+        ~Archive();
+
+        bool open(const std::string &dir, bool writable);
+        bool restore(const std::string &name, std::vector<char> &data);
+
+        // Stores a save as it arrives, nothing is visible until commit()
+        void begin(Chunking chunking, Compression compression = STORE, const std::string &card = "");
+        void append(const char *data, size_t size);
+        bool commit(const std::string &name);
+
+        // A new dictionary for card, used by every save stored after it
+        bool add_dictionary(const std::string &card, const std::vector<char> &data);
+        bool has_dictionary(const std::string &card) const { return latest_dictionary.count(card) > 0; }
+
+        std::string manifest_path(const std::string &name) const;
+        const std::string &error() const { return last_error; }
+
+        // What the last commit() added, bytes_stored after compression
+        size_t chunks_seen, chunks_added;
+        long long bytes_seen, bytes_added, bytes_stored;
+
+    private:
+        static const size_t FIXED_SIZE = 512,
+                            CDC_MIN    = 256,
+                            CDC_MAX    = 8 * 1024;
+
+        // Top 10 bits of the gear hash clear, about one cut per kB
+        static const uint64_t CDC_MASK = 0xFFC0000000000000ull;
+
+        struct ChunkHash {
+            uint64_t lo, hi;
+
+            bool operator==(const ChunkHash &other) const { return lo == other.lo && hi == other.hi; }
+        };
+
+        struct ChunkHashKey {
+            size_t operator()(const ChunkHash &hash) const { return (size_t) hash.lo; }
+        };
+
+        struct IndexEntry {
+            ChunkHash hash;
+            uint64_t offset;
+            uint32_t length;    // in the pack, the top 8 bits are the codec
+            uint32_t check;     // detects an entry torn by a crash
+        };
+
+        // Codecs: STORED, a dictionary number, or PLAIN_LZ
+        static const uint32_t LENGTH_MASK = 0x00FFFFFF,
+                              CODEC_SHIFT = 24,
+                              STORED      = 0,
+                              PLAIN_LZ    = 0xFF;
+
+        struct ManifestHeader {
+            char magic[4];
+            uint32_t version;
+            uint32_t save_size;
+            uint32_t chunks;
+        };
+
+        std::string root;
+        std::string last_error;
+        bool writable;
+        int pack_fd, index_fd;
+        uint64_t pack_size;
+        FileLock writer;       // on the index, while open for writing
+
+        std::vector<IndexEntry> entries;
+        std::unordered_map<ChunkHash, uint32_t, ChunkHashKey> lookup;
+        SaveFile pack;
+
+        std::map<uint32_t, std::unique_ptr<LzDictionary> > dictionaries;
+        std::map<std::string, uint32_t> latest_dictionary;
+        uint32_t highest_dictionary;    // of any file in dicts/, even one that's damaged
+
+        // The save being stored
+        Chunking chunking;
+        Compression compression;
+        std::string card;
+        std::string pending;
+        size_t scanned;
+        uint64_t gear_hash;
+        std::vector<uint32_t> manifest;
+        std::string new_data;
+        std::vector<IndexEntry> new_entries;
+
+        void close();
+        void discard();
+        bool fail(const std::string &message);
+        void cut_at(size_t start, size_t length);
+        void compress_new();
+        void load_dictionaries();
+        static uint32_t entry_check(const IndexEntry &entry);
+};
+
+// Stores a download straight into the archive as it comes off the device
+class ArchiveSink : public PipelineStage {
+    public:
+        ArchiveSink(Archive &archive, const std::string &name, Archive::Chunking chunking,
+                    Archive::Compression compression = Archive::STORE, const std::string &card = "")
+            : archive(archive), name(name) { archive.begin(chunking, compression, card); }
+
+        bool process(PipelineBlock &block);
+        bool finish(bool complete);
+
+    private:
+        Archive &archive;
+        std::string name;
+};
+
+#endif
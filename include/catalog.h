@@ -0,0 +1,123 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "savefile.h"
+
+struct ContainerInfo;
+
+// One dump as the catalog knows it, a fixed 256 bytes on disk
+struct CatalogRecord {
+    enum {
+        CONTAINER   = 1,        // a container, rather than a raw save
+        INCREMENTAL = 2         // a container built on an earlier dump
+    };
+
+    uint64_t created;           // unix time
+    uint64_t header_hash;       // xxh64 of the card's raw header
+    uint64_t save_hash;         // as save_fingerprint() has it
+    uint32_t save_size;
+    uint32_t flags;
+    char card_id[16];
+    char card_title[32];
+    char file[168];             // name within the directory
+    uint32_t reserved;
+    uint32_t check;             // detects a record torn by a crash
+
+    static CatalogRecord describe(const std::string &file, const ContainerInfo &info, uint32_t flags);
+    std::string name() const;
+    std::string id() const;
+    std::string title() const;
+    std::string key() const;    // card ID, or the header hash of a 3DS card
+};
+
+/*
+    A catalog of the dumps in a directory, kept in <dir>/.005catalog so
+    finding the latest dump of a card, or every dump of a title, never
+    means opening the dumps themselves.  The file is a header and then
+    records appended in the order the dumps were made; it's mapped, and
+    the records are indexed by card ID, title and header hash when it's
+    opened, so a lookup is a hash table probe.  Records are in time order,
+    so "latest" is the last match and "since" is a binary search.
+
+    Each download is its own process, so appends are serialized by a lock
+    on the file: one write and one fsync per record, and a rebuild holds
+    the lock until the new catalog is in place.  Each record carries a
+    checksum and anything torn off the end by a crash is dropped.  A
+    record for a file that's already in the catalog replaces the older one.
+*/
+class Catalog {
+    public:
+        static const char *FILE_NAME;
+
+        Catalog();
+        ~Catalog();
+
+        bool open(const std::string &dir, bool writable);
+        bool append(const CatalogRecord &record);
+        bool rebuild(const std::string &dir, unsigned threads);
+
+        size_t size() const { return order.size(); }
+        const CatalogRecord &at(size_t i) const { return record(order[i]); }
+
+        const CatalogRecord *lookup(const std::string &file) const;
+        std::vector<const CatalogRecord *> find(const std::string &key) const;
+        std::vector<const CatalogRecord *> since(uint64_t time) const;
+        const CatalogRecord *latest(const ContainerInfo &card, const std::string &skip) const;
+
+        const std::string &error() const { return last_error; }
+
+    private:
+        std::string root;
+        std::string last_error;
+        SaveFile mapped;
+        size_t mapped_count;
+        std::deque<CatalogRecord> added;
+        int fd;
+
+        // Live records in time order, and the keys into them
+        std::vector<size_t> order;
+        std::unordered_map<std::string, size_t> by_file;
+        std::unordered_multimap<std::string, size_t> by_id, by_title;
+        std::unordered_multimap<uint64_t, size_t> by_header;
+
+        const CatalogRecord &record(size_t i) const;
+        void index(size_t i);
+        void reindex();
+        bool fail(const std::string &message);
+        static uint32_t record_check(const CatalogRecord &record);
+};
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+#include "savefile.h"
+
+/*
+    A save file that says what it is.  Raw .sav dumps lose everything but
+    the bytes; a container also keeps the dongle's firmware, the card's ID,
+    title, type and raw header, and when the dump was taken.
+
+        header          ContainerHeader, then the card's raw header
+        block index     a BlockEntry per BLOCK_SIZE bytes of save
+        blocks          each one a fill byte (a run of 0xFF or 0x00 costs
+                        nothing but its index entry), LZ packed, or stored
+                        as is if packing didn't help
+
+    Every block is packed on its own, so any range of the save can be read
+    by unpacking just the blocks it covers.  Each index entry carries an
+    xxh64 of its block as it was, checked as it's unpacked, and the header
+    an xxh64 over all of those to identify the save as a whole.
+
+    An incremental container names a parent, an earlier dump of the same
+    card in the same directory.  Blocks whose hash matches the parent's are
+    stored as a reference to it, so a daily dump of a save that changed by
+    a few kB costs a few kB.  The chain is cut every REBASE_DEPTH dumps by
+    writing a full image, so reading one back never goes through more than
+    a handful of files.  Removing a dump breaks the dumps built on it,
+    which the parent's recorded hash catches rather than anything going
+    silently wrong.
+*/
+
+// What we know about the dump, the card and the dongle it came from
+struct ContainerInfo {
+    enum CardType {
+        NTR = 0,
+        CTR = 1,
+        UNKNOWN = 0xFF
+    };
+
+    ContainerInfo() : save_size(0), card_type(UNKNOWN), created(0), save_hash(0), parent_hash(0), depth(0) {}
+
+    uint32_t save_size;
+    uint32_t card_type;
+    uint64_t created;           // unix time
+    uint64_t save_hash;         // filled in when the container is written
+    std::string firmware;
+    std::string card_id;
+    std::string card_title;
+    std::vector<char> card_header;
+
+    // Incremental dumps only
+    std::string parent;         // file name, next to this one
+    uint64_t parent_hash;       // its save_hash, in case it's been replaced
+    uint32_t depth;             // parents between this and a full image
+
+    bool same_card(const ContainerInfo &other) const;
+};
+
+class ContainerReader;
+
+// The save_hash a container holding data would have, so raw saves can be compared
+uint64_t save_fingerprint(const char *data, size_t size);
+
+// Writes a container a piece at a time, front to back
+class ContainerWriter {
+    public:
+        ContainerWriter();
+        ~ContainerWriter();
+
+        // Full images are written at least this often in a chain
+        static const uint32_t REBASE_DEPTH = 8;
+
+        bool create(const std::string &path, const ContainerInfo &info);
+        bool set_parent(const std::string &path, const ContainerReader &parent);
+        bool append(const char *data, size_t size);
+        bool finish(bool sync);
+
+        const std::string &error() const { return last_error; }
+        uint64_t stored_size() const { return data_end; }
+        uint32_t blocks_reused() const { return reused; }
+        const ContainerInfo &details() const { return info; }
+
+    private:
+        int fd;
+        ContainerInfo info;
+        std::string target_path, temp_path;
+        std::string last_error;
+        std::vector<char> block, packed;
+        std::vector<char> index;
+        std::vector<uint64_t> hashes, parent_hashes;
+        uint32_t block_count, reused;
+        uint64_t data_start, data_end;
+
+        bool flush_block();
+        bool fail(const std::string &message);
+};
+
+// Reads a container through a mapping, and its parents if it has any
+class ContainerReader {
+    public:
+        static bool is_container(const char *data, size_t size);
+        static bool peek(const std::string &path, ContainerInfo &info);
+        static std::string latest_dump(const std::string &dir, const ContainerInfo &card, const std::string &skip);
+
+        ContainerReader() : base(NULL), length(0), entries(NULL), block_size(0), block_count(0) {}
+
+        bool open(const std::string &path);
+        bool read(size_t offset, size_t length, char *out) const;
+        bool read_all(std::vector<char> &out) const;
+
+        uint32_t blocks() const { return block_count; }
+        uint64_t block_hash(uint32_t block) const;
+
+        const ContainerInfo &details() const { return info; }
+        const std::string &error() const { return last_error; }
+
+    private:
+        SaveFile mapped;
+        std::unique_ptr<ContainerReader> parent;
+        const char *base;
+        size_t length;
+        const char *entries;
+        uint32_t block_size, block_count;
+        ContainerInfo info;
+        mutable std::string last_error;
+
+        bool parse(const char *data, size_t size, bool with_index = true);
+        bool unpack(uint32_t block, char *out) const;
+};
+
+// Packs a download into a container as it comes off the device
+class ContainerSink : public PipelineStage {
+    public:
+        ContainerSink(ContainerWriter &writer, bool sync) : writer(writer), sync(sync) {}
+
+        bool process(PipelineBlock &block);
+        bool finish(bool complete);
+
+    private:
+        ContainerWriter &writer;
+        bool sync;
+};
+
+#endif
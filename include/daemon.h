@@ -0,0 +1,93 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include <string>
+
+/*
+    "005tools daemon" keeps every dongle open and serves requests on a Unix
+    domain socket, so the CMD_STOP/CMD_FIRMWARE/CMD_GET_HEADER handshake is
+    paid once per dongle instead of once per process.
+
+    Everything on the socket is a frame: a little-endian uint32 length,
+    then a one byte type, then length - 1 bytes of payload.  A client sends
+    one request per connection:
+
+        REQ_INFO        uint16 device, uint32 save size (0 uses the detected one)
+        REQ_DOWNLOAD    as above
+        REQ_ERASE       as above
+        REQ_UPLOAD      as above, followed by the save image
+        REQ_VERIFY      as above, followed by the image to compare against
+        REQ_CHECKSUM    as above, followed by a uint8 SaveDigest::Algorithm
+
+    and the daemon answers with any number of frames, the last of which is
+    always RSP_DONE or RSP_ERROR:
+
+        RSP_INFO        the card the request ran against, see encode_info()
+        RSP_START       uint32 bytes the operation covers
+        RSP_DATA        the next part of a download
+        RSP_PROGRESS    uint32 bytes done so far, for everything but downloads
+        RSP_DIGEST      the checksum asked for, then the save's fingerprint, as
+                        uint16-prefixed hex strings
+        RSP_DONE        uint8 success, then a message if it failed
+        RSP_ERROR       a message, the request never ran
+
+    Info is answered straight from the header the daemon last read; every
+    other request waits in that dongle's queue behind the ones before it.
+*/
+static const uint8_t
+    REQ_INFO     = 'I',
+    REQ_DOWNLOAD = 'D',
+    REQ_UPLOAD   = 'U',
+    REQ_ERASE    = 'E',
+    REQ_VERIFY   = 'V',
+    REQ_CHECKSUM = 'H',
+
+    RSP_INFO     = 'i',
+    RSP_START    = 's',
+    RSP_DATA     = 'd',
+    RSP_PROGRESS = 'p',
+    RSP_DIGEST   = 'h',
+    RSP_DONE     = 'k',
+    RSP_ERROR    = 'e';
+
+// What a checksum request asks for, and what came back
+struct ClientDigest {
+    uint8_t algorithm;
+    std::string digest;
+    uint64_t fingerprint;
+    int save_size;
+};
+
+std::string default_socket_path();
+bool run_daemon(const std::string &socket_path);
+bool run_client(const std::string &socket_path, uint8_t request, const std::string &filename,
+                int device, int save_size, ClientDigest *checksum = NULL);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FDSTREAM_H
+#define FDSTREAM_H
+
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #include <fcntl.h>
+#endif
+
+/*
+    Streams over file descriptors that can't seek, so a save can go to or
+    come from a pipe.  Both buffer in large chunks, so a 512 byte block
+    from the device never turns into a 512 byte syscall.
+*/
+
+// An std::ostream writing to a descriptor through a 64kB buffer
+class ofdbuf : public std::streambuf {
+    public:
+        ofdbuf(int fd) : fd(fd), flushed(0), buffer(BUFFER_SIZE) {
+#ifdef _WIN32
+            _setmode(fd, _O_BINARY);
+#endif
+            setp(&buffer[0], &buffer[0] + buffer.size());
+        }
+
+        ~ofdbuf() { sync(); }
+
+    protected:
+        int_type overflow(int_type c) {
+            if (!drain())
+                return traits_type::eof();
+
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+
+            return traits_type::not_eof(c);
+        }
+
+        int sync() { return drain() ? 0 : -1; }
+
+        // Only reports the position, which is all dev->read() asks for
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+            if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out))
+                return pos_type(off_type(-1));
+
+            return pos_type(off_type(flushed + (pptr() - pbase())));
+        }
+
+    private:
+        static const size_t BUFFER_SIZE = 64 * 1024;
+
+        int fd;
+        long long flushed;
+        std::vector<char> buffer;
+
+        bool drain() {
+            const char *p = pbase();
+
+            while (p < pptr()) {
+                ssize_t n = ::write(fd, p, pptr() - p);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+
+                p += n;
+            }
+
+            flushed += pptr() - pbase();
+            setp(&buffer[0], &buffer[0] + buffer.size());
+            return true;
+        }
+};
+
+class ofdstream : private ofdbuf, public std::ostream {
+    public:
+        ofdstream(int fd)
+            : ofdbuf(fd),
+              std::ostream(static_cast<std::streambuf *>(this)) {}
+};
+
+/*
+    An std::istream reading a descriptor front to back, size being how long
+    the stream will be if it's known (-1 if not) so seeking to the end works.
+    Writing a 3DS card goes back over its first 16kB once the rest is
+    written, and a failed block is re-sent from its start, so this keeps
+    the first head_size bytes and the tail of the previous chunk around;
+    anything else behind the read position is gone.  Chunks come from
+    fetch(), which a subclass can take over to read from something other
+    than fd.
+*/
+class ipipebuf : public std::streambuf {
+    public:
+        ipipebuf(int fd, long long size = -1, size_t head_size = 16 * 1024)
+            : fd(fd), size(size), head_size(head_size), consumed(0), window_start(0), in_head(false) {
+#ifdef _WIN32
+            if (fd >= 0)
+                _setmode(fd, _O_BINARY);
+#endif
+            window.resize(KEEP_SIZE + CHUNK_SIZE);
+            setg(&window[0], &window[0], &window[0]);
+        }
+
+    protected:
+        virtual ssize_t fetch(char *buf, size_t max) {
+            ssize_t n;
+            do
+                n = ::read(fd, buf, max);
+            while (n < 0 && errno == EINTR);
+
+            return n;
+        }
+
+        int_type underflow() {
+            // Reading on from the end of the kept head picks up the pipe again
+            if (in_head) {
+                if (consumed != (long long) head.size())
+                    return traits_type::eof();
+
+                in_head = false;
+                window_start = consumed;
+                setg(&window[0], &window[0], &window[0]);
+            }
+
+            if (gptr() < egptr())
+                return traits_type::to_int_type(*gptr());
+
+            // Hold on to the end of this chunk so a block can be re-read
+            size_t used = egptr() - eback();
+            size_t keep = std::min(used, (size_t) KEEP_SIZE);
+            memmove(&window[0], egptr() - keep, keep);
+            window_start += used - keep;
+
+            ssize_t n = fetch(&window[keep], CHUNK_SIZE);
+            if (n <= 0) {
+                setg(&window[0], &window[0] + keep, &window[0] + keep);
+                return traits_type::eof();
+            }
+
+            if (consumed < (long long) head_size) {
+                size_t take = std::min<long long>(n, head_size - consumed);
+                head.insert(head.end(), &window[keep], &window[keep] + take);
+            }
+
+            consumed += n;
+            setg(&window[0], &window[0] + keep, &window[0] + keep + n);
+            return traits_type::to_int_type(*gptr());
+        }
+
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+            if (!(which & std::ios_base::in) || (dir == std::ios_base::end && size < 0))
+                return pos_type(off_type(-1));
+
+            off_type current = (in_head ? 0 : window_start) + (gptr() - eback());
+            if (off == 0 && dir == std::ios_base::cur)
+                return pos_type(current);
+
+            off_type pos = off + (dir == std::ios_base::beg ? 0 : dir == std::ios_base::end ? size : current);
+
+            return seekpos(pos_type(pos), which);
+        }
+
+        pos_type seekpos(pos_type sp, std::ios_base::openmode which) {
+            off_type pos = sp;
+
+            if (!(which & std::ios_base::in) || pos < 0 || (size >= 0 && pos > size))
+                return pos_type(off_type(-1));
+
+            // Still inside the current chunk (or the bit kept from the last one)
+            if (!in_head && pos >= window_start && pos <= window_start + (egptr() - eback())) {
+                setg(eback(), eback() + (pos - window_start), egptr());
+                return sp;
+            }
+
+            if (pos <= (off_type) head.size() && !head.empty()) {
+                in_head = true;
+                setg(&head[0], &head[0] + pos, &head[0] + head.size());
+                return sp;
+            }
+
+            // The end is only reachable once everything has been read anyway
+            if (pos == consumed && pos == size) {
+                in_head = false;
+                window_start = pos;
+                setg(&window[0], &window[0], &window[0]);
+                return sp;
+            }
+
+            return pos_type(off_type(-1));
+        }
+
+    private:
+        static const size_t CHUNK_SIZE = 64 * 1024, KEEP_SIZE = 4 * 1024;
+
+        int fd;
+        long long size;
+        size_t head_size;
+        long long consumed;         // bytes taken from the descriptor so far
+        long long window_start;     // stream position of window[0]
+        bool in_head;               // reading from head rather than window
+
+        std::vector<char> window, head;
+};
+
+class ipipestream : private ipipebuf, public std::istream {
+    public:
+        ipipestream(int fd, long long size = -1)
+            : ipipebuf(fd, size),
+              std::istream(static_cast<std::streambuf *>(this)) {}
+};
+
+#endif
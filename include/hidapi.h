@@ -39,6 +39,11 @@
 
 #define HID_API_EXPORT_CALL HID_API_EXPORT HID_API_CALL /**< API export and call macro*/
 
+/** Returned instead of a byte count when the device was disconnected
+    and has been reopened under the reconnect policy, see
+    hid_set_reconnect(). Nothing was transferred by the call. */
+#define HID_RECONNECTED -2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -78,6 +83,14 @@ extern "C" {
 			struct hid_device_info *next;
 		};
 
+		/** A Vendor ID/Product ID pair, see hid_enumerate_ids() */
+		struct hid_device_id {
+			/** Device Vendor ID */
+			unsigned short vendor_id;
+			/** Device Product ID */
+			unsigned short product_id;
+		};
+
 
 		/** @brief Initialize the HIDAPI library.
 
@@ -129,6 +142,25 @@ extern "C" {
 		*/
 		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
+		/** @brief Enumerate the HID Devices matching any of several IDs.
+
+			This function works like hid_enumerate(), but matches each
+			device against every entry of @p ids during the same pass,
+			so looking for several types of device costs no more than
+			looking for one.
+
+			@ingroup API
+			@param ids An array of VID/PID pairs to match.
+			@param count The number of entries in @p ids.
+
+		    @returns
+		    	This function returns a pointer to a linked list of type
+		    	struct #hid_device, containing information about the HID devices
+		    	attached to the system, or NULL in the case of failure. Free
+		    	this linked list by calling hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ids(const struct hid_device_id *ids, size_t count);
+
 		/** @brief Free an enumeration Linked List
 
 		    This function frees a linked list created by hid_enumerate().
@@ -315,6 +347,30 @@ extern "C" {
 		*/
 		void HID_API_EXPORT HID_API_CALL hid_close(hid_device *device);
 
+		/** @brief Set the reconnect policy for a device.
+
+			By default a device which is disconnected stays that way,
+			and every later call on it fails. With a reconnect policy,
+			the call which notices the disconnect instead waits up to
+			@p timeout_ms milliseconds for the device to come back (by
+			serial number if it has one, otherwise at the same path),
+			reopens it and returns #HID_RECONNECTED. Whatever command
+			was in progress has been lost and should be sent again.
+
+			Reconnecting happens on the calling thread, so the device
+			must not be used from several threads at once.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param timeout_ms How long to wait for the device to come
+				back, or 0 to disable reconnecting.
+
+			@returns
+				This function returns 0 on success and -1 if
+				reconnecting isn't supported on this platform.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_reconnect(hid_device *device, int timeout_ms);
+
 		/** @brief Get The Manufacturer String from a HID device.
 
 			@ingroup API
@@ -0,0 +1,97 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <string>
+
+class HIDDevice;
+class SaveFile;
+
+/*
+    A sidecar file (<filename>.journal) recording which ranges of a transfer
+    have completed.  Ranges are collected in memory and committed in batches:
+    the range of the output file is synced first, then it is appended to the
+    journal and that is synced too, so a committed range is always on disk.
+    With a weaker --fsync policy neither sync happens and the journal is only
+    as good as the OS cache.  If the transfer is interrupted, --resume picks
+    up from the last commit.
+*/
+class TransferJournal {
+    public:
+        static const char
+            DOWNLOAD = 'D',
+            UPLOAD   = 'U';
+
+        TransferJournal(const std::string &target, char op, const HIDDevice *dev);
+        ~TransferJournal();
+
+        bool begin();
+        bool resume(int &pass, int &offset);
+        void attach(SaveFile &data);
+        void complete(int pass, int end);
+        void commit();
+        void finish();
+
+        const std::string &path() const { return journal_path; }
+
+    private:
+        // Commit after this many bytes have been transferred
+        static const int COMMIT_BYTES = 32 * 1024;
+
+        struct Header {
+            char magic[4];
+            uint32_t version;
+            uint32_t op;
+            uint32_t save_size;
+            uint32_t fingerprint;
+        };
+
+        struct Record {
+            uint32_t pass;
+            uint32_t start;
+            uint32_t end;
+            uint32_t check;     // detects a record torn by a crash
+        };
+
+        std::string target_path;
+        std::string journal_path;
+        Header header;
+        SaveFile *data;
+        int fd;
+
+        int pass;
+        int committed;
+        int pending;
+        int written_pass;
+
+        static uint32_t record_check(const Record &);
+        bool append(const void *, size_t);
+};
+
+#endif
@@ -26,6 +26,7 @@
 
 #include <string>
 #include <cstring>
+#include <stdint.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
@@ -35,6 +36,7 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <atomic>
 
 #include "hidapi.h"
 
@@ -51,12 +53,17 @@ typedef std::vector<char> buffer_t;
 
 class HIDDevice {
     public:
+        HIDDevice() : device(NULL), found(false), has_card(false), io_error(false),
+                      card_size(0), save_size(0), timeout_ms(1000), retry_limit(3),
+                      timeouts(0), retries(0), reconnects(0) {}
+
         hid_device *device;
         buffer_t firmware_data;
         std::string name;
         std::string version;
         bool found;
         bool has_card;
+        bool io_error;
 
         buffer_t card_header;
         std::string card_title;
@@ -64,11 +71,166 @@ class HIDDevice {
         int card_size;
         int save_size;
 
+        // How long a command may take, and how often a failed one is tried again
+        int timeout_ms;
+        int retry_limit;
+
+        // Commands that timed out, blocks that were retried and USB disconnects survived
+        int timeouts;
+        int retries;
+        int reconnects;
+
         virtual void read(std::ostream &, int = -1)=0;
         virtual void write(std::istream &, int = -1)=0;
         virtual ~HIDDevice() {}
+
+        // Devices that write cards in more than one pass report which one they're in,
+        // and can be told to pick up part way through a pass
+        virtual int write_pass() { return 0; }
+        virtual void resume_write(int) {}
+
+        // Asks for the card header again and returns true if a different card
+        // is in now, in which case the card details above have been updated
+        virtual bool refresh_card() { return false; }
+};
+
+// Requested by the SIGINT handler and checked between blocks, so a transfer can stop cleanly
+class CancelToken {
+    private:
+        std::atomic<bool> flag;
+
+    public:
+        CancelToken() : flag(false) {}
+        void request() { flag = true; }
+        bool requested() const { return flag; }
+};
+
+/*
+    Each HIDDevice class describes itself with one of these and main.cpp keeps
+    a constant table of them. A single hid_enumerate_ids() pass is matched
+    against the whole table, so supporting another adapter never costs
+    another bus scan or open attempt.
+*/
+struct HIDDriver {
+    const char *name;
+    hid_device_id id;
+    HIDDevice *(*create)(const char *path);
+};
+
+// An attached device and the driver that knows how to talk to it
+struct HIDMatch {
+    const HIDDriver *driver;
+    std::string path;
+};
+
+// Functions in main.cpp
+extern CancelToken cancel_token;
+extern int stdout_fd;
+std::vector<HIDMatch> probe_devices();
+bool configure_device(HIDDevice *device);
+
+// Functions in compare.cpp
+size_t first_difference(const char *a, const char *b, size_t size);
+size_t last_difference(const char *a, const char *b, size_t size);
+
+// A run of bytes two images differ in, end is one past the last
+struct DiffRange {
+    size_t start, end;
+};
+
+size_t diff_blocks(const char *a, const char *b, size_t size, size_t block, std::vector<DiffRange> &ranges);
+
+// Functions in hash.cpp
+uint64_t xxh64(const void *data, size_t size, uint64_t seed = 0);
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+// Hashes a save as it streams past, so it never has to be held or written out
+class SaveDigest {
+    public:
+        enum Algorithm {
+            FINGERPRINT,    // what save_fingerprint() gives, and the catalog keeps
+            SHA256
+        };
+
+        static bool parse(const std::string &name, Algorithm &algorithm);
+
+        SaveDigest(Algorithm algorithm);
+        void update(const char *data, size_t size);
+        std::string finish();
+        uint64_t fingerprint() const { return result; }
+
+    private:
+        Algorithm algorithm;
+        std::vector<char> pending;          // a part block of either hash
+        std::vector<uint64_t> hashes;       // per block, for the fingerprint
+        uint32_t state[8];
+        uint64_t length, result;
+
+        void consume(const char *block);
+        void sha256_block(const unsigned char *block);
+};
+
+// Functions in lz.cpp
+struct LzDictionary {
+    std::vector<char> data;         // up to 64kB, as if it came just before the data
+    std::vector<uint32_t> table;    // filled in by lz_prepare()
 };
 
+struct LzSample {
+    const char *data;
+    size_t size;
+};
+
+void lz_prepare(LzDictionary &dict);
+void lz_train(const std::vector<LzSample> &samples, size_t capacity, LzDictionary &dict);
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity, const LzDictionary *dict = NULL);
+bool lz_decompress(const char *src, size_t length, char *dst, size_t size, const LzDictionary *dict = NULL);
+
 // Functions in tools.cpp
-void chunk_data(std::istream data);
-std::string get_key();
+class KeyFinder {
+    public:
+        static const size_t CHUNK_SIZE = 0x200;
+
+        KeyFinder();
+        void chunk_data(const char *data, size_t size);
+        void chunk_data(std::istream &data);
+        bool get_key(std::string &key, size_t *count = NULL) const;
+
+        size_t chunks() const { return seen; }
+        size_t blank_chunks() const { return blank; }
+
+    private:
+        // A distinct chunk, found by its 128-bit hash; 0 in count is an empty slot
+        struct Slot {
+            uint64_t hash[2];
+            uint32_t count;
+            uint32_t sample;    // where in samples its bytes are
+        };
+
+        std::vector<Slot> slots;
+        std::vector<char> samples;
+        std::vector<char> pending;
+        size_t used, seen, blank, best;
+
+        void add_chunk(const char *chunk);
+        void grow();
+};
+
+void apply_pad(char *data, size_t size, const char *pad, size_t offset);
+
+// Keys found in earlier saves, one file per card under dir
+class PadCache {
+    public:
+        PadCache(const std::string &dir = default_dir()) : dir(dir) {}
+
+        bool find(const std::string &card, std::string &pad);
+        bool store(const std::string &card, const std::string &pad);
+
+        static std::string default_dir();
+
+    private:
+        std::string dir;
+        std::map<std::string, std::string> loaded;
+
+        std::string path_for(const std::string &card) const;
+};
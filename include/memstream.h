@@ -0,0 +1,100 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MEMSTREAM_H
+#define MEMSTREAM_H
+
+#include <istream>
+#include <ostream>
+#include <streambuf>
+
+/*
+    A stream buffer over a block of memory that we don't own.  Unlike
+    std::stringstream this doesn't copy the data, so any number of streams
+    can read the same save image at once, each with its own position, and
+    the device can read straight into a buffer we've already allocated.
+*/
+class membuf : public std::streambuf {
+    public:
+        membuf(char *data, size_t size, std::ios_base::openmode mode) {
+            if (mode & std::ios_base::in)
+                setg(data, data, data + size);
+            if (mode & std::ios_base::out)
+                setp(data, data + size);
+        }
+
+    protected:
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+            off_type pos = -1;
+
+            if (which & std::ios_base::in && eback()) {
+                pos = off + (dir == std::ios_base::beg ? 0
+                          : dir == std::ios_base::end ? egptr() - eback()
+                          : gptr() - eback());
+
+                if (pos < 0 || pos > egptr() - eback())
+                    return pos_type(off_type(-1));
+
+                setg(eback(), eback() + pos, egptr());
+            }
+
+            if (which & std::ios_base::out && pbase()) {
+                pos = off + (dir == std::ios_base::beg ? 0
+                          : dir == std::ios_base::end ? epptr() - pbase()
+                          : pptr() - pbase());
+
+                if (pos < 0 || pos > epptr() - pbase())
+                    return pos_type(off_type(-1));
+
+                setp(pbase(), epptr());
+                pbump(int(pos));
+            }
+
+            return pos_type(pos);
+        }
+
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+            return seekoff(off_type(pos), std::ios_base::beg, which);
+        }
+};
+
+// An std::istream that reads straight from memory via membuf
+class imemstream : private membuf, public std::istream {
+    public:
+        imemstream(const char *data, size_t size)
+            : membuf(const_cast<char *>(data), size, std::ios_base::in),
+              std::istream(static_cast<std::streambuf *>(this)) {}
+};
+
+// An std::ostream that writes straight into memory via membuf, failing past the end
+class omemstream : private membuf, public std::ostream {
+    public:
+        omemstream(char *data, size_t size)
+            : membuf(data, size, std::ios_base::out),
+              std::ostream(static_cast<std::streambuf *>(this)) {}
+};
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fdstream.h"
+
+class SaveFile;
+class TransferJournal;
+
+/*
+    A single producer, single consumer queue with room for N items.  Each
+    end only ever writes its own index, so neither side takes a lock; the
+    two indices sit on separate cache lines so they don't fight over one.
+*/
+template <typename T, size_t N>
+class RingQueue {
+    public:
+        RingQueue() : head(0), tail(0) {}
+
+        bool push(const T &item) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == N)
+                return false;
+
+            slots[t % N] = item;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &item) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+
+            item = slots[h % N];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        // Padded out to a cache line each (new can't do alignas before C++17)
+        std::atomic<size_t> head;
+        char head_pad[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+        char tail_pad[64 - sizeof(std::atomic<size_t>)];
+        T slots[N];
+};
+
+// Calls work(i) for every i below count, spread over up to threads threads
+void run_parallel(size_t count, unsigned threads, const std::function<void(size_t)> &work);
+
+// A chunk of save data on its way through a Pipeline
+struct PipelineBlock {
+    static const size_t SIZE = 64 * 1024;
+
+    long long offset;   // where data[0] belongs in the save
+    size_t length;      // 0 from a source means there's nothing left
+    char data[SIZE];
+};
+
+/*
+    One step a block goes through, run on its own thread.  process() sees
+    every block in save order; finish() is called once at the end with
+    whether the whole transfer made it.  A stage that fails says why in
+    failure and the pipeline stops handing anything to any stage.
+*/
+class PipelineStage {
+    public:
+        virtual ~PipelineStage() {}
+
+        virtual bool process(PipelineBlock &block) = 0;
+        virtual bool finish(bool complete) { return true; }
+
+        std::string failure;
+};
+
+/*
+    Overlaps the device with everything else that happens to the data.
+
+    A fixed set of blocks goes round a ring: the caller hands a block to
+    the first stage with submit(), each stage passes it on to the next
+    over a RingQueue, and the last stage hands it back to be picked up
+    with acquire().  Nothing is allocated once it starts, and with enough
+    blocks in the ring the device thread never waits on a slow stage.
+
+    Downloads start with every block on the caller's side: the device
+    fills one, submits it, and stages hash, compress or write it out.
+    Uploads run the other way round: the caller submits empty blocks, a
+    source stage fills them ahead of time, later stages decode them, and
+    the device writes out of what acquire() returns (see PipelineReader).
+*/
+class Pipeline {
+    public:
+        enum Direction {
+            DOWNLOAD,   // the caller fills blocks
+            UPLOAD      // the stages fill blocks
+        };
+
+        Pipeline(Direction direction);
+        ~Pipeline();
+
+        void add(PipelineStage *stage);
+        void start();
+
+        PipelineBlock *acquire();
+        void submit(PipelineBlock *block);
+        bool finish(bool complete);
+
+        bool failed() const { return error.load(std::memory_order_acquire); }
+        std::string failure() const;
+
+    private:
+        static const size_t BLOCKS = 16;
+
+        // Room for every block plus the end marker, so a push never fails
+        typedef RingQueue<PipelineBlock *, BLOCKS + 1> Queue;
+
+        Direction direction;
+        std::vector<PipelineBlock> blocks;
+        std::vector<PipelineStage *> stages;
+        std::vector<Queue *> queues;    // queues[i] feeds stages[i], the last one the caller
+        std::vector<std::thread> workers;
+        std::atomic<bool> error;
+        std::atomic<bool> completed;
+        bool running;
+
+        void run_stage(size_t index);
+};
+
+// Writes each block into a mapped download target, journaling as it goes
+class SaveFileSink : public PipelineStage {
+    public:
+        SaveFileSink(SaveFile &file, TransferJournal *journal = NULL, int pass = 0)
+            : file(file), journal(journal), pass(pass) {}
+
+        bool process(PipelineBlock &block);
+        bool finish(bool complete);
+
+    private:
+        SaveFile &file;
+        TransferJournal *journal;
+        int pass;
+};
+
+// Writes each block to a stream, stdout for one
+class StreamSink : public PipelineStage {
+    public:
+        StreamSink(std::ostream &out, const std::string &name) : out(out), name(name) {}
+
+        bool process(PipelineBlock &block);
+        bool finish(bool complete);
+
+    private:
+        std::ostream &out;
+        std::string name;
+};
+
+// Fills blocks from a descriptor until size bytes or the end of it
+class FdSource : public PipelineStage {
+    public:
+        FdSource(int fd, long long size = -1) : fd(fd), size(size), done(0) {}
+
+        bool process(PipelineBlock &block);
+
+    private:
+        int fd;
+        long long size;
+        long long done;
+};
+
+/*
+    The device end of an upload Pipeline, an std::istream over the blocks
+    it fills.  Built on ipipebuf, so it keeps the same head and re-read
+    window a 3DS write needs.
+*/
+class PipelineReader : private ipipebuf, public std::istream {
+    public:
+        PipelineReader(Pipeline &pipeline, long long size = -1)
+            : ipipebuf(-1, size),
+              std::istream(static_cast<std::streambuf *>(this)),
+              pipeline(pipeline), block(NULL), used(0), ended(false) {}
+
+        ~PipelineReader();
+
+    protected:
+        ssize_t fetch(char *buf, size_t max);
+
+    private:
+        Pipeline &pipeline;
+        PipelineBlock *block;
+        size_t used;
+        bool ended;
+};
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+    Draws transfer progress from its own thread.  The transfer loop only
+    stores how far it has got in an atomic counter, the renderer samples
+    that a few times a second, so a 512 byte block costs nothing more than
+    the store however slow the terminal (or whatever is reading us) is.
+
+    Throughput and ETA come from the samples of the last few seconds rather
+    than the whole transfer, so they settle quickly after a stall or retry.
+*/
+class ProgressRenderer {
+    public:
+        enum Style {
+            BAR,    // progress bar on stdout
+            JSONL,  // one JSON object per line on a file descriptor
+            NONE
+        };
+
+        static bool parse_style(const std::string &name, Style &style);
+        static void configure(Style style, int fd);
+        static Style current_style() { return style; }
+
+        ProgressRenderer(const char *op, long long total, long long start = 0);
+        ~ProgressRenderer();
+
+        void update(long long done) { bytes.store(done, std::memory_order_relaxed); }
+        void finish(const char *status);
+
+    private:
+        // How often each style redraws
+        static const int BAR_INTERVAL_MS   = 100;
+        static const int JSONL_INTERVAL_MS = 500;
+
+        // Samples older than this don't count towards the throughput
+        static const int RATE_WINDOW_MS = 3000;
+
+        typedef std::chrono::steady_clock clock;
+
+        // Set once from the command line, shared by every transfer
+        static Style style;
+        static int fd;
+
+        struct Sample {
+            clock::time_point time;
+            long long bytes;
+        };
+
+        std::string op;
+        long long total, start;
+
+        std::atomic<long long> bytes;
+        std::deque<Sample> samples;
+        clock::time_point started;
+
+        std::thread renderer;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping, finished;
+
+        void run();
+        void render(const char *status);
+        void emit(const char *line, size_t len);
+};
+
+#endif
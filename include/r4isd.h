@@ -31,6 +31,7 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <chrono>
 
 /*
     Our class extends the generic class, so we can create other classes for other devices
@@ -55,7 +56,7 @@ class R4iSaveDongle : public HIDDevice {
             CMD_DESCRIBE_CARD_REPORTS    = 0;
 
         // Reports that are sent to the HID device
-        static unsigned char
+        static const unsigned char
             CMD_FIRMWARE[REPORT_SIZE],          // Get information aboute the R4i's firmware
             CMD_GET_HEADER[REPORT_SIZE],        // Get current ROM headers
             CMD_START_TRANSFER[REPORT_SIZE],    // Initiate save extraction process
@@ -65,6 +66,14 @@ class R4iSaveDongle : public HIDDevice {
             CMD_WRITE_LARGE_DATA[REPORT_SIZE],  // For saves > 64kB
             CMD_DESCRIBE_CARD[REPORT_SIZE];     // Tell R4i how to write to the card
 
+        /* Our own copies of the reports that get patched before sending, so that
+           several dongles can be driven from different threads at once */
+        unsigned char
+            cmd_read_data[REPORT_SIZE],
+            cmd_write_data[REPORT_SIZE],
+            cmd_write_large_data[REPORT_SIZE],
+            cmd_describe_card[REPORT_SIZE];
+
         /* The firmware version is repeated 3 times in the response,
            R4iSaveDongle.exe (v1.5) checks to see if all 3 bytes are the same */
         struct FirmwareReport {
@@ -116,22 +125,34 @@ class R4iSaveDongle : public HIDDevice {
             first_pass;
         bool
             in_transfer_mode,
-            nds_block_we_flag;
+            nds_block_we_flag,
+            failed;             // the last command timed out, failed or was lost to a reconnect
 
-        buffer_t send_command(unsigned char*, int);
+        buffer_t send_command(const unsigned char*, int);
+        buffer_t command(const unsigned char*, int);
         int detect_save_size();
+        void parse_header();
+        void start_transfer();
         void transfer_init();
         void transfer_end();
+        void resync();
+        void recover();
 
     public:
-        R4iSaveDongle();
+        static const HIDDriver driver;
+        static HIDDevice *create(const char *path) { return new R4iSaveDongle(path); }
+
+        R4iSaveDongle(const char * = NULL);
         ~R4iSaveDongle();
         void read(std::ostream &, int);
         void write(std::istream &, int);
+        int write_pass();
+        void resume_write(int);
+        bool refresh_card();
 };
 
 // Initialize the teports that are sent to the HID device
-unsigned char
+const unsigned char
     R4iSaveDongle::CMD_FIRMWARE[REPORT_SIZE] = { 0xa0, 0x00, 0x00 },
     R4iSaveDongle::CMD_GET_HEADER[REPORT_SIZE] = { 0x22, 0x22, 0x00 },
     R4iSaveDongle::CMD_START_TRANSFER[REPORT_SIZE] = { 0x11, 0x11 },
@@ -141,6 +162,9 @@ unsigned char
     R4iSaveDongle::CMD_WRITE_LARGE_DATA[REPORT_SIZE] = { 0x64, 0x64, 0x00, 0x00 },
     R4iSaveDongle::CMD_DESCRIBE_CARD[REPORT_SIZE] = { 0x66, 0x66, 0x00, 0x00 , 0x00, 0x00, 0x00 };
 
+// How probe_devices() recognises the dongle
+const HIDDriver R4iSaveDongle::driver = { "R4i Save Dongle", { VID_R4I, PID_R4I }, R4iSaveDongle::create };
+
 
 /* +--------------------------------------------------------------------+
  *
@@ -150,23 +174,35 @@ unsigned char
  * +--------------------------------------------------------------------+ */
 R4iSaveDongle::~R4iSaveDongle() {
 /* +--------------------------------------------------------------------+ */
+    if (device == NULL)
+        return;
+
     // Make sure the device clears any reports
     send_command(CMD_STOP, CMD_STOP_REPORTS);
+    hid_close(device);
 }
 
+
 /* +--------------------------------------------------------------------+
  *
  * R4iSaveDongle()
  * The main constructor for the class, does all the initialisation
  *
  * +--------------------------------------------------------------------+ */
-R4iSaveDongle::R4iSaveDongle() {
+R4iSaveDongle::R4iSaveDongle(const char *path) {
 /* +--------------------------------------------------------------------+ */
     buffer_t response;
     in_transfer_mode = false;
+    nds_block_we_flag = false;
+    failed = false;
 
-    // Get a handle on the dongle
-    device = hid_open(VID_R4I, PID_R4I, NULL);
+    memcpy(cmd_read_data, CMD_READ_DATA, REPORT_SIZE);
+    memcpy(cmd_write_data, CMD_WRITE_DATA, REPORT_SIZE);
+    memcpy(cmd_write_large_data, CMD_WRITE_LARGE_DATA, REPORT_SIZE);
+    memcpy(cmd_describe_card, CMD_DESCRIBE_CARD, REPORT_SIZE);
+
+    // Get a handle on the dongle, either a specific one or the first we find
+    device = path ? hid_open_path(path) : hid_open(VID_R4I, PID_R4I, NULL);
     name = "R4i Save Dongle";
 
     if (device == NULL) {
@@ -177,10 +213,10 @@ R4iSaveDongle::R4iSaveDongle() {
     has_card = false;
 
     // Clear any crap that may have been left on the device from before
-    send_command(CMD_STOP, CMD_STOP_REPORTS);
+    command(CMD_STOP, CMD_STOP_REPORTS);
 
     // Get information about the device's firmware
-    firmware_data = send_command(CMD_FIRMWARE, CMD_FIRMWARE_REPORTS);
+    firmware_data = command(CMD_FIRMWARE, CMD_FIRMWARE_REPORTS);
     FirmwareReport *dev = reinterpret_cast<FirmwareReport *>(&firmware_data[0]);
 
     // All 3 reports for firmware info describe the firmware version and should be equal
@@ -196,9 +232,28 @@ R4iSaveDongle::R4iSaveDongle() {
     else // Not sure this will ever happen, but the R4i software has something similar
         version = -1;
 
-    card_header = send_command(CMD_GET_HEADER, CMD_GET_HEADER_REPORTS);
+    card_header = command(CMD_GET_HEADER, CMD_GET_HEADER_REPORTS);
+    parse_header();
+
+//    nds_block_we_flag = true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * void parse_header ()
+ * Works out what card is inserted from card_header
+ *
+ * +--------------------------------------------------------------------+ */
+void R4iSaveDongle::parse_header() {
+/* +--------------------------------------------------------------------+ */
     CardInfo *info = reinterpret_cast<CardInfo *>(&card_header[0]);
 
+    has_card = false;
+    card_id.clear();
+    card_title.clear();
+    card_size = 0;
+    save_size = 0;
+
     if (info->title[0] == 0 && info->save_desc1 == 0)
         return;
 
@@ -227,8 +282,27 @@ R4iSaveDongle::R4iSaveDongle() {
             // We have to do it the old fasioned way (not currently working)
             save_size = 0;//detect_save_size();
     }
+}
 
-//    nds_block_we_flag = true;
+/* +--------------------------------------------------------------------+
+ *
+ * bool refresh_card ()
+ * Fetches the card header again, re-parsing it only if the card changed
+ *
+ * +--------------------------------------------------------------------+ */
+bool R4iSaveDongle::refresh_card() {
+/* +--------------------------------------------------------------------+ */
+    // The SD won't describe the card while it's in transfer mode
+    transfer_end();
+
+    buffer_t header = command(CMD_GET_HEADER, CMD_GET_HEADER_REPORTS);
+    if (io_error || header == card_header)
+        return false;
+
+    card_header = header;
+    parse_header();
+
+    return true;
 }
 
 /* +--------------------------------------------------------------------+
@@ -237,7 +311,7 @@ R4iSaveDongle::R4iSaveDongle() {
  * Issues a command to the R4i dongle, and returns any reports generated
  *
  * +--------------------------------------------------------------------+ */
-buffer_t R4iSaveDongle::send_command(unsigned char *cmd, int reports) {
+buffer_t R4iSaveDongle::send_command(const unsigned char *cmd, int reports) {
 /* +--------------------------------------------------------------------+ */
     HIDReport inrep = { 0x00 }, outrep;
     buffer_t retbuf;
@@ -246,17 +320,76 @@ buffer_t R4iSaveDongle::send_command(unsigned char *cmd, int reports) {
     // First byte of the report is always 0x00 for us (the report id)
     memcpy(&inrep.data[0], &cmd[0], REPORT_SIZE);
 
-    hid_write(device, &inrep.reportID, sizeof(inrep));
+    int res = hid_write(device, &inrep.reportID, sizeof(inrep));
+
+    // Every report has to arrive before the command's deadline
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
 
     int i = 0;
-    while (i++ < reports) {
-        hid_read(device, &outrep.data[0], sizeof(outrep.data));
+    while (res >= 0 && i++ < reports) {
+        int wait = -1;
+        if (timeout_ms > 0) {
+            wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            wait = wait > 0 ? wait : 1;
+        }
+
+        res = hid_read_timeout(device, &outrep.data[0], sizeof(outrep.data), wait);
+        if (res == 0) {
+            timeouts++;
+            break;
+        }
+
         retbuf.insert(retbuf.end(), outrep.data, outrep.data+sizeof(outrep.data));
     }
 
+    // The dongle was unplugged and came back, whatever we sent is lost
+    if (res == HID_RECONNECTED)
+        reconnects++;
+
+    // Callers can always rely on getting as many reports as they asked for
+    if (res <= 0) {
+        failed = true;
+        retbuf.resize(REPORT_SIZE * reports, 0);
+    }
+
     return retbuf;
 }
 
+/* +--------------------------------------------------------------------+
+ *
+ * (buffer_t) command()
+ * Issues a command, resyncing with the SD and trying again if it fails
+ *
+ * +--------------------------------------------------------------------+ */
+buffer_t R4iSaveDongle::command(const unsigned char *cmd, int reports) {
+/* +--------------------------------------------------------------------+ */
+    buffer_t response;
+
+    for (int attempt = 0; ; attempt++) {
+        failed = false;
+        response = send_command(cmd, reports);
+
+        if (!failed)
+            break;
+
+        if (attempt >= retry_limit) {
+            io_error = true;
+            break;
+        }
+
+        retries++;
+        recover();
+
+        // The SD couldn't be put back into transfer mode, so there's no point sending it again
+        if (io_error)
+            break;
+    }
+
+    return response;
+}
+
 /* +--------------------------------------------------------------------+
  *
  * void transfer_init ()
@@ -268,20 +401,85 @@ void R4iSaveDongle::transfer_init() {
     if (in_transfer_mode)
         return;
 
+    start_transfer();
+    first_pass = true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * void start_transfer ()
+ * Describes the card to the SD and puts it into transfer mode
+ *
+ * +--------------------------------------------------------------------+ */
+void R4iSaveDongle::start_transfer() {
+/* +--------------------------------------------------------------------+ */
     // Need to tell the SD more information about the card
-    CMD_DESCRIBE_CARD[2] = char(card_type); // 1 for a 3DS card, 0 for NDS/DSi
-    CMD_DESCRIBE_CARD[3] = (save_size / 1024 >> 8) & 0xFF;
-    CMD_DESCRIBE_CARD[4] = save_size < 1024 ? 0x01 : (save_size / 1024) & 0xFF;
-    CMD_DESCRIBE_CARD[5] = !card_type && nds_block_we_flag ? 0x55 : 0x00;
-    CMD_DESCRIBE_CARD[6] = !card_type && nds_block_we_flag ? 0xAA : 0x00;
+    cmd_describe_card[2] = char(card_type); // 1 for a 3DS card, 0 for NDS/DSi
+    cmd_describe_card[3] = (save_size / 1024 >> 8) & 0xFF;
+    cmd_describe_card[4] = save_size < 1024 ? 0x01 : (save_size / 1024) & 0xFF;
+    cmd_describe_card[5] = !card_type && nds_block_we_flag ? 0x55 : 0x00;
+    cmd_describe_card[6] = !card_type && nds_block_we_flag ? 0xAA : 0x00;
+
+    // Anything sent to an SD that missed either of these would read or write garbage,
+    // so both go again if one is lost.  recover() calls us, so command() can't be used
+    for (int attempt = 0; ; attempt++) {
+        failed = false;
+        send_command(cmd_describe_card, CMD_DESCRIBE_CARD_REPORTS);
+
+        if (!failed)
+            send_command(CMD_START_TRANSFER, CMD_START_TRANSFER_REPORTS);
+
+        if (!failed)
+            break;
 
-    send_command(CMD_DESCRIBE_CARD, CMD_DESCRIBE_CARD_REPORTS);
-    send_command(CMD_START_TRANSFER, CMD_START_TRANSFER_REPORTS);
+        if (attempt >= retry_limit) {
+            io_error = true;
+            return;
+        }
+
+        retries++;
+        resync();
+    }
 
-    first_pass = true;
     in_transfer_mode = true;
 }
 
+/* +--------------------------------------------------------------------+
+ *
+ * void resync ()
+ * Stops the SD and throws away whatever a failed command left behind
+ *
+ * +--------------------------------------------------------------------+ */
+void R4iSaveDongle::resync() {
+/* +--------------------------------------------------------------------+ */
+    unsigned char stale[REPORT_SIZE];
+
+    send_command(CMD_STOP, CMD_STOP_REPORTS);
+    in_transfer_mode = false;
+
+    // Throw away anything the failed command left queued up, so it doesn't
+    // end up in the reply to the next one
+    while (hid_read_timeout(device, stale, sizeof(stale), 20) > 0)
+        continue;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * void recover ()
+ * Resyncs with the SD after a failed command, or after it reconnected
+ *
+ * +--------------------------------------------------------------------+ */
+void R4iSaveDongle::recover() {
+/* +--------------------------------------------------------------------+ */
+    bool was_transferring = in_transfer_mode;
+
+    resync();
+
+    // The pass we were in is kept, only the SD has forgotten about it
+    if (was_transferring)
+        start_transfer();
+}
+
 /* +--------------------------------------------------------------------+
  *
  * void transfer_end ()
@@ -314,55 +512,83 @@ void R4iSaveDongle::write(std::istream &data, int off = -1) {
 
     // Get the SD ready to receive the data
     transfer_init();
+    if (io_error)
+        return;
 
-    CMD_WRITE_DATA[1] = big ? 0x00 : 0x44;
-    CMD_WRITE_DATA[2] = card_type  && big ? 0x02 : (big ? 0x0A : 0x00);
-    CMD_WRITE_DATA[3] = big ? (off >> 16) & 0xFF: 0x02;
-    CMD_WRITE_DATA[4] = (off >> 8) & 0xFF;
-    CMD_WRITE_DATA[5] = off & 0xFF;
+    cmd_write_data[1] = big ? 0x00 : 0x44;
+    cmd_write_data[2] = card_type  && big ? 0x02 : (big ? 0x0A : 0x00);
+    cmd_write_data[3] = big ? (off >> 16) & 0xFF: 0x02;
+    cmd_write_data[4] = (off >> 8) & 0xFF;
+    cmd_write_data[5] = off & 0xFF;
 
     // The SD software does something along these lines:
     if (card_type || save_size > (512 * 1024)) {
         for (short i = 0; i < 3; i++) {
             int offset = (4 * i) + 6;
-            CMD_WRITE_DATA[offset] = 0x02;
-            CMD_WRITE_DATA[offset+1] = CMD_WRITE_DATA[3];
-            CMD_WRITE_DATA[offset+2] = CMD_WRITE_DATA[4];
-            CMD_WRITE_DATA[offset+3] = CMD_WRITE_DATA[5] + ((i+1)*32);
+            cmd_write_data[offset] = 0x02;
+            cmd_write_data[offset+1] = cmd_write_data[3];
+            cmd_write_data[offset+2] = cmd_write_data[4];
+            cmd_write_data[offset+3] = cmd_write_data[5] + ((i+1)*32);
         }
         if (first_pass && off == 0) {
-            CMD_WRITE_DATA[18] = 0xD8;
-            CMD_WRITE_DATA[19] = CMD_WRITE_DATA[20] = CMD_WRITE_DATA[21] = 0;
-            CMD_WRITE_DATA[22] = 0xFE;
-            CMD_WRITE_DATA[23] = 0xFD;
-            CMD_WRITE_DATA[24] = 0xFB;
-            CMD_WRITE_DATA[25] = 0xF8;
+            cmd_write_data[18] = 0xD8;
+            cmd_write_data[19] = cmd_write_data[20] = cmd_write_data[21] = 0;
+            cmd_write_data[22] = 0xFE;
+            cmd_write_data[23] = 0xFD;
+            cmd_write_data[24] = 0xFB;
+            cmd_write_data[25] = 0xF8;
         }
         else {
-            CMD_WRITE_DATA[18] = 0;
-            CMD_WRITE_DATA[19] = 0xA5;
-            CMD_WRITE_DATA[20] = 0x5A;
-            CMD_WRITE_DATA[25] = 0x55;
+            cmd_write_data[18] = 0;
+            cmd_write_data[19] = 0xA5;
+            cmd_write_data[20] = 0x5A;
+            cmd_write_data[25] = 0x55;
         }
     }
 
-    if (big) {
-        // The R4iSD.exe sends the data in 4×32B chunks
-        for (int i=0; i < 4; i++) {
-            CMD_WRITE_LARGE_DATA[2] = CMD_WRITE_LARGE_DATA[3] = i;
+    // If any part of the block fails, the whole block is sent again
+    std::streampos block_pos = data.tellg();
+    int block_off = off;
+
+    for (int attempt = 0; ; attempt++) {
+        failed = false;
 
-            data.read((char*)&CMD_WRITE_LARGE_DATA[4], write_size);
+        if (big) {
+            // The R4iSD.exe sends the data in 4×32B chunks
+            for (int i=0; i < 4 && !failed; i++) {
+                cmd_write_large_data[2] = cmd_write_large_data[3] = i;
 
-            // CMD_WRITE_DATA is sent after the actual data
-            send_command(CMD_WRITE_LARGE_DATA, CMD_WRITE_LARGE_DATA_REPORTS);
-            off += write_size;
+                data.read((char*)&cmd_write_large_data[4], write_size);
+
+                // CMD_WRITE_DATA is sent after the actual data
+                send_command(cmd_write_large_data, CMD_WRITE_LARGE_DATA_REPORTS);
+                off += write_size;
+            }
         }
-    }
-    else // Send the data in 32B chunks
-        data.read((char*)&CMD_WRITE_DATA[6], write_size);
+        else // Send the data in 32B chunks
+            data.read((char*)&cmd_write_data[6], write_size);
 
-    // CMD_WRITE_DATA is more like a commit for 3DS/big cards
-    send_command(CMD_WRITE_DATA, CMD_WRITE_DATA_REPORTS);
+        // CMD_WRITE_DATA is more like a commit for 3DS/big cards
+        if (!failed)
+            send_command(cmd_write_data, CMD_WRITE_DATA_REPORTS);
+
+        if (!failed)
+            break;
+
+        if (attempt >= retry_limit) {
+            io_error = true;
+            break;
+        }
+
+        retries++;
+        recover();
+        if (io_error)
+            break;
+
+        data.clear();
+        data.seekg(block_pos);
+        off = block_off;
+    }
 
     if (card_type && !first_pass && data.tellg() >= (16 * 1024))
         data.seekg(0, std::ios::end);
@@ -379,6 +605,29 @@ void R4iSaveDongle::write(std::istream &data, int off = -1) {
     return;
 }
 
+/* +--------------------------------------------------------------------+
+ *
+ * (int) write_pass ()
+ * 3DS cards are written in full, then the first 16kB again (pass 1)
+ *
+ * +--------------------------------------------------------------------+ */
+int R4iSaveDongle::write_pass() {
+/* +--------------------------------------------------------------------+ */
+    return in_transfer_mode && !first_pass ? 1 : 0;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * void resume_write ()
+ * Gets the SD ready to continue an interrupted write in the given pass
+ *
+ * +--------------------------------------------------------------------+ */
+void R4iSaveDongle::resume_write(int pass) {
+/* +--------------------------------------------------------------------+ */
+    transfer_init();
+    first_pass = pass == 0;
+}
+
 /* +--------------------------------------------------------------------+
  *
  * void read ()
@@ -395,18 +644,20 @@ void R4iSaveDongle::read(std::ostream &data, int off=-1) {
 
     // Get the SD ready to receive the data
     transfer_init();
+    if (io_error)
+        return;
 
     // In the read command, 0x03 seems to signify that the following bytes are the offset
-    CMD_READ_DATA[2] = big ? 0x03 : 0x00;
-    CMD_READ_DATA[3] = big ? (off >> 16) & 0xFF : 0x03;
-    CMD_READ_DATA[4] = (off >> 8) & 0xFF;
+    cmd_read_data[2] = big ? 0x03 : 0x00;
+    cmd_read_data[3] = big ? (off >> 16) & 0xFF : 0x03;
+    cmd_read_data[4] = (off >> 8) & 0xFF;
 
     // Read from card and write to file
-    response = send_command(CMD_READ_DATA, CMD_READ_DATA_REPORTS);
+    response = command(cmd_read_data, CMD_READ_DATA_REPORTS);
     data.write((char *)&response[0], response.size());
 
     // Stop data transfer mode when we reach the end
-    if (data.tellp() >= save_size)
+    if (off + (int) response.size() >= save_size)
        transfer_end();
 
     return;
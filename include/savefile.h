@@ -0,0 +1,101 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <string>
+#include <cstddef>
+
+/*
+    A save image on disk, mapped into memory so the device reads straight
+    into the file and writes straight out of it.  Download targets are
+    preallocated to the full save size up front, so a transfer never grows
+    the file block by block and a full disk shows up before the first read.
+
+    How hard we try to get a download onto the disk is up to the caller:
+
+        SYNC_NONE       leave it to the OS, fine unless the machine dies
+        SYNC_END        one msync/fsync when the transfer finishes
+        SYNC_PERIODIC   also sync each range before the journal records
+                        it, so --resume is safe even after a power cut
+*/
+class SaveFile {
+    public:
+        enum Durability {
+            SYNC_NONE,
+            SYNC_END,
+            SYNC_PERIODIC
+        };
+
+        static bool parse_durability(const std::string &name, Durability &result);
+
+        SaveFile(Durability durability = SYNC_PERIODIC);
+        ~SaveFile();
+
+        bool create(const std::string &path, size_t size, bool keep);
+        bool open(const std::string &path);
+        bool sync(size_t start, size_t end);
+        bool finish();
+
+        char *data() const { return map; }
+        size_t size() const { return length; }
+        bool durable() const { return durability == SYNC_PERIODIC; }
+
+    private:
+        Durability durability;
+        int fd;
+        char *map;
+        size_t length;
+        bool writable;
+
+        void release();
+};
+
+// An exclusive lock on an open file, other processes (and other opens of it here)
+// wait until it's let go; Windows gets by without
+class FileLock {
+    public:
+        FileLock(int fd = -1) : fd(-1) { lock(fd); }
+        ~FileLock() { unlock(); }
+
+        void lock(int fd);
+        void unlock();
+
+    private:
+        int fd;
+
+        FileLock(const FileLock &);
+        FileLock &operator=(const FileLock &);
+};
+
+// For the files we write ourselves: the whole of data, however many goes it takes
+bool write_all(int fd, const void *data, size_t size);
+
+// Puts a finished temporary file in place of path, replacing what was there in one go
+bool replace_file(const std::string &temp, const std::string &path);
+
+#endif
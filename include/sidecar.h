@@ -0,0 +1,93 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+/*
+    A CRC32C of every 512 byte block of a save, the size the card is read
+    in, kept next to it as <save>.crc:
+
+        header      magic "005S", version, block size, save size and a
+                    CRC32C of the sums that follow
+        sums        a 32-bit CRC32C per block, in order
+
+    Sums are worked out as the download streams in, so checking the file
+    later only means reading the file.  A block that no longer matches its
+    sum is damage on the disk, and only those blocks need reading from the
+    card again (see download --repair).
+*/
+class Sidecar {
+    public:
+        static const size_t BLOCK_SIZE = 512;
+
+        static std::string path_for(const std::string &save);
+
+        Sidecar();
+
+        void reset(size_t save_size);
+        void add(long long offset, const char *data, size_t length);
+        bool complete() const;
+
+        bool load(const std::string &path);
+        bool write(const std::string &path, bool sync);
+
+        size_t save_size() const { return size; }
+        size_t blocks() const { return sums.size(); }
+        uint32_t sum(size_t block) const { return sums[block]; }
+
+        // Blocks of data that don't match their sum, stopping at the first if asked
+        std::vector<size_t> damaged(const char *data, size_t length, bool first_only = false) const;
+
+        const std::string &error() const { return last_error; }
+
+    private:
+        size_t size;
+        size_t covered;
+        std::vector<uint32_t> sums;
+        std::vector<char> have;
+        std::string last_error;
+
+        bool fail(const std::string &message);
+};
+
+// Sums each block of a download on its way through
+class SidecarSink : public PipelineStage {
+    public:
+        SidecarSink(Sidecar &sidecar) : sidecar(sidecar) {}
+        bool process(PipelineBlock &block);
+
+    private:
+        Sidecar &sidecar;
+};
+
+#endif
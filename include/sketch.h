@@ -0,0 +1,80 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+    Counts how often 512 byte chunks turn up across any number of saves in
+    a fixed amount of memory.  A count-min sketch (DEPTH rows of WIDTH
+    counters, each chunk bumping one counter per row) gives an estimate
+    that's never too low, and with conservative updates rarely far too
+    high.  Alongside it a min-heap keeps the K chunks with the highest
+    estimates so far, with a copy of each so they can be shown.
+
+    Sketches built on separate threads merge by adding their counters; the
+    candidates from every heap are then estimated again against the total.
+*/
+class ChunkSketch {
+    public:
+        static const size_t CHUNK_SIZE = 512, DEPTH = 4, WIDTH = 1 << 16;
+
+        struct Heavy {
+            uint64_t hash[2];
+            uint32_t count;
+            std::string chunk;
+        };
+
+        ChunkSketch(size_t k);
+
+        void add(const char *chunk);
+        void merge(const ChunkSketch &other);
+        uint32_t estimate(const uint64_t hash[2]) const;
+
+        // Highest estimate first
+        std::vector<Heavy> top() const;
+        uint64_t total() const { return added; }
+
+    private:
+        size_t k;
+        uint64_t added;
+        std::vector<uint32_t> counters;     // DEPTH rows of WIDTH, one after another
+        std::vector<Heavy> heap;
+        std::unordered_map<uint64_t, size_t> in_heap;   // first hash to heap position
+
+        size_t cell(const uint64_t hash[2], size_t row) const;
+        void offer(const uint64_t hash[2], uint32_t count, const char *chunk);
+        void sift_down(size_t i);
+        void sift_up(size_t i);
+        void swap_entries(size_t a, size_t b);
+};
+
+#endif
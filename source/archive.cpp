@@ -0,0 +1,691 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "archive.h"
+#include "savefile.h"
+
+#include <cstddef>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <direct.h>
+  #include <io.h>
+  #define fsync _commit
+  #define mkdir(path, mode) _mkdir(path)
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+const size_t Archive::FIXED_SIZE, Archive::CDC_MIN, Archive::CDC_MAX;
+const uint64_t Archive::CDC_MASK;
+const uint32_t Archive::LENGTH_MASK, Archive::CODEC_SHIFT, Archive::STORED, Archive::PLAIN_LZ;
+
+// Version 1 had no compressed chunks, so it's read as it is and upgraded when written to
+static const char INDEX_MAGIC[4] = { '0', '0', '5', 'I' };
+static const uint32_t INDEX_VERSION = 2;
+
+// A chunk's hash is two xxh64s, the second with this seed
+static const uint64_t SECOND_SEED = 0x9E3779B97F4A7C15ull;
+
+struct DictionaryHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t check;     // CRC32C of the dictionary
+    char card[32];
+};
+
+static const char DICTIONARY_MAGIC[4] = { '0', '0', '5', 'D' };
+
+/* +--------------------------------------------------------------------+
+ *
+ * (const uint64_t *) gear_table()
+ * 256 random-looking words for the rolling hash, the same every run
+ *
+ * +--------------------------------------------------------------------+ */
+static const uint64_t *gear_table() {
+/* +--------------------------------------------------------------------+ */
+    static uint64_t table[256];
+    static bool ready = false;
+
+    // splitmix64, cut points must never change or old chunks stop matching
+    if (!ready) {
+        uint64_t x = 0x005005005005ull;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            table[i] = z ^ (z >> 31);
+        }
+        ready = true;
+    }
+
+    return table;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse_chunking()
+ * Maps a --chunking value to a Chunking, false if we don't know it
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::parse_chunking(const std::string &name, Chunking &result) {
+/* +--------------------------------------------------------------------+ */
+    if (name == "fixed")
+        result = FIXED;
+    else if (name == "cdc")
+        result = CDC;
+    else
+        return false;
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse_compression()
+ * Maps a --compress value to a Compression, false if we don't know it
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::parse_compression(const std::string &name, Compression &result) {
+/* +--------------------------------------------------------------------+ */
+    if (name == "none")
+        result = STORE;
+    else if (name == "lz")
+        result = LZ;
+    else if (name == "dict")
+        result = DICTIONARY;
+    else
+        return false;
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) valid_name()
+ * Whether name can be a manifest, it has to stay inside manifests/
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::valid_name(const std::string &name) {
+/* +--------------------------------------------------------------------+ */
+    return !name.empty() && name != "." && name != ".." && name.find_first_of("/\\") == std::string::npos;
+}
+
+/* +--------------------------------------------------------------------+ */
+Archive::Archive()
+    : chunks_seen(0), chunks_added(0), bytes_seen(0), bytes_added(0), bytes_stored(0), writable(false),
+      pack_fd(-1), index_fd(-1), pack_size(0), highest_dictionary(0), chunking(FIXED), compression(STORE), scanned(0), gear_hash(0) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+ */
+Archive::~Archive() {
+/* +--------------------------------------------------------------------+ */
+    close();
+}
+
+/* +--------------------------------------------------------------------+ */
+void Archive::close() {
+/* +--------------------------------------------------------------------+ */
+    writer.unlock();
+
+    if (pack_fd >= 0)
+        ::close(pack_fd);
+
+    if (index_fd >= 0)
+        ::close(index_fd);
+
+    pack_fd = index_fd = -1;
+    entries.clear();
+    lookup.clear();
+    dictionaries.clear();
+    latest_dictionary.clear();
+    highest_dictionary = 0;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool Archive::fail(const std::string &message) {
+/* +--------------------------------------------------------------------+ */
+    last_error = message;
+    return false;
+}
+
+/* +--------------------------------------------------------------------+ */
+uint32_t Archive::entry_check(const IndexEntry &entry) {
+/* +--------------------------------------------------------------------+ */
+    return (uint32_t) xxh64(&entry, offsetof(IndexEntry, check));
+}
+
+/* +--------------------------------------------------------------------+ */
+std::string Archive::manifest_path(const std::string &name) const {
+/* +--------------------------------------------------------------------+ */
+    return root + "/manifests/" + name;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) open()
+ * Loads the index of dir, creating an empty archive there if writable
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::open(const std::string &dir, bool write) {
+/* +--------------------------------------------------------------------+ */
+    struct stat st;
+
+    close();
+    root = dir;
+    writable = write;
+
+    if (writable) {
+        mkdir(root.c_str(), 0755);
+        mkdir((root + "/manifests").c_str(), 0755);
+        mkdir((root + "/dicts").c_str(), 0755);
+    }
+
+    int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+    pack_fd = ::open((root + "/chunks.pack").c_str(), flags | O_BINARY, 0644);
+    index_fd = ::open((root + "/chunks.idx").c_str(), flags | O_BINARY, 0644);
+
+    if (pack_fd < 0 || index_fd < 0)
+        return fail("Unable to open the archive at " + root);
+
+    // Held until close(), nothing past the index is a crash's leftovers while another writer is appending
+    if (writable)
+        writer.lock(index_fd);
+
+    if (fstat(pack_fd, &st) != 0)
+        return fail("Unable to open the archive at " + root);
+
+    uint64_t pack_end = st.st_size;
+    char magic[4];
+    uint32_t version;
+
+    ssize_t got = ::read(index_fd, magic, sizeof(magic));
+    if (got == 0 && writable) {
+        if (!write_all(index_fd, INDEX_MAGIC, sizeof(INDEX_MAGIC)) || !write_all(index_fd, &INDEX_VERSION, sizeof(INDEX_VERSION)))
+            return fail("Unable to write to the archive at " + root);
+    }
+    else if (got != sizeof(magic) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 ||
+             ::read(index_fd, &version, sizeof(version)) != sizeof(version) || version < 1 || version > INDEX_VERSION)
+        return fail(root + " isn't an archive (or was written by a newer version)");
+    else if (version < INDEX_VERSION && writable) {
+        // Older versions won't know what to do with a compressed chunk, so they're kept out
+        if (lseek(index_fd, sizeof(INDEX_MAGIC), SEEK_SET) != sizeof(INDEX_MAGIC) ||
+            !write_all(index_fd, &INDEX_VERSION, sizeof(INDEX_VERSION)))
+            return fail("Unable to write to the archive at " + root);
+    }
+
+    // Entries only count if they're whole and the pack really has their chunk
+    IndexEntry entry;
+    pack_size = 0;
+
+    while (::read(index_fd, &entry, sizeof(entry)) == sizeof(entry) && entry.check == entry_check(entry) &&
+           entry.offset == pack_size && entry.offset + (entry.length & LENGTH_MASK) <= pack_end) {
+        lookup[entry.hash] = entries.size();
+        entries.push_back(entry);
+        pack_size += entry.length & LENGTH_MASK;
+    }
+
+    if (writable) {
+        // Drop whatever a crash left beyond the last good entry
+        off_t index_end = sizeof(INDEX_MAGIC) + sizeof(INDEX_VERSION) + entries.size() * sizeof(IndexEntry);
+
+        if (ftruncate(index_fd, index_end) != 0 || lseek(index_fd, index_end, SEEK_SET) != index_end ||
+            ftruncate(pack_fd, pack_size) != 0 || lseek(pack_fd, pack_size, SEEK_SET) != (off_t) pack_size)
+            return fail("Unable to write to the archive at " + root);
+    }
+
+    load_dictionaries();
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * load_dictionaries()
+ * Reads every dictionary in dicts/, noting the newest for each card
+ *
+ * +--------------------------------------------------------------------+ */
+void Archive::load_dictionaries() {
+/* +--------------------------------------------------------------------+ */
+    DIR *d = opendir((root + "/dicts").c_str());
+    if (!d)
+        return;
+
+    while (struct dirent *ent = readdir(d)) {
+        char *end = NULL;
+        unsigned long number = strtoul(ent->d_name, &end, 10);
+        DictionaryHeader header;
+
+        if (number == STORED || number >= PLAIN_LZ || *end != '\0')
+            continue;
+
+        // Chunks may already be stored against it, so its number is never handed out again
+        highest_dictionary = std::max(highest_dictionary, (uint32_t) number);
+
+        // One that's damaged is left out, restoring a chunk that needs it says so
+        std::ifstream file ((root + "/dicts/" + ent->d_name).c_str(), std::ios::binary);
+        std::unique_ptr<LzDictionary> dict (new LzDictionary());
+
+        if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || memcmp(header.magic, DICTIONARY_MAGIC, 4) != 0 ||
+            header.version != 1 || header.size == 0 || header.size > 64 * 1024)
+            continue;
+
+        dict->data.resize(header.size);
+        if (!file.read(&dict->data[0], header.size) || crc32c(&dict->data[0], header.size) != header.check)
+            continue;
+
+        lz_prepare(*dict);
+        dictionaries[number].reset(dict.release());
+
+        std::string card (header.card, strnlen(header.card, sizeof(header.card)));
+        if (latest_dictionary[card] < number)
+            latest_dictionary[card] = number;
+    }
+
+    closedir(d);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) add_dictionary()
+ * Stores a new dictionary for card, under the next free number
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::add_dictionary(const std::string &card, const std::vector<char> &data) {
+/* +--------------------------------------------------------------------+ */
+    uint32_t number = highest_dictionary + 1;
+    DictionaryHeader header;
+
+    if (!writable)
+        return fail("The archive at " + root + " is read-only");
+
+    if (data.empty() || data.size() > 64 * 1024 || card.empty() || card.size() >= sizeof(header.card))
+        return fail("A dictionary for '" + card + "' can't be stored");
+
+    // Numbers go in the index entries, so once they run out only plain compression is left
+    if (number >= PLAIN_LZ)
+        return fail("The archive at " + root + " has no room for more dictionaries");
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICTIONARY_MAGIC, sizeof(DICTIONARY_MAGIC));
+    header.version = 1;
+    header.size = data.size();
+    header.check = crc32c(&data[0], data.size());
+    memcpy(header.card, card.data(), card.size());
+
+    std::string path = root + "/dicts/" + std::to_string(number), temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    bool ok = fd >= 0 && write_all(fd, &header, sizeof(header)) && write_all(fd, &data[0], data.size()) && fsync(fd) == 0;
+
+    if (fd >= 0)
+        ::close(fd);
+
+    if (!ok || !replace_file(temp, path)) {
+        remove(temp.c_str());
+        return fail("Unable to write " + path);
+    }
+
+    std::unique_ptr<LzDictionary> dict (new LzDictionary());
+    dict->data = data;
+    lz_prepare(*dict);
+
+    dictionaries[number].reset(dict.release());
+    latest_dictionary[card] = number;
+    highest_dictionary = number;
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) restore()
+ * Puts the save called name back together from its chunks
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::restore(const std::string &name, buffer_t &data) {
+/* +--------------------------------------------------------------------+ */
+    std::ifstream file (manifest_path(name).c_str(), std::ios::binary);
+    ManifestHeader header;
+
+    if (!valid_name(name) || !file.read(reinterpret_cast<char *>(&header), sizeof(header)) || memcmp(header.magic, "005M", 4) != 0)
+        return fail("No save called " + name + " in " + root);
+
+    std::vector<uint32_t> ids (header.chunks);
+    if (header.chunks > 0 && !file.read(reinterpret_cast<char *>(&ids[0]), ids.size() * sizeof(uint32_t)))
+        return fail("The manifest for " + name + " is truncated");
+
+    // Chunks are copied straight out of the mapped pack
+    if (pack.size() < pack_size && !pack.open(root + "/chunks.pack"))
+        return fail("Unable to read " + root + "/chunks.pack");
+
+    data.resize(header.save_size);
+    size_t pos = 0;
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i] >= entries.size())
+            return fail("The manifest for " + name + " refers to chunks the archive doesn't have");
+
+        const IndexEntry &entry = entries[ids[i]];
+        const char *stored = pack.data() + entry.offset;
+        size_t length = entry.length & LENGTH_MASK;
+        uint32_t codec = entry.length >> CODEC_SHIFT;
+        size_t size = length;       // once it's restored
+
+        if (codec == STORED) {
+            if (pos + length > data.size())
+                return fail("The manifest for " + name + " doesn't add up to its save size");
+
+            memcpy(&data[pos], stored, length);
+        }
+        else {
+            const LzDictionary *dict = NULL;
+
+            if (codec != PLAIN_LZ) {
+                if (!dictionaries.count(codec))
+                    return fail("Dictionary " + std::to_string(codec) + " is missing from " + root + "/dicts");
+                dict = dictionaries[codec].get();
+            }
+
+            // Compressed chunks lead with their size
+            uint16_t unpacked;
+
+            if (length < sizeof(unpacked))
+                return fail("A chunk of " + name + " is damaged");
+
+            memcpy(&unpacked, stored, sizeof(unpacked));
+            size = unpacked;
+            if (pos + size > data.size())
+                return fail("The manifest for " + name + " doesn't add up to its save size");
+
+            if (!lz_decompress(stored + sizeof(unpacked), length - sizeof(unpacked), &data[pos], size, dict))
+                return fail("A chunk of " + name + " is damaged");
+        }
+
+        // Whatever it went through, it has to come out as the chunk that was hashed
+        if (xxh64(&data[pos], size) != entry.hash.lo || xxh64(&data[pos], size, SECOND_SEED) != entry.hash.hi)
+            return fail("A chunk of " + name + " is damaged");
+
+        pos += size;
+    }
+
+    if (pos != data.size())
+        return fail("The manifest for " + name + " doesn't add up to its save size");
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * begin()
+ * Starts on a new save, throwing away anything not committed
+ *
+ * +--------------------------------------------------------------------+ */
+void Archive::begin(Chunking mode, Compression codec, const std::string &source) {
+/* +--------------------------------------------------------------------+ */
+    discard();
+
+    chunking = mode;
+    compression = codec;
+    card = source;
+    gear_hash = 0;
+
+    chunks_seen = chunks_added = 0;
+    bytes_seen = bytes_added = bytes_stored = 0;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * discard()
+ * Forgets the save being stored, along with any chunks only it added
+ *
+ * +--------------------------------------------------------------------+ */
+void Archive::discard() {
+/* +--------------------------------------------------------------------+ */
+    for (size_t i = 0; i < new_entries.size(); i++)
+        lookup.erase(new_entries[i].hash);
+
+    // A failed commit may have got part way through the pack or index
+    if (writable && (!new_data.empty() || !new_entries.empty())) {
+        off_t index_end = sizeof(INDEX_MAGIC) + sizeof(INDEX_VERSION) + entries.size() * sizeof(IndexEntry);
+
+        if (ftruncate(pack_fd, pack_size) == 0)
+            lseek(pack_fd, pack_size, SEEK_SET);
+        if (ftruncate(index_fd, index_end) == 0)
+            lseek(index_fd, index_end, SEEK_SET);
+    }
+
+    pending.clear();
+    scanned = 0;
+    manifest.clear();
+    new_data.clear();
+    new_entries.clear();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * append()
+ * Feeds the next part of the save in, cutting chunks off as they fill
+ *
+ * +--------------------------------------------------------------------+ */
+void Archive::append(const char *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    const uint64_t *gear = gear_table();
+    size_t start = 0;
+
+    pending.append(data, size);
+
+    if (chunking == FIXED) {
+        while (pending.size() - start >= FIXED_SIZE) {
+            cut_at(start, FIXED_SIZE);
+            start += FIXED_SIZE;
+        }
+    }
+    else {
+        for (; scanned < pending.size(); scanned++) {
+            gear_hash = (gear_hash << 1) + gear[(unsigned char) pending[scanned]];
+
+            size_t length = scanned + 1 - start;
+            if ((length >= CDC_MIN && (gear_hash & CDC_MASK) == 0) || length >= CDC_MAX) {
+                cut_at(start, length);
+                start += length;
+                gear_hash = 0;
+            }
+        }
+    }
+
+    pending.erase(0, start);
+    scanned -= std::min(scanned, start);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * cut_at()
+ * Adds pending[start, start + length) to the save, storing it if it's new
+ *
+ * +--------------------------------------------------------------------+ */
+void Archive::cut_at(size_t start, size_t length) {
+/* +--------------------------------------------------------------------+ */
+    const char *data = pending.data() + start;
+    ChunkHash hash = { xxh64(data, length), xxh64(data, length, SECOND_SEED) };
+
+    chunks_seen++;
+    bytes_seen += length;
+
+    std::unordered_map<ChunkHash, uint32_t, ChunkHashKey>::const_iterator found = lookup.find(hash);
+    if (found != lookup.end()) {
+        manifest.push_back(found->second);
+        return;
+    }
+
+    // New to the archive, held in memory until commit()
+    IndexEntry entry = { hash, pack_size + new_data.size(), (uint32_t) length, 0 };
+    entry.check = entry_check(entry);
+
+    uint32_t id = entries.size() + new_entries.size();
+    lookup[hash] = id;
+    new_entries.push_back(entry);
+    new_data.append(data, length);
+    manifest.push_back(id);
+
+    chunks_added++;
+    bytes_added += length;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * compress_new()
+ * Packs the chunks this save added, spread over every core
+ *
+ * +--------------------------------------------------------------------+ */
+void Archive::compress_new() {
+/* +--------------------------------------------------------------------+ */
+    uint32_t codec = PLAIN_LZ;
+    const LzDictionary *dict = NULL;
+
+    if (compression == DICTIONARY && latest_dictionary.count(card)) {
+        codec = latest_dictionary[card];
+        dict = dictionaries[codec].get();
+    }
+
+    // Each chunk on its own, kept only where it comes out smaller
+    std::vector<std::string> packed (new_entries.size());
+    std::string old_data;
+    old_data.swap(new_data);
+
+    run_parallel(new_entries.size(), std::thread::hardware_concurrency(), [&](size_t i) {
+        const IndexEntry &entry = new_entries[i];
+        const char *raw = old_data.data() + (entry.offset - pack_size);
+        uint16_t size = entry.length;
+        char out[sizeof(size) + CDC_MAX];
+
+        size_t n = lz_compress(raw, entry.length, out + sizeof(size), entry.length - 1, dict);
+        if (n > 0 && sizeof(size) + n < entry.length) {
+            memcpy(out, &size, sizeof(size));
+            packed[i].assign(out, sizeof(size) + n);
+        }
+    });
+
+    for (size_t i = 0; i < new_entries.size(); i++) {
+        IndexEntry &entry = new_entries[i];
+        uint64_t offset = pack_size + new_data.size();
+
+        if (packed[i].empty())
+            new_data.append(old_data, entry.offset - pack_size, entry.length);
+        else {
+            new_data.append(packed[i]);
+            entry.length = packed[i].size() | (codec << CODEC_SHIFT);
+        }
+
+        entry.offset = offset;
+        entry.check = entry_check(entry);
+    }
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) commit()
+ * Writes out the new chunks, then the save's manifest as name
+ *
+ * +--------------------------------------------------------------------+ */
+bool Archive::commit(const std::string &name) {
+/* +--------------------------------------------------------------------+ */
+    if (!writable)
+        return fail("The archive at " + root + " is read-only");
+
+    if (!valid_name(name))
+        return fail("'" + name + "' can't be used as a name in the archive");
+
+    // Whatever is left over is the last chunk
+    if (!pending.empty())
+        cut_at(0, pending.size());
+
+    pending.clear();
+    scanned = 0;
+
+    if (compression != STORE)
+        compress_new();
+
+    bytes_stored = new_data.size();
+
+    // Chunks, then the entries pointing at them, then the manifest pointing at those
+    if (!new_data.empty() && (!write_all(pack_fd, new_data.data(), new_data.size()) || fsync(pack_fd) != 0)) {
+        discard();
+        return fail("Unable to write to " + root + "/chunks.pack");
+    }
+
+    if (!new_entries.empty() && (!write_all(index_fd, &new_entries[0], new_entries.size() * sizeof(IndexEntry)) || fsync(index_fd) != 0)) {
+        discard();
+        return fail("Unable to write to " + root + "/chunks.idx");
+    }
+
+    pack_size += new_data.size();
+    entries.insert(entries.end(), new_entries.begin(), new_entries.end());
+    new_data.clear();
+    new_entries.clear();
+
+    ManifestHeader header = { { '0', '0', '5', 'M' }, 1, (uint32_t) bytes_seen, (uint32_t) manifest.size() };
+    std::string path = manifest_path(name), temp = path + ".tmp";
+
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    bool ok = fd >= 0 && write_all(fd, &header, sizeof(header)) &&
+              (manifest.empty() || write_all(fd, &manifest[0], manifest.size() * sizeof(uint32_t))) && fsync(fd) == 0;
+
+    if (fd >= 0)
+        ::close(fd);
+
+    if (!ok || !replace_file(temp, path)) {
+        remove(temp.c_str());
+        return fail("Unable to write " + path);
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ArchiveSink::process(PipelineBlock &block) {
+/* +--------------------------------------------------------------------+ */
+    archive.append(block.data, block.length);
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ArchiveSink::finish(bool complete) {
+/* +--------------------------------------------------------------------+ */
+    // An interrupted download never shows up in the archive
+    if (complete && !archive.commit(name)) {
+        failure = archive.error();
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,556 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "catalog.h"
+#include "container.h"
+#include "pipeline.h"
+#include "savefile.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #define fsync _commit
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+const char *Catalog::FILE_NAME = ".005catalog";
+
+static const char CATALOG_MAGIC[4] = { '0', '0', '5', 'K' };
+static const uint32_t CATALOG_VERSION = 1;
+static const size_t CATALOG_HEADER = sizeof(CATALOG_MAGIC) + sizeof(CATALOG_VERSION);
+
+/* +--------------------------------------------------------------------+ */
+static std::string field(const char *text, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    return std::string(text, std::find(text, text + size, '\0'));
+}
+
+/* +--------------------------------------------------------------------+ */
+static void set_field(char *dest, size_t size, const std::string &text) {
+/* +--------------------------------------------------------------------+ */
+    memset(dest, 0, size);
+    memcpy(dest, text.data(), std::min(size - 1, text.size()));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (CatalogRecord) describe()
+ * The record for a dump called file, holding a save with these details
+ *
+ * +--------------------------------------------------------------------+ */
+CatalogRecord CatalogRecord::describe(const std::string &file, const ContainerInfo &info, uint32_t flags) {
+/* +--------------------------------------------------------------------+ */
+    CatalogRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.created = info.created;
+    record.header_hash = info.card_header.empty() ? 0 : xxh64(&info.card_header[0], info.card_header.size());
+    record.save_hash = info.save_hash;
+    record.save_size = info.save_size;
+    record.flags = flags;
+    set_field(record.card_id, sizeof(record.card_id), info.card_id);
+    set_field(record.card_title, sizeof(record.card_title), info.card_title);
+    set_field(record.file, sizeof(record.file), file);
+    return record;
+}
+
+/* +--------------------------------------------------------------------+ */
+std::string CatalogRecord::name() const {
+/* +--------------------------------------------------------------------+ */
+    return field(file, sizeof(file));
+}
+
+/* +--------------------------------------------------------------------+ */
+std::string CatalogRecord::id() const {
+/* +--------------------------------------------------------------------+ */
+    return field(card_id, sizeof(card_id));
+}
+
+/* +--------------------------------------------------------------------+ */
+std::string CatalogRecord::title() const {
+/* +--------------------------------------------------------------------+ */
+    return field(card_title, sizeof(card_title));
+}
+
+/* +--------------------------------------------------------------------+ */
+std::string CatalogRecord::key() const {
+/* +--------------------------------------------------------------------+ */
+    char hex[17];
+
+    if (card_id[0] || !header_hash)
+        return id();
+
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) header_hash);
+    return hex;
+}
+
+/* +--------------------------------------------------------------------+ */
+Catalog::Catalog() : mapped(SaveFile::SYNC_NONE), mapped_count(0), fd(-1) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+ */
+Catalog::~Catalog() {
+/* +--------------------------------------------------------------------+ */
+    if (fd >= 0)
+        ::close(fd);
+}
+
+/* +--------------------------------------------------------------------+ */
+bool Catalog::fail(const std::string &message) {
+/* +--------------------------------------------------------------------+ */
+    last_error = message;
+    return false;
+}
+
+/* +--------------------------------------------------------------------+ */
+uint32_t Catalog::record_check(const CatalogRecord &record) {
+/* +--------------------------------------------------------------------+ */
+    return (uint32_t) xxh64(&record, offsetof(CatalogRecord, check), 0x005C);
+}
+
+/* +--------------------------------------------------------------------+ */
+const CatalogRecord &Catalog::record(size_t i) const {
+/* +--------------------------------------------------------------------+ */
+    if (i < mapped_count)
+        return reinterpret_cast<const CatalogRecord *>(mapped.data() + CATALOG_HEADER)[i];
+
+    return added[i - mapped_count];
+}
+
+/* +--------------------------------------------------------------------+ */
+static bool replaced(int fd, const std::string &path) {
+/* +--------------------------------------------------------------------+ */
+    struct stat opened, current;
+
+    // A rebuild swaps in a new file, whoever waited on the old one's lock has to reopen
+    if (fstat(fd, &opened) != 0)
+        return false;
+
+    return stat(path.c_str(), &current) != 0 || current.st_ino != opened.st_ino || current.st_dev != opened.st_dev;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) open()
+ * Maps the catalog in dir and indexes it, creating it if writable
+ *
+ * +--------------------------------------------------------------------+ */
+bool Catalog::open(const std::string &dir, bool writable) {
+/* +--------------------------------------------------------------------+ */
+    std::string path = dir + "/" + FILE_NAME;
+    char header[CATALOG_HEADER];
+
+    root = dir;
+    for (;;) {
+        if (fd >= 0)
+            ::close(fd);
+
+        fd = ::open(path.c_str(), (writable ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY) | O_BINARY, 0644);
+        if (fd < 0)
+            return fail(writable ? "Unable to open " + path + ", check your permissions" : "No catalog in " + dir);
+
+        FileLock lock (fd);
+        struct stat st;
+
+        if (replaced(fd, path))
+            continue;
+
+        if (fstat(fd, &st) != 0)
+            return fail("Unable to read " + path);
+
+        if (st.st_size == 0 && writable) {
+            memcpy(header, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+            memcpy(header + sizeof(CATALOG_MAGIC), &CATALOG_VERSION, sizeof(CATALOG_VERSION));
+            if (!write_all(fd, header, sizeof(header)))
+                return fail("Unable to write to " + path);
+        }
+        else if (writable && (st.st_size - CATALOG_HEADER) % sizeof(CatalogRecord) != 0) {
+            // Drop a record a crash tore in half, the next one would be misaligned behind it
+            if (ftruncate(fd, st.st_size - (st.st_size - CATALOG_HEADER) % sizeof(CatalogRecord)) != 0)
+                return fail("Unable to write to " + path);
+        }
+
+        if (!mapped.open(path))
+            return fail("Unable to read " + path);
+        break;
+    }
+
+    if (mapped.size() < CATALOG_HEADER || memcmp(mapped.data(), CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0 ||
+        memcmp(mapped.data() + sizeof(CATALOG_MAGIC), &CATALOG_VERSION, sizeof(CATALOG_VERSION)) != 0)
+        return fail(path + " isn't a catalog (or was written by a newer version)");
+
+    mapped_count = (mapped.size() - CATALOG_HEADER) / sizeof(CatalogRecord);
+    added.clear();
+    reindex();
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+void Catalog::reindex() {
+/* +--------------------------------------------------------------------+ */
+    order.clear();
+    by_file.clear();
+    by_id.clear();
+    by_title.clear();
+    by_header.clear();
+
+    for (size_t i = 0; i < mapped_count + added.size(); i++) {
+        if (record(i).check == record_check(record(i)))
+            index(i);
+    }
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (void) index()
+ * Makes record i findable, replacing any earlier record for its file
+ *
+ * +--------------------------------------------------------------------+ */
+void Catalog::index(size_t i) {
+/* +--------------------------------------------------------------------+ */
+    const CatalogRecord &entry = record(i);
+    std::string name = entry.name();
+
+    // Sorted on time, then on position, so ties go to whichever was written later
+    struct Before {
+        const Catalog *catalog;
+        bool operator()(size_t a, size_t b) const {
+            const CatalogRecord &x = catalog->record(a), &y = catalog->record(b);
+            return x.created < y.created || (x.created == y.created && a < b);
+        }
+    } before = { this };
+
+    std::unordered_map<std::string, size_t>::iterator old = by_file.find(name);
+    if (old != by_file.end()) {
+        size_t j = old->second;
+        const CatalogRecord &previous = record(j);
+        std::pair<std::unordered_multimap<std::string, size_t>::iterator,
+                  std::unordered_multimap<std::string, size_t>::iterator> range;
+
+        order.erase(std::lower_bound(order.begin(), order.end(), j, before));
+
+        for (range = by_id.equal_range(previous.id()); range.first != range.second; ++range.first) {
+            if (range.first->second == j) { by_id.erase(range.first); break; }
+        }
+        for (range = by_title.equal_range(previous.title()); range.first != range.second; ++range.first) {
+            if (range.first->second == j) { by_title.erase(range.first); break; }
+        }
+
+        std::pair<std::unordered_multimap<uint64_t, size_t>::iterator,
+                  std::unordered_multimap<uint64_t, size_t>::iterator> hashes = by_header.equal_range(previous.header_hash);
+        for (; hashes.first != hashes.second; ++hashes.first) {
+            if (hashes.first->second == j) { by_header.erase(hashes.first); break; }
+        }
+    }
+
+    by_file[name] = i;
+    order.insert(std::upper_bound(order.begin(), order.end(), i, before), i);
+
+    if (entry.card_id[0])
+        by_id.insert(std::make_pair(entry.id(), i));
+    if (entry.card_title[0])
+        by_title.insert(std::make_pair(entry.title(), i));
+    if (entry.header_hash)
+        by_header.insert(std::make_pair(entry.header_hash, i));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) append()
+ * Adds a record, returning once it's on disk
+ *
+ * +--------------------------------------------------------------------+ */
+bool Catalog::append(const CatalogRecord &entry) {
+/* +--------------------------------------------------------------------+ */
+    CatalogRecord record = entry;
+
+    if (fd < 0)
+        return fail("The catalog isn't open");
+
+    record.check = record_check(record);
+    for (;;) {
+        FileLock lock (fd);
+
+        if (!replaced(fd, root + "/" + FILE_NAME)) {
+            // One write, so another process appending at the same time can't land in the middle
+            if (!write_all(fd, &record, sizeof(record)) || fsync(fd) != 0)
+                return fail("Unable to write to the catalog in " + root);
+            break;
+        }
+
+        lock.unlock();
+        if (!open(root, true))
+            return false;
+    }
+
+    added.push_back(record);
+    index(mapped_count + added.size() - 1);
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+const CatalogRecord *Catalog::lookup(const std::string &file) const {
+/* +--------------------------------------------------------------------+ */
+    std::unordered_map<std::string, size_t>::const_iterator found = by_file.find(file);
+    return found == by_file.end() ? NULL : &record(found->second);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::vector<const CatalogRecord *>) find()
+ * Every dump whose card ID, title or header hash (in hex) is key
+ *
+ * +--------------------------------------------------------------------+ */
+std::vector<const CatalogRecord *> Catalog::find(const std::string &key) const {
+/* +--------------------------------------------------------------------+ */
+    std::vector<size_t> hits;
+    std::pair<std::unordered_multimap<std::string, size_t>::const_iterator,
+              std::unordered_multimap<std::string, size_t>::const_iterator> range;
+
+    for (range = by_id.equal_range(key); range.first != range.second; ++range.first)
+        hits.push_back(range.first->second);
+    for (range = by_title.equal_range(key); range.first != range.second; ++range.first)
+        hits.push_back(range.first->second);
+
+    char *end = NULL;
+    uint64_t hash = key.empty() || key.size() > 16 ? 0 : strtoull(key.c_str(), &end, 16);
+    if (hash && *end == '\0') {
+        std::pair<std::unordered_multimap<uint64_t, size_t>::const_iterator,
+                  std::unordered_multimap<uint64_t, size_t>::const_iterator> hashes = by_header.equal_range(hash);
+        for (; hashes.first != hashes.second; ++hashes.first)
+            hits.push_back(hashes.first->second);
+    }
+
+    std::sort(hits.begin(), hits.end());
+    hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+
+    std::vector<const CatalogRecord *> result;
+    for (size_t i = 0; i < hits.size(); i++)
+        result.push_back(&record(hits[i]));
+
+    std::stable_sort(result.begin(), result.end(), [](const CatalogRecord *a, const CatalogRecord *b) {
+        return a->created < b->created;
+    });
+    return result;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::vector<const CatalogRecord *>) since()
+ * Every dump made at or after time, oldest first
+ *
+ * +--------------------------------------------------------------------+ */
+std::vector<const CatalogRecord *> Catalog::since(uint64_t time) const {
+/* +--------------------------------------------------------------------+ */
+    std::vector<size_t>::const_iterator first = std::partition_point(order.begin(), order.end(), [this, time](size_t i) {
+        return record(i).created < time;
+    });
+
+    std::vector<const CatalogRecord *> result;
+    for (; first != order.end(); ++first)
+        result.push_back(&record(*first));
+
+    return result;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (const CatalogRecord *) latest()
+ * Newest container from the same card as card, other than skip
+ *
+ * +--------------------------------------------------------------------+ */
+const CatalogRecord *Catalog::latest(const ContainerInfo &card, const std::string &skip) const {
+/* +--------------------------------------------------------------------+ */
+    CatalogRecord wanted = CatalogRecord::describe("", card, 0);
+    const CatalogRecord *best = NULL;
+    size_t best_index = 0;
+
+    std::pair<std::unordered_multimap<uint64_t, size_t>::const_iterator,
+              std::unordered_multimap<uint64_t, size_t>::const_iterator> range = by_header.equal_range(wanted.header_hash);
+
+    for (; range.first != range.second; ++range.first) {
+        size_t i = range.first->second;
+        const CatalogRecord &entry = record(i);
+
+        if (!(entry.flags & CatalogRecord::CONTAINER) || entry.save_size != wanted.save_size ||
+            entry.id() != wanted.id() || entry.name() == skip)
+            continue;
+
+        if (!best || entry.created > best->created || (entry.created == best->created && i > best_index)) {
+            best = &entry;
+            best_index = i;
+        }
+    }
+
+    return best;
+}
+
+/* +--------------------------------------------------------------------+ */
+static bool looks_like_save(const struct stat &st) {
+/* +--------------------------------------------------------------------+ */
+    // Card saves are always a power of two, from 512 bytes up
+    return S_ISREG(st.st_mode) && st.st_size >= 512 && st.st_size <= 128 * 1024 * 1024 && (st.st_size & (st.st_size - 1)) == 0;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) rebuild()
+ * Replaces the catalog with one made from the dumps in dir
+ *
+ * +--------------------------------------------------------------------+ */
+bool Catalog::rebuild(const std::string &dir, unsigned threads) {
+/* +--------------------------------------------------------------------+ */
+    std::string path = dir + "/" + FILE_NAME, temp = path + ".tmp";
+    std::vector<std::string> names;
+    FileLock lock;
+    int held = -1;
+
+    // Appends (and other rebuilds) wait from before the scan until the new catalog is in place
+    do {
+        if (held >= 0)
+            ::close(held);
+
+        held = ::open(path.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+        if (held < 0)
+            return fail("Unable to open " + path + ", check your permissions");
+
+        lock.lock(held);
+    } while (replaced(held, path));
+
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        lock.unlock();
+        ::close(held);
+        return fail("Unable to read the directory " + dir);
+    }
+
+    while (struct dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == ".." || name == FILE_NAME ||
+            (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) ||
+            (name.size() > 8 && name.compare(name.size() - 8, 8, ".journal") == 0) ||
+            (name.size() > 4 && name.compare(name.size() - 4, 4, ".crc") == 0))
+            continue;
+
+        names.push_back(name);
+    }
+
+    closedir(d);
+
+    // Every file is read and hashed by whichever thread gets to it first
+    std::vector<CatalogRecord> found (names.size());
+    std::vector<long long> written (names.size());
+    std::vector<char> usable (names.size(), 0);
+
+    run_parallel(names.size(), threads, [&](size_t i) {
+        std::string path = dir + "/" + names[i];
+        ContainerInfo info;
+        struct stat st;
+
+        if (stat(path.c_str(), &st) != 0)
+            return;
+
+        written[i] = st.st_mtime * 1000000000LL;
+#ifdef __linux__
+        written[i] += st.st_mtim.tv_nsec;
+#endif
+
+        if (ContainerReader::peek(path, info)) {
+            uint32_t flags = CatalogRecord::CONTAINER | (info.parent.empty() ? 0 : CatalogRecord::INCREMENTAL);
+            found[i] = CatalogRecord::describe(names[i], info, flags);
+            usable[i] = 1;
+        }
+        else if (looks_like_save(st)) {
+            // A raw save says nothing about its card, only its contents can be matched
+            SaveFile file (SaveFile::SYNC_NONE);
+            if (!file.open(path))
+                return;
+
+            info.save_size = file.size();
+            info.save_hash = save_fingerprint(file.data(), file.size());
+            info.created = st.st_mtime;
+            found[i] = CatalogRecord::describe(names[i], info, 0);
+            usable[i] = 1;
+        }
+    });
+
+    // Written oldest first, as appends would have left them
+    std::vector<size_t> sorted;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (usable[i])
+            sorted.push_back(i);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [&found, &written](size_t a, size_t b) {
+        return found[a].created < found[b].created || (found[a].created == found[b].created && written[a] < written[b]);
+    });
+
+    int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    bool ok = out >= 0 && write_all(out, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) &&
+              write_all(out, &CATALOG_VERSION, sizeof(CATALOG_VERSION));
+
+    for (size_t i = 0; ok && i < sorted.size(); i++) {
+        CatalogRecord &entry = found[sorted[i]];
+        entry.check = record_check(entry);
+        ok = write_all(out, &entry, sizeof(entry));
+    }
+
+    ok = ok && fsync(out) == 0;
+    if (out >= 0)
+        ::close(out);
+
+#ifdef _WIN32
+    // Windows won't replace a file that's still open
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    ::close(held);
+    held = -1;
+#endif
+
+    ok = ok && replace_file(temp, path);
+    if (!ok)
+        remove(temp.c_str());
+
+    lock.unlock();
+    if (held >= 0)
+        ::close(held);
+
+    return ok ? open(dir, true) : fail("Unable to write " + path + ", check your permissions and free space");
+}
@@ -0,0 +1,237 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include <algorithm>
+
+/*
+    Finding where two buffers first (or last) differ, for comparing a save
+    against the card a block at a time.  memcmp() only says whether they
+    differ; these say where, 32 bytes a step with AVX2 when the CPU has it,
+    16 with SSE2, and a machine word at a time anywhere else.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define COMPARE_X86
+  #include <immintrin.h>
+#endif
+
+/* +--------------------------------------------------------------------+ */
+static size_t first_difference_words(const char *a, const char *b, size_t start, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = start;
+
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y)
+            break;
+    }
+
+    for (; i < size; i++) {
+        if (a[i] != b[i])
+            return i;
+    }
+
+    return size;
+}
+
+/* +--------------------------------------------------------------------+ */
+static size_t last_difference_words(const char *a, const char *b, size_t end) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = end;
+
+    for (; i >= sizeof(uint64_t); i -= sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, a + i - sizeof(x), sizeof(x));
+        memcpy(&y, b + i - sizeof(y), sizeof(y));
+        if (x != y)
+            break;
+    }
+
+    for (; i > 0; i--) {
+        if (a[i - 1] != b[i - 1])
+            return i - 1;
+    }
+
+    return (size_t) -1;
+}
+
+#ifdef COMPARE_X86
+/* +--------------------------------------------------------------------+ */
+static size_t first_difference_sse2(const char *a, const char *b, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+
+        if (same != 0xFFFF)
+            return i + __builtin_ctz(~same);
+    }
+
+    return first_difference_words(a, b, i, size);
+}
+
+/* +--------------------------------------------------------------------+ */
+__attribute__((target("avx2")))
+static size_t first_difference_avx2(const char *a, const char *b, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = 0;
+
+    // Long equal stretches go 128 bytes a step, so a whole image compares at memory speed
+    for (; i + 128 <= size; i += 128) {
+        const __m256i *x = reinterpret_cast<const __m256i *>(a + i), *y = reinterpret_cast<const __m256i *>(b + i);
+        __m256i same = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(x), _mm256_loadu_si256(y)),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256(x + 1), _mm256_loadu_si256(y + 1))),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256(x + 2), _mm256_loadu_si256(y + 2)),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256(x + 3), _mm256_loadu_si256(y + 3))));
+
+        if ((unsigned) _mm256_movemask_epi8(same) != 0xFFFFFFFF)
+            break;
+    }
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+        if (same != 0xFFFFFFFF)
+            return i + __builtin_ctz(~same);
+    }
+
+    return first_difference_words(a, b, i, size);
+}
+
+/* +--------------------------------------------------------------------+ */
+static size_t last_difference_sse2(const char *a, const char *b, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = size;
+
+    for (; i >= 16; i -= 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i - 16));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i - 16));
+        unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+
+        if (differ)
+            return i - 16 + (31 - __builtin_clz(differ));
+    }
+
+    return last_difference_words(a, b, i);
+}
+
+/* +--------------------------------------------------------------------+ */
+__attribute__((target("avx2")))
+static size_t last_difference_avx2(const char *a, const char *b, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = size;
+
+    for (; i >= 32; i -= 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i - 32));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i - 32));
+        unsigned differ = ~(unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+        if (differ)
+            return i - 32 + (31 - __builtin_clz(differ));
+    }
+
+    return last_difference_words(a, b, i);
+}
+#endif
+
+/* +--------------------------------------------------------------------+
+ *
+ * (size_t) first_difference()
+ * Offset of the first byte a and b differ in, size if they don't
+ *
+ * +--------------------------------------------------------------------+ */
+size_t first_difference(const char *a, const char *b, size_t size) {
+/* +--------------------------------------------------------------------+ */
+#ifdef COMPARE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? first_difference_avx2(a, b, size) : first_difference_sse2(a, b, size);
+#else
+    return first_difference_words(a, b, 0, size);
+#endif
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (size_t) last_difference()
+ * Offset of the last byte a and b differ in, size if they don't
+ *
+ * +--------------------------------------------------------------------+ */
+size_t last_difference(const char *a, const char *b, size_t size) {
+/* +--------------------------------------------------------------------+ */
+#ifdef COMPARE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    size_t last = avx2 ? last_difference_avx2(a, b, size) : last_difference_sse2(a, b, size);
+#else
+    size_t last = last_difference_words(a, b, size);
+#endif
+
+    return last == (size_t) -1 ? size : last;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (size_t) diff_blocks()
+ * The ranges two images differ in, a block at a time, returns how many
+ * blocks differ.  A block contributes its first to last differing byte,
+ * and ranges that run on from one block into the next are joined up.
+ *
+ * +--------------------------------------------------------------------+ */
+size_t diff_blocks(const char *a, const char *b, size_t size, size_t block, std::vector<DiffRange> &ranges) {
+/* +--------------------------------------------------------------------+ */
+    size_t blocks = 0, pos = 0;
+
+    while (pos < size) {
+        // Equal blocks are skipped over in one go
+        size_t at = pos + first_difference(a + pos, b + pos, size - pos);
+        if (at >= size)
+            break;
+
+        size_t start = at / block * block, end = std::min(start + block, size);
+        size_t last = start + last_difference(a + start, b + start, end - start);
+        blocks++;
+
+        if (!ranges.empty() && ranges.back().end == at)
+            ranges.back().end = last + 1;
+        else {
+            DiffRange range = { at, last + 1 };
+            ranges.push_back(range);
+        }
+
+        pos = end;
+    }
+
+    return blocks;
+}
@@ -0,0 +1,612 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "container.h"
+#include "savefile.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #define fsync _commit
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+static const char MAGIC[4] = { '0', '0', '5', 'C' };
+static const uint32_t VERSION = 2, BLOCK_SIZE = 4096;
+
+const uint32_t ContainerWriter::REBASE_DEPTH;
+
+struct ContainerHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t header_size;       // this plus the card header, where the index starts
+    uint32_t save_size;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t card_type;
+    uint32_t card_header_size;
+    uint64_t created;
+    uint64_t save_hash;
+    char firmware[32];
+    char card_id[16];
+    char card_title[32];
+
+    // Version 2 on, zero when read from a version 1 header
+    uint64_t parent_hash;
+    uint32_t depth;
+    uint32_t reserved;
+    char parent[64];
+};
+
+// Everything a version 1 header had
+static const size_t V1_HEADER_SIZE = offsetof(ContainerHeader, parent_hash);
+
+struct BlockEntry {
+    uint64_t offset;            // from the start of the file
+    uint32_t size;              // bytes stored, 0 for a fill block
+    uint8_t method;
+    uint8_t fill;
+    uint16_t reserved;
+    uint64_t hash;              // xxh64 of the unpacked block
+};
+
+enum {
+    METHOD_FILL   = 0,
+    METHOD_LZ     = 1,
+    METHOD_STORED = 2,
+    METHOD_PARENT = 3       // the same as the parent's block
+};
+
+/* +--------------------------------------------------------------------+ */
+static void put_string(char *field, size_t size, const std::string &value) {
+/* +--------------------------------------------------------------------+ */
+    memset(field, 0, size);
+    memcpy(field, value.data(), std::min(value.size(), size));
+}
+
+/* +--------------------------------------------------------------------+ */
+static std::string get_string(const char *field, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    return std::string(field, std::find(field, field + size, '\0'));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (uint64_t) save_fingerprint()
+ * xxh64 over the xxh64 of each block, as a container's header has it
+ *
+ * +--------------------------------------------------------------------+ */
+uint64_t save_fingerprint(const char *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    std::vector<uint64_t> hashes;
+
+    for (size_t pos = 0; pos < size; pos += BLOCK_SIZE)
+        hashes.push_back(xxh64(data + pos, std::min<size_t>(BLOCK_SIZE, size - pos)));
+
+    return hashes.empty() ? 0 : xxh64(&hashes[0], hashes.size() * sizeof(uint64_t));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) same_card()
+ * Whether two dumps came from the same card, going by its header
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerInfo::same_card(const ContainerInfo &other) const {
+/* +--------------------------------------------------------------------+ */
+    return card_id == other.card_id && card_header == other.card_header && save_size == other.save_size;
+}
+
+/* +--------------------------------------------------------------------+ */
+ContainerWriter::ContainerWriter() : fd(-1), block_count(0), reused(0), data_start(0), data_end(0) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+ */
+ContainerWriter::~ContainerWriter() {
+/* +--------------------------------------------------------------------+ */
+    // Never finished, so it never replaces anything
+    if (fd >= 0) {
+        ::close(fd);
+        remove(temp_path.c_str());
+    }
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ContainerWriter::fail(const std::string &message) {
+/* +--------------------------------------------------------------------+ */
+    last_error = message;
+    return false;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) create()
+ * Starts writing a container for the save described by details
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerWriter::create(const std::string &path, const ContainerInfo &details) {
+/* +--------------------------------------------------------------------+ */
+    // Built under another name and renamed into place once it's complete
+    target_path = path;
+    temp_path = path + ".tmp";
+    info = details;
+
+    fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+        return fail("Unable to open " + path + " for writing, check your permissions");
+
+    block_count = (info.save_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    data_start = data_end = sizeof(ContainerHeader) + info.card_header.size() + block_count * sizeof(BlockEntry);
+
+    // The header and index go in front at the end, when we know what they say
+    if (lseek(fd, data_start, SEEK_SET) != (off_t) data_start)
+        return fail("Unable to write to " + path);
+
+    block.reserve(BLOCK_SIZE);
+    packed.resize(BLOCK_SIZE + BLOCK_SIZE / 255 + 16);
+    index.assign(block_count * sizeof(BlockEntry), 0);
+    hashes.clear();
+    parent_hashes.clear();
+    reused = 0;
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) set_parent()
+ * Makes this an incremental dump on top of the one at path
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerWriter::set_parent(const std::string &path, const ContainerReader &parent) {
+/* +--------------------------------------------------------------------+ */
+    const ContainerInfo &details = parent.details();
+
+    if (!hashes.empty() || !details.same_card(info) || parent.blocks() != block_count)
+        return fail(path + " isn't a dump of this card");
+
+    info.parent = path.substr(path.find_last_of("/\\") + 1);
+    info.parent_hash = details.save_hash;
+    info.depth = details.depth + 1;
+
+    // Blocks are matched against these as they come in
+    parent_hashes.resize(block_count);
+    for (uint32_t b = 0; b < block_count; b++)
+        parent_hashes[b] = parent.block_hash(b);
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) append()
+ * Adds the next part of the save, packing each block as it fills
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerWriter::append(const char *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    while (size > 0 && hashes.size() < block_count) {
+        size_t block_length = std::min<size_t>(BLOCK_SIZE, info.save_size - hashes.size() * BLOCK_SIZE);
+        size_t take = std::min(size, block_length - block.size());
+
+        block.insert(block.end(), data, data + take);
+        data += take;
+        size -= take;
+
+        if (block.size() == block_length && !flush_block())
+            return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ContainerWriter::flush_block() {
+/* +--------------------------------------------------------------------+ */
+    const char *p = &block[0];
+    size_t n = block.size();
+    BlockEntry entry = { data_end, 0, METHOD_FILL, (uint8_t) p[0], 0, xxh64(p, n) };
+
+    // Unchanged since the parent, or one byte repeated (almost always 0xFF), is just its index entry
+    if (!parent_hashes.empty() && parent_hashes[hashes.size()] == entry.hash) {
+        entry.method = METHOD_PARENT;
+        reused++;
+    }
+    else if (n > 1 && memcmp(p, p + 1, n - 1) != 0) {
+        size_t packed_size = lz_compress(p, n, &packed[0], packed.size());
+
+        if (packed_size > 0 && packed_size < n) {
+            entry.method = METHOD_LZ;
+            entry.size = packed_size;
+            p = &packed[0];
+        }
+        else {
+            entry.method = METHOD_STORED;
+            entry.size = n;
+        }
+
+        if (!write_all(fd, p, entry.size))
+            return fail("Unable to write to " + target_path + ", the disk may be full");
+
+        data_end += entry.size;
+    }
+
+    memcpy(&index[hashes.size() * sizeof(BlockEntry)], &entry, sizeof(entry));
+    hashes.push_back(entry.hash);
+    block.clear();
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) finish()
+ * Writes the header and index, then puts the container in place
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerWriter::finish(bool sync) {
+/* +--------------------------------------------------------------------+ */
+    if (fd < 0)
+        return fail("Nothing was written to " + target_path);
+
+    if (hashes.size() < block_count)
+        return fail("The save for " + target_path + " ended early");
+
+    ContainerHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.header_size = sizeof(header) + info.card_header.size();
+    header.save_size = info.save_size;
+    header.block_size = BLOCK_SIZE;
+    header.block_count = block_count;
+    header.card_type = info.card_type;
+    header.card_header_size = info.card_header.size();
+    header.created = info.created;
+    header.save_hash = info.save_hash = hashes.empty() ? 0 : xxh64(&hashes[0], hashes.size() * sizeof(uint64_t));
+    put_string(header.firmware, sizeof(header.firmware), info.firmware);
+    put_string(header.card_id, sizeof(header.card_id), info.card_id);
+    put_string(header.card_title, sizeof(header.card_title), info.card_title);
+    put_string(header.parent, sizeof(header.parent), info.parent);
+    header.parent_hash = info.parent_hash;
+    header.depth = info.depth;
+
+    bool ok = lseek(fd, 0, SEEK_SET) == 0 && write_all(fd, &header, sizeof(header)) &&
+              (info.card_header.empty() || write_all(fd, &info.card_header[0], info.card_header.size())) &&
+              (index.empty() || write_all(fd, &index[0], index.size())) &&
+              (!sync || fsync(fd) == 0);
+
+    ::close(fd);
+    fd = -1;
+
+    if (!ok || !replace_file(temp_path, target_path)) {
+        remove(temp_path.c_str());
+        return fail("Unable to write to " + target_path + ", the disk may be full");
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) is_container()
+ * Whether data starts like a container, so anything else is a raw save
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerReader::is_container(const char *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    return size >= sizeof(ContainerHeader) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) peek()
+ * Reads just the header of the container at path
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerReader::peek(const std::string &path, ContainerInfo &details) {
+/* +--------------------------------------------------------------------+ */
+    std::ifstream file (path.c_str(), std::ios::binary);
+    ContainerHeader header;
+    ContainerReader reader;
+
+    if (!file.read(reinterpret_cast<char *>(&header), V1_HEADER_SIZE) || !is_container(header.magic, sizeof(header)))
+        return false;
+
+    std::vector<char> head (header.header_size);
+    file.seekg(0);
+
+    if (header.header_size < V1_HEADER_SIZE || header.header_size > 64 * 1024 || !file.read(&head[0], head.size()))
+        return false;
+
+    // Just the details, the index isn't needed
+    if (!reader.parse(&head[0], head.size(), false))
+        return false;
+
+    details = reader.info;
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) latest_dump()
+ * Newest container in dir from the same card, other than skip
+ *
+ * +--------------------------------------------------------------------+ */
+std::string ContainerReader::latest_dump(const std::string &dir, const ContainerInfo &card, const std::string &skip) {
+/* +--------------------------------------------------------------------+ */
+    std::string latest;
+    uint64_t latest_time = 0;
+    long long latest_written = 0;
+    DIR *d = opendir(dir.c_str());
+
+    if (!d)
+        return latest;
+
+    while (struct dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        ContainerInfo details;
+
+        if (name == skip || name == "." || name == ".." || !peek(dir + "/" + name, details))
+            continue;
+
+        if (!details.same_card(card))
+            continue;
+
+        // Dumps taken within the same second are told apart by when the file was written
+        struct stat st;
+        long long written = stat((dir + "/" + name).c_str(), &st) == 0 ? st.st_mtime * 1000000000LL : 0;
+#ifdef __linux__
+        written += st.st_mtim.tv_nsec;
+#endif
+
+        if (latest.empty() || details.created > latest_time || (details.created == latest_time && written > latest_written)) {
+            latest = dir + "/" + name;
+            latest_time = details.created;
+            latest_written = written;
+        }
+    }
+
+    closedir(d);
+    return latest;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) open()
+ * Maps the container at path, along with every parent it builds on
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerReader::open(const std::string &path) {
+/* +--------------------------------------------------------------------+ */
+    if (!mapped.open(path)) {
+        last_error = "Unable to open " + path + " for reading";
+        return false;
+    }
+
+    if (!parse(mapped.data(), mapped.size()))
+        return false;
+
+    if (!info.parent.empty()) {
+        std::string dir = path.find_last_of("/\\") == std::string::npos ? "." : path.substr(0, path.find_last_of("/\\"));
+
+        parent.reset(new ContainerReader());
+        if (info.depth > ContainerWriter::REBASE_DEPTH * 4 || !parent->open(dir + "/" + info.parent)) {
+            last_error = "Unable to read " + info.parent + ", the dump this one builds on";
+            return false;
+        }
+
+        if (parent->info.save_hash != info.parent_hash || parent->block_count != block_count) {
+            last_error = info.parent + " has changed since this dump was built on it";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse()
+ * Checks the header at data, and that the index is all there if asked
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerReader::parse(const char *data, size_t size, bool with_index) {
+/* +--------------------------------------------------------------------+ */
+    ContainerHeader header;
+
+    if (!is_container(data, size)) {
+        last_error = "Not a save container";
+        return false;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, data, V1_HEADER_SIZE);
+
+    if (header.version > VERSION) {
+        last_error = "The container was written by a newer version";
+        return false;
+    }
+
+    size_t fixed_size = header.version == 1 ? V1_HEADER_SIZE : sizeof(header);
+    if (size >= fixed_size)
+        memcpy(&header, data, fixed_size);
+
+    uint64_t index_end = (uint64_t) header.header_size + (uint64_t) header.block_count * sizeof(BlockEntry);
+
+    if (header.block_size == 0 || header.header_size != fixed_size + header.card_header_size || header.header_size > size ||
+        header.block_count != (header.save_size + (uint64_t) header.block_size - 1) / header.block_size) {
+        last_error = "The container's header is damaged";
+        return false;
+    }
+
+    base = data;
+    length = size;
+    entries = data + header.header_size;
+    block_size = header.block_size;
+    block_count = header.block_count;
+
+    info.save_size = header.save_size;
+    info.card_type = header.card_type;
+    info.created = header.created;
+    info.save_hash = header.save_hash;
+    info.firmware = get_string(header.firmware, sizeof(header.firmware));
+    info.card_id = get_string(header.card_id, sizeof(header.card_id));
+    info.card_title = get_string(header.card_title, sizeof(header.card_title));
+    info.card_header.assign(data + fixed_size, data + header.header_size);
+    info.parent = get_string(header.parent, sizeof(header.parent));
+    info.parent_hash = header.parent_hash;
+    info.depth = header.depth;
+
+    if (with_index && index_end > size) {
+        last_error = "The container is truncated";
+        return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+uint64_t ContainerReader::block_hash(uint32_t b) const {
+/* +--------------------------------------------------------------------+ */
+    BlockEntry entry;
+    memcpy(&entry, entries + b * sizeof(BlockEntry), sizeof(entry));
+    return entry.hash;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ContainerReader::unpack(uint32_t b, char *out) const {
+/* +--------------------------------------------------------------------+ */
+    BlockEntry entry;
+    memcpy(&entry, entries + b * sizeof(BlockEntry), sizeof(entry));
+
+    size_t n = std::min<size_t>(block_size, info.save_size - (size_t) b * block_size);
+    bool ok = entry.offset <= length && entry.size <= length - entry.offset;
+
+    if (ok && entry.method == METHOD_FILL)
+        memset(out, entry.fill, n);
+    else if (ok && entry.method == METHOD_LZ)
+        ok = lz_decompress(base + entry.offset, entry.size, out, n);
+    else if (ok && entry.method == METHOD_STORED && entry.size == n)
+        memcpy(out, base + entry.offset, n);
+    else if (ok && entry.method == METHOD_PARENT && parent)
+        ok = parent->unpack(b, out);
+    else
+        ok = false;
+
+    if (!ok || xxh64(out, n) != entry.hash) {
+        std::ostringstream message;
+        message << "The container is damaged at offset 0x" << std::hex << (size_t) b * block_size;
+        last_error = message.str();
+        return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) read()
+ * Unpacks length bytes from offset, touching only the blocks they're in
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerReader::read(size_t offset, size_t size, char *out) const {
+/* +--------------------------------------------------------------------+ */
+    if (offset > info.save_size || size > info.save_size - offset) {
+        last_error = "Read past the end of the save";
+        return false;
+    }
+
+    std::vector<char> scratch (block_size);
+
+    while (size > 0) {
+        uint32_t b = offset / block_size;
+        size_t within = offset % block_size;
+        size_t n = std::min<size_t>(size, std::min<size_t>(block_size, info.save_size - (size_t) b * block_size) - within);
+
+        // Whole blocks go straight to out, partial ones through scratch
+        if (within == 0 && n == std::min<size_t>(block_size, info.save_size - (size_t) b * block_size)) {
+            if (!unpack(b, out))
+                return false;
+        }
+        else {
+            if (!unpack(b, &scratch[0]))
+                return false;
+            memcpy(out, &scratch[within], n);
+        }
+
+        out += n;
+        offset += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) read_all()
+ * Unpacks the whole save
+ *
+ * +--------------------------------------------------------------------+ */
+bool ContainerReader::read_all(std::vector<char> &out) const {
+/* +--------------------------------------------------------------------+ */
+    out.resize(info.save_size);
+    return out.empty() || read(0, out.size(), &out[0]);
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ContainerSink::process(PipelineBlock &block) {
+/* +--------------------------------------------------------------------+ */
+    if (!writer.append(block.data, block.length)) {
+        failure = writer.error();
+        return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool ContainerSink::finish(bool complete) {
+/* +--------------------------------------------------------------------+ */
+    // An interrupted download leaves whatever was there before alone
+    if (complete && !writer.finish(sync)) {
+        failure = writer.error();
+        return false;
+    }
+
+    return true;
+}
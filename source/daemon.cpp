@@ -0,0 +1,927 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "daemon.h"
+#include "fdstream.h"
+#include "memstream.h"
+#include "progress.h"
+#include "savefile.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <csignal>
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Downloads go out in frames of this size, other operations report progress as often
+static const int FRAME_BYTES = 32 * 1024;
+
+// Neither side accepts a frame bigger than this, comfortably more than any save
+static const uint32_t MAX_FRAME = 32 * 1024 * 1024;
+
+// How often an idle dongle is asked whether its card changed
+static const int CARD_POLL_MS = 1000;
+
+/* +--------------------------------------------------------------------+ */
+static bool read_all(int fd, void *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    char *p = static_cast<char *>(data);
+
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR && !cancel_token.requested())
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static void put_u16(buffer_t &buf, uint16_t v) {
+    buf.push_back(char(v));
+    buf.push_back(char(v >> 8));
+}
+
+static void put_u32(buffer_t &buf, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        buf.push_back(char(v >> (i * 8)));
+}
+
+static void put_string(buffer_t &buf, const std::string &s) {
+    put_u16(buf, s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+}
+
+static uint32_t get_u32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+    return u[0] | u[1] << 8 | u[2] << 16 | uint32_t(u[3]) << 24;
+}
+
+// Reads fields back out of a payload, going quietly empty once it runs out
+class PayloadReader {
+    public:
+        PayloadReader(const buffer_t &buf, size_t pos = 0) : buf(buf), pos(pos) {}
+
+        uint32_t u8() { return pos + 1 <= buf.size() ? (unsigned char) buf[pos++] : 0; }
+        uint32_t u16() { uint32_t lo = u8(); return lo | u8() << 8; }
+        uint32_t u32() { uint32_t lo = u16(); return lo | u16() << 16; }
+
+        std::string string() {
+            size_t len = u16();
+            len = std::min(len, buf.size() - pos);
+            pos += len;
+            return std::string(&buf[0] + pos - len, len);
+        }
+
+        size_t offset() const { return pos; }
+
+    private:
+        const buffer_t &buf;
+        size_t pos;
+};
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) send_frame()
+ * Writes one length-prefixed frame
+ *
+ * +--------------------------------------------------------------------+ */
+static bool send_frame(int fd, uint8_t type, const char *data = NULL, size_t size = 0) {
+/* +--------------------------------------------------------------------+ */
+    char header[5];
+    uint32_t length = size + 1;
+
+    for (int i = 0; i < 4; i++)
+        header[i] = char(length >> (i * 8));
+    header[4] = type;
+
+    return write_all(fd, header, sizeof(header)) && (size == 0 || write_all(fd, data, size));
+}
+
+static bool send_frame(int fd, uint8_t type, const buffer_t &payload) {
+    return send_frame(fd, type, payload.empty() ? NULL : &payload[0], payload.size());
+}
+
+static bool send_u32(int fd, uint8_t type, uint32_t value) {
+    buffer_t payload;
+    put_u32(payload, value);
+    return send_frame(fd, type, payload);
+}
+
+static bool send_done(int fd, bool ok, const std::string &message = "") {
+    buffer_t payload (1, ok);
+    payload.insert(payload.end(), message.begin(), message.end());
+    return send_frame(fd, RSP_DONE, payload);
+}
+
+static bool send_error(int fd, const std::string &message) {
+    return send_frame(fd, RSP_ERROR, buffer_t(message.begin(), message.end()));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) recv_frame()
+ * Reads one length-prefixed frame, false if the peer went away
+ *
+ * +--------------------------------------------------------------------+ */
+static bool recv_frame(int fd, uint8_t &type, buffer_t &payload) {
+/* +--------------------------------------------------------------------+ */
+    char header[5];
+    if (!read_all(fd, header, sizeof(header)))
+        return false;
+
+    uint32_t length = get_u32(header);
+    if (length < 1 || length > MAX_FRAME)
+        return false;
+
+    type = header[4];
+    payload.resize(length - 1);
+
+    return payload.empty() || read_all(fd, &payload[0], payload.size());
+}
+
+// What the daemon knows about a dongle and its card, sent as RSP_INFO
+struct CardSnapshot {
+    std::string name, version, card_id, card_title;
+    bool has_card;
+    int card_size, save_size;
+    buffer_t card_header;
+
+    void update(const HIDDevice *dev) {
+        name = dev->name;
+        version = dev->version;
+        has_card = dev->has_card;
+        card_id = dev->card_id;
+        card_title = dev->card_title;
+        card_size = dev->card_size;
+        save_size = dev->save_size;
+        card_header = dev->card_header;
+    }
+};
+
+/* +--------------------------------------------------------------------+
+ *
+ * (buffer_t) encode_info()
+ * uint8 has card, uint32 card size, uint32 save size, then name, version,
+ * card id and card title as uint16-prefixed strings, then the raw header
+ *
+ * +--------------------------------------------------------------------+ */
+static buffer_t encode_info(const CardSnapshot &card) {
+/* +--------------------------------------------------------------------+ */
+    buffer_t payload;
+
+    payload.push_back(card.has_card);
+    put_u32(payload, card.card_size);
+    put_u32(payload, card.save_size);
+    put_string(payload, card.name);
+    put_string(payload, card.version);
+    put_string(payload, card.card_id);
+    put_string(payload, card.card_title);
+    payload.insert(payload.end(), card.card_header.begin(), card.card_header.end());
+
+    return payload;
+}
+
+static CardSnapshot decode_info(const buffer_t &payload) {
+    PayloadReader in (payload);
+    CardSnapshot card;
+
+    card.has_card = in.u8();
+    card.card_size = in.u32();
+    card.save_size = in.u32();
+    card.name = in.string();
+    card.version = in.string();
+    card.card_id = in.string();
+    card.card_title = in.string();
+    card.card_header.assign(payload.begin() + in.offset(), payload.end());
+
+    return card;
+}
+
+/*
+    The daemon side.  Every dongle gets a worker thread that owns the
+    HIDDevice and works through its queue, so requests for different
+    dongles run in parallel and requests for the same one never overlap.
+*/
+struct DaemonJob {
+    uint8_t type;
+    int fd;
+    int save_size;
+    buffer_t image;
+    std::promise<void> done;
+};
+
+struct DaemonDevice {
+    HIDMatch match;
+    HIDDevice *dev;
+    std::thread worker;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<DaemonJob *> queue;
+    CardSnapshot card;      // guarded by lock, read by connection threads
+    bool stopping;
+};
+
+static const char *request_name(uint8_t type) {
+    switch (type) {
+        case REQ_INFO:     return "info";
+        case REQ_DOWNLOAD: return "download";
+        case REQ_UPLOAD:   return "upload";
+        case REQ_ERASE:    return "erase";
+        case REQ_VERIFY:   return "verify";
+        case REQ_CHECKSUM: return "checksum";
+    }
+
+    return "unknown";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) serve_job()
+ * Runs one queued request against the dongle, returns why it failed
+ *
+ * +--------------------------------------------------------------------+ */
+static std::string serve_job(DaemonDevice *dd, DaemonJob *job) {
+/* +--------------------------------------------------------------------+ */
+    HIDDevice *dev = dd->dev;
+    const int BLOCK_SIZE = 512;
+
+    if (dev->io_error)
+        return "device stopped responding";
+
+    // Only the header goes over the wire unless the card was swapped
+    if (dev->refresh_card()) {
+        std::lock_guard<std::mutex> guard(dd->lock);
+        dd->card.update(dev);
+    }
+
+    if (!dev->has_card)
+        return "no card inserted";
+
+    CardSnapshot card;
+    {
+        std::lock_guard<std::mutex> guard(dd->lock);
+        card = dd->card;
+    }
+
+    // A --save-size from the client only applies to its own request
+    int save_size = job->save_size > 0 ? job->save_size : dev->save_size;
+    if (job->type == REQ_UPLOAD && save_size <= 0)
+        save_size = job->image.size();
+
+    if (save_size <= 0)
+        return "unable to detect save size";
+
+    if ((job->type == REQ_UPLOAD || job->type == REQ_VERIFY) && (int) job->image.size() != save_size) {
+        std::ostringstream message;
+        message << "image is " << job->image.size() << " bytes, save size is " << save_size << " bytes";
+        return message.str();
+    }
+
+    card.save_size = save_size;
+    if (!send_frame(job->fd, RSP_INFO, encode_info(card)) || !send_u32(job->fd, RSP_START, save_size))
+        return "client went away";
+
+    struct SaveSizeScope {
+        HIDDevice *dev;
+        int saved;
+        ~SaveSizeScope() { dev->save_size = saved; }
+    } scope = { dev, dev->save_size };
+    dev->save_size = save_size;
+
+    int done = 0, reported = 0, mismatched = 0, first_mismatch = -1;
+
+    if (job->type == REQ_DOWNLOAD) {
+        buffer_t chunk (FRAME_BYTES);
+
+        while (done < save_size && !cancel_token.requested()) {
+            int len = std::min(FRAME_BYTES, save_size - done);
+            omemstream os (&chunk[0], len);
+
+            for (int off = 0; off < len && !dev->io_error; off += BLOCK_SIZE)
+                dev->read(os, done + off);
+
+            if (dev->io_error)
+                break;
+
+            if (!send_frame(job->fd, RSP_DATA, &chunk[0], len))
+                return "client went away";
+
+            done += len;
+        }
+    }
+    else if (job->type == REQ_UPLOAD) {
+        imemstream is (&job->image[0], save_size);
+
+        while (done < save_size && !dev->io_error && !cancel_token.requested()) {
+            dev->write(is);
+            done = is.tellg();
+
+            if (done - reported >= FRAME_BYTES || done >= save_size) {
+                if (!send_u32(job->fd, RSP_PROGRESS, done))
+                    return "client went away";
+                reported = done;
+            }
+        }
+    }
+    else if (job->type == REQ_ERASE) {
+        char blank[128];
+        std::fill(&blank[0], &blank[0] + sizeof(blank), 0xFF);
+        imemstream is (blank, sizeof(blank));
+
+        while (done < save_size && !dev->io_error && !cancel_token.requested()) {
+            is.seekg(0);
+            dev->write(is, done);
+            done += sizeof(blank);
+
+            if (done - reported >= FRAME_BYTES || done >= save_size) {
+                if (!send_u32(job->fd, RSP_PROGRESS, std::min(done, save_size)))
+                    return "client went away";
+                reported = done;
+            }
+        }
+    }
+    else if (job->type == REQ_VERIFY) {
+        char block[BLOCK_SIZE];
+        omemstream os (block, BLOCK_SIZE);
+
+        while (done < save_size && !dev->io_error && !cancel_token.requested()) {
+            os.seekp(0);
+            dev->read(os, done);
+            if (dev->io_error)
+                break;
+
+            int len = std::min(BLOCK_SIZE, save_size - done);
+            if (memcmp(block, &job->image[done], len) != 0) {
+                if (first_mismatch < 0)
+                    first_mismatch = done;
+                mismatched++;
+            }
+
+            done += len;
+            if (done - reported >= FRAME_BYTES || done >= save_size) {
+                if (!send_u32(job->fd, RSP_PROGRESS, done))
+                    return "client went away";
+                reported = done;
+            }
+        }
+    }
+
+    else if (job->type == REQ_CHECKSUM) {
+        SaveDigest::Algorithm algorithm = job->image.empty() || job->image[0] != SaveDigest::SHA256 ? SaveDigest::FINGERPRINT
+                                                                                                   : SaveDigest::SHA256;
+        SaveDigest digest (algorithm), fingerprint (SaveDigest::FINGERPRINT);
+        char block[BLOCK_SIZE];
+        omemstream os (block, BLOCK_SIZE);
+
+        while (done < save_size && !dev->io_error && !cancel_token.requested()) {
+            os.seekp(0);
+            dev->read(os, done);
+            if (dev->io_error)
+                break;
+
+            int len = std::min(BLOCK_SIZE, save_size - done);
+            digest.update(block, len);
+            if (algorithm != SaveDigest::FINGERPRINT)
+                fingerprint.update(block, len);
+
+            done += len;
+            if (done - reported >= FRAME_BYTES || done >= save_size) {
+                if (!send_u32(job->fd, RSP_PROGRESS, done))
+                    return "client went away";
+                reported = done;
+            }
+        }
+
+        if (done >= save_size) {
+            buffer_t payload;
+            std::string hex = digest.finish();
+            put_string(payload, hex);
+            put_string(payload, algorithm == SaveDigest::FINGERPRINT ? hex : fingerprint.finish());
+
+            if (!send_frame(job->fd, RSP_DIGEST, payload))
+                return "client went away";
+        }
+    }
+
+    if (dev->io_error)
+        return "device stopped responding";
+
+    if (done < save_size)
+        return "daemon is shutting down";
+
+    if (mismatched > 0) {
+        std::ostringstream message;
+        message << mismatched << " block(s) differ, the first at offset 0x" << std::hex << first_mismatch;
+        return message.str();
+    }
+
+    return "";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * device_worker()
+ * Works through one dongle's queue, watching for card swaps when idle
+ *
+ * +--------------------------------------------------------------------+ */
+static void device_worker(DaemonDevice *dd) {
+/* +--------------------------------------------------------------------+ */
+    std::unique_lock<std::mutex> guard(dd->lock);
+
+    while (true) {
+        dd->wake.wait_for(guard, std::chrono::milliseconds(CARD_POLL_MS),
+                          [dd] { return dd->stopping || !dd->queue.empty(); });
+
+        if (dd->queue.empty()) {
+            if (dd->stopping)
+                break;
+
+            // Keep the cached header fresh so info requests stay cheap
+            guard.unlock();
+            bool changed = !dd->dev->io_error && dd->dev->refresh_card();
+            guard.lock();
+
+            if (changed) {
+                dd->card.update(dd->dev);
+                std::cout << dd->match.path << ": card "
+                          << (dd->card.has_card ? "inserted" : "removed") << std::endl;
+            }
+            continue;
+        }
+
+        DaemonJob *job = dd->queue.front();
+        bool stopping = dd->stopping;
+        dd->queue.pop_front();
+        guard.unlock();
+
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+        std::string failure = stopping ? "daemon is shutting down" : serve_job(dd, job);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        send_done(job->fd, failure.empty(), failure);
+
+        std::cout << dd->match.path << ": " << request_name(job->type)
+                  << (failure.empty() ? " ok" : " failed, " + failure) << " ("
+                  << std::fixed << std::setprecision(2) << seconds << " s)" << std::endl;
+
+        job->done.set_value();
+        guard.lock();
+    }
+}
+
+// A client connection, reaped by the accept loop once its thread is done
+struct DaemonConnection {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> finished;
+};
+
+/* +--------------------------------------------------------------------+
+ *
+ * handle_connection()
+ * Reads one request and either answers it or queues it for a dongle
+ *
+ * +--------------------------------------------------------------------+ */
+static void handle_connection(DaemonConnection *conn, std::vector<DaemonDevice *> *devices) {
+/* +--------------------------------------------------------------------+ */
+    int fd = conn->fd;
+    uint8_t type;
+    buffer_t payload;
+
+    if (!recv_frame(fd, type, payload)) {
+        conn->finished = true;
+        return;
+    }
+
+    PayloadReader in (payload);
+    size_t index = in.u16();
+    int save_size = in.u32();
+
+    if (payload.size() < 6)
+        send_error(fd, "malformed request");
+    else if (index >= devices->size())
+        send_error(fd, "no such device");
+    else if (type == REQ_INFO) {
+        DaemonDevice *dd = (*devices)[index];
+        CardSnapshot card;
+        {
+            std::lock_guard<std::mutex> guard(dd->lock);
+            card = dd->card;
+        }
+
+        if (save_size > 0)
+            card.save_size = save_size;
+
+        send_frame(fd, RSP_INFO, encode_info(card));
+        send_done(fd, card.has_card, card.has_card ? "" : "no card inserted");
+    }
+    else if (type == REQ_DOWNLOAD || type == REQ_UPLOAD || type == REQ_ERASE || type == REQ_VERIFY || type == REQ_CHECKSUM) {
+        DaemonDevice *dd = (*devices)[index];
+        DaemonJob job;
+
+        job.type = type;
+        job.fd = fd;
+        job.save_size = save_size;
+        job.image.assign(payload.begin() + in.offset(), payload.end());
+
+        std::future<void> finished = job.done.get_future();
+        bool queued = false;
+        {
+            // Once a worker is told to stop it won't look at its queue again
+            std::lock_guard<std::mutex> guard(dd->lock);
+            if (!dd->stopping) {
+                dd->queue.push_back(&job);
+                queued = true;
+            }
+        }
+
+        if (queued) {
+            dd->wake.notify_one();
+            finished.wait();
+        }
+        else
+            send_error(fd, "daemon is shutting down");
+    }
+    else
+        send_error(fd, "unknown request");
+
+    conn->finished = true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) default_socket_path()
+ * Where the daemon listens unless --socket says otherwise
+ *
+ * +--------------------------------------------------------------------+ */
+std::string default_socket_path() {
+/* +--------------------------------------------------------------------+ */
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+        return std::string(runtime) + "/005tools.sock";
+
+    std::ostringstream path;
+    path << "/tmp/005tools-" << getuid() << ".sock";
+    return path.str();
+}
+
+static bool socket_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << path << " is too long for a socket path.\n";
+        return false;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) run_daemon()
+ * Opens every dongle and serves requests until Ctrl+C
+ *
+ * +--------------------------------------------------------------------+ */
+bool run_daemon(const std::string &socket_path) {
+/* +--------------------------------------------------------------------+ */
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr))
+        return false;
+
+    // A client hanging up mid-download shouldn't take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<HIDMatch> matches = probe_devices();
+    if (matches.empty()) {
+        std::cout << "Device not found (protip: make sure the device is plugged in, and permissions are set)\n";
+        return false;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "Unable to create a socket.\n";
+        return false;
+    }
+
+    // Only replace the socket if nobody is answering on it
+    if (connect(listener, (sockaddr *) &addr, sizeof(addr)) == 0) {
+        std::cerr << "Another daemon is already listening on " << socket_path << ".\n";
+        close(listener);
+        return false;
+    }
+
+    close(listener);
+    unlink(socket_path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_umask = umask(0077);
+    bool bound = bind(listener, (sockaddr *) &addr, sizeof(addr)) == 0 && listen(listener, 16) == 0;
+    umask(old_umask);
+
+    if (!bound) {
+        std::cerr << "Unable to listen on " << socket_path << ", check your permissions.\n";
+        close(listener);
+        return false;
+    }
+
+    std::vector<DaemonDevice *> devices;
+    for (size_t i = 0; i < matches.size(); i++) {
+        HIDDevice *dev = matches[i].driver->create(matches[i].path.c_str());
+
+        if (!dev->found) {
+            std::cout << "Unable to open " << matches[i].path << ", skipping it.\n";
+            delete dev;
+            continue;
+        }
+
+        configure_device(dev);
+
+        DaemonDevice *dd = new DaemonDevice();
+        dd->match = matches[i];
+        dd->dev = dev;
+        dd->stopping = false;
+        dd->card.update(dev);
+        devices.push_back(dd);
+
+        std::cout << "#" << devices.size() << " " << dev->name << " v" << dev->version
+                  << " (" << matches[i].path << "): "
+                  << (dev->has_card ? (dev->card_title.empty() ? "CTR card" : dev->card_id + " " + dev->card_title)
+                                    : "no card") << "\n";
+    }
+
+    for (size_t i = 0; i < devices.size(); i++)
+        devices[i]->worker = std::thread(device_worker, devices[i]);
+
+    std::cout << "Listening on " << socket_path << ", Ctrl+C to stop." << std::endl;
+
+    std::list<DaemonConnection> connections;
+
+    while (!cancel_token.requested()) {
+        for (std::list<DaemonConnection>::iterator c = connections.begin(); c != connections.end(); ) {
+            if (!c->finished) {
+                ++c;
+                continue;
+            }
+
+            c->thread.join();
+            close(c->fd);
+            c = connections.erase(c);
+        }
+
+        pollfd pfd = { listener, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        connections.emplace_back();
+        DaemonConnection &conn = connections.back();
+        conn.fd = fd;
+        conn.finished = false;
+        conn.thread = std::thread(handle_connection, &conn, &devices);
+    }
+
+    std::cout << "\nStopping." << std::endl;
+
+    close(listener);
+    unlink(socket_path.c_str());
+
+    // Anything still queued is turned away, and clients we're still
+    // waiting on are cut off
+    for (size_t i = 0; i < devices.size(); i++) {
+        {
+            std::lock_guard<std::mutex> guard(devices[i]->lock);
+            devices[i]->stopping = true;
+        }
+        devices[i]->wake.notify_one();
+    }
+
+    for (std::list<DaemonConnection>::iterator c = connections.begin(); c != connections.end(); ++c) {
+        shutdown(c->fd, SHUT_RDWR);
+        c->thread.join();
+        close(c->fd);
+    }
+
+    for (size_t i = 0; i < devices.size(); i++) {
+        devices[i]->worker.join();
+        delete devices[i]->dev;
+        delete devices[i];
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * print_card()
+ * The client's version of the device and card details main() prints
+ *
+ * +--------------------------------------------------------------------+ */
+static void print_card(const CardSnapshot &card) {
+/* +--------------------------------------------------------------------+ */
+    std::cout << card.name << " v" << card.version << " found." << "\n";
+
+    if (!card.has_card)
+        return;
+
+    if (card.card_title.size() > 0)
+        std::cout << "Detected game: " << card.card_id << " " << card.card_title
+                  << " (" << card.card_size << "Mb" << ")\n";
+    else
+        std::cout << "Detected unknown CTR-005 game (encrypted 3DS card)\n";
+
+    std::cout << "Save game size: ";
+    if (card.save_size > 1048576)
+        std::cout << (card.save_size / 1048576.00) << "MB\n";
+    else if (card.save_size > 0)
+        std::cout << (card.save_size / 1024.00) << "kB\n";
+    else
+        std::cout << "(unknown)\n";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) run_client()
+ * Sends one request to the daemon and reports on it like a normal run
+ *
+ * +--------------------------------------------------------------------+ */
+bool run_client(const std::string &socket_path, uint8_t request, const std::string &filename,
+                int device, int save_size, ClientDigest *checksum) {
+/* +--------------------------------------------------------------------+ */
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr))
+        return false;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    buffer_t payload;
+    put_u16(payload, device);
+    put_u32(payload, save_size);
+
+    bool piped = filename == "-";
+
+    if (request == REQ_CHECKSUM)
+        payload.push_back(checksum ? checksum->algorithm : SaveDigest::FINGERPRINT);
+
+    if (request == REQ_UPLOAD || request == REQ_VERIFY) {
+        std::unique_ptr<std::istream> file (piped ? static_cast<std::istream *>(new ipipestream(STDIN_FILENO))
+                                                  : new std::ifstream(filename, std::ios::binary));
+        if (!*file) {
+            std::cerr << "Unable to open " << filename << " for reading, check your permissions.\n";
+            return false;
+        }
+
+        payload.insert(payload.end(), std::istreambuf_iterator<char>(*file), std::istreambuf_iterator<char>());
+    }
+
+    std::unique_ptr<std::ostream> out;
+    if (request == REQ_DOWNLOAD) {
+        out.reset(piped ? static_cast<std::ostream *>(new ofdstream(stdout_fd))
+                        : new std::ofstream(filename, std::ios::binary | std::ios::trunc));
+        if (!*out) {
+            std::cerr << "Unable to open " << filename << " for writing, check your permissions.\n";
+            return false;
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || !send_frame(fd, request, payload)) {
+        std::cerr << "Unable to reach the daemon at " << socket_path << " (is \"005tools daemon\" running?)\n";
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    std::unique_ptr<ProgressRenderer> progress;
+    std::string message, digest;
+    CardSnapshot card;
+    long long received = 0;
+    bool ok = false, answered = false;
+    uint8_t type;
+    buffer_t frame;
+
+    while (!answered && recv_frame(fd, type, frame)) {
+        if (type == RSP_INFO) {
+            card = decode_info(frame);
+            print_card(card);
+        }
+        else if (type == RSP_START && frame.size() >= 4) {
+            if (checksum)
+                checksum->save_size = get_u32(&frame[0]);
+            std::cout << std::endl;
+            progress.reset(new ProgressRenderer(request_name(request), get_u32(&frame[0])));
+        }
+        else if (type == RSP_DATA && !frame.empty()) {
+            out->write(&frame[0], frame.size());
+            received += frame.size();
+            if (progress)
+                progress->update(received);
+        }
+        else if (type == RSP_PROGRESS && frame.size() >= 4 && progress)
+            progress->update(get_u32(&frame[0]));
+        else if (type == RSP_DIGEST) {
+            PayloadReader in (frame);
+            digest = in.string();
+            if (checksum) {
+                checksum->digest = digest;
+                checksum->fingerprint = strtoull(in.string().c_str(), NULL, 16);
+            }
+        }
+        else if (type == RSP_DONE && !frame.empty()) {
+            ok = frame[0] != 0;
+            message.assign(frame.begin() + 1, frame.end());
+            answered = true;
+        }
+        else if (type == RSP_ERROR) {
+            message.assign(frame.begin(), frame.end());
+            answered = true;
+        }
+    }
+
+    close(fd);
+
+    if (progress)
+        progress->finish(ok ? "done" : answered ? "failed" : "interrupted");
+
+    // Don't leave half a save lying around looking like a dump
+    if (out)
+        out->flush();
+
+    if (request == REQ_DOWNLOAD && !ok && !piped) {
+        out.reset();
+        unlink(filename.c_str());
+    }
+
+    if (!answered) {
+        std::cout << "\n" << (cancel_token.requested() ? "Interrupted" : "The daemon closed the connection")
+                  << ", the request didn't finish.";
+        return false;
+    }
+
+    if (!ok) {
+        std::cout << "\nFailed: " << message << ".";
+        return false;
+    }
+
+    if (request == REQ_DOWNLOAD)
+        std::cout << "\nData successfully downloaded to " << (piped ? "stdout" : filename) << ".";
+    else if (request == REQ_UPLOAD || request == REQ_ERASE)
+        std::cout << "\nData successfully written to game card.";
+    else if (request == REQ_VERIFY)
+        std::cout << "\nThe card's save matches " << (piped ? "stdin" : filename) << ".";
+    else if (request == REQ_CHECKSUM) {
+        // Keyed like the catalog, by card ID or else the header's hash
+        char key[17];
+        snprintf(key, sizeof(key), "%016llx", card.card_header.empty() ? 0ULL :
+                 (unsigned long long) xxh64(&card.card_header[0], card.card_header.size()));
+        std::cout << "\n" << digest << "  " << (card.card_id.size() || card.card_header.empty() ? card.card_id : key);
+    }
+
+    return true;
+}
@@ -0,0 +1,391 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include <algorithm>
+
+/*
+    Fast non-cryptographic hashing, used wherever we need to tell blocks of
+    save data apart quickly.  This is XXH64 by Yann Collet, which is public
+    domain in algorithm and easy enough to carry around ourselves.
+*/
+
+static const uint64_t
+    PRIME64_1 = 0x9E3779B185EBCA87ULL,
+    PRIME64_2 = 0xC2B2AE3D27D4EB4FULL,
+    PRIME64_3 = 0x165667B19E3779F9ULL,
+    PRIME64_4 = 0x85EBCA77C2B2AE63ULL,
+    PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (uint64_t) xxh64()
+ * 64-bit hash of a block of memory
+ *
+ * +--------------------------------------------------------------------+ */
+uint64_t xxh64(const void *data, size_t size, uint64_t seed) {
+/* +--------------------------------------------------------------------+ */
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        }
+        while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else
+        h = seed + PRIME64_5;
+
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= uint64_t(read32(p)) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/*
+    CRC32C (Castagnoli), the polynomial SSE 4.2 and ARMv8 have instructions
+    for.  Those are used when the CPU has them, otherwise a slicing-by-8
+    table lookup, which still does a 512 byte block in a few hundred cycles.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define CRC32C_X86
+  #include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+  #include <arm_acle.h>
+#endif
+
+// Built once, on first use by whichever thread gets there
+struct Crc32cTables {
+    uint32_t t[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0u - (crc & 1)));
+            t[0][i] = crc;
+        }
+
+        for (int n = 1; n < 8; n++) {
+            for (int i = 0; i < 256; i++)
+                t[n][i] = (t[n - 1][i] >> 8) ^ t[0][t[n - 1][i] & 0xFF];
+        }
+    }
+};
+
+/* +--------------------------------------------------------------------+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    static const Crc32cTables tables;
+    const uint32_t *t = tables.t[0];
+
+    for (; size >= 8; p += 8, size -= 8) {
+        uint32_t lo = read32(p) ^ crc, hi = read32(p + 4);
+        crc = t[7 * 256 + (lo & 0xFF)] ^ t[6 * 256 + ((lo >> 8) & 0xFF)] ^
+              t[5 * 256 + ((lo >> 16) & 0xFF)] ^ t[4 * 256 + (lo >> 24)] ^
+              t[3 * 256 + (hi & 0xFF)] ^ t[2 * 256 + ((hi >> 8) & 0xFF)] ^
+              t[1 * 256 + ((hi >> 16) & 0xFF)] ^ t[hi >> 24];
+    }
+
+    for (; size > 0; p++, size--)
+        crc = (crc >> 8) ^ t[(crc ^ *p) & 0xFF];
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/* +--------------------------------------------------------------------+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size) {
+/* +--------------------------------------------------------------------+ */
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    for (; size >= 8; p += 8, size -= 8)
+        wide = _mm_crc32_u64(wide, read64(p));
+    crc = (uint32_t) wide;
+#endif
+
+    for (; size >= 4; p += 4, size -= 4)
+        crc = _mm_crc32_u32(crc, read32(p));
+    for (; size > 0; p++, size--)
+        crc = _mm_crc32_u8(crc, *p);
+
+    return crc;
+}
+#endif
+
+/* +--------------------------------------------------------------------+
+ *
+ * (uint32_t) crc32c()
+ * CRC32C of a block of memory, continuing from crc
+ *
+ * +--------------------------------------------------------------------+ */
+uint32_t crc32c(const void *data, size_t size, uint32_t crc) {
+/* +--------------------------------------------------------------------+ */
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+
+#if defined(CRC32C_X86)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    crc = hardware ? crc32c_sse42(crc, p, size) : crc32c_table(crc, p, size);
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; size >= 8; p += 8, size -= 8)
+        crc = __crc32cd(crc, read64(p));
+    for (; size > 0; p++, size--)
+        crc = __crc32cb(crc, *p);
+#else
+    crc = crc32c_table(crc, p, size);
+#endif
+
+    return ~crc;
+}
+
+/*
+    SaveDigest hashes a save a block at a time as it comes off the card.
+    The fingerprint is xxh64 over the xxh64 of each 4kB block, exactly as
+    save_fingerprint() works it out for the catalog, so the two can be
+    compared.  SHA-256 (FIPS 180-4) is there for when the digest has to
+    mean something outside of 005Tools.
+*/
+
+static const size_t FINGERPRINT_BLOCK = 4096, SHA256_BLOCK = 64;
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse()
+ * Turns --hash's value into an algorithm
+ *
+ * +--------------------------------------------------------------------+ */
+bool SaveDigest::parse(const std::string &name, Algorithm &algorithm) {
+/* +--------------------------------------------------------------------+ */
+    if (name == "fast" || name == "xxh64")
+        algorithm = FINGERPRINT;
+    else if (name == "sha256")
+        algorithm = SHA256;
+    else
+        return false;
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+SaveDigest::SaveDigest(Algorithm algorithm) : algorithm(algorithm), length(0), result(0) {
+/* +--------------------------------------------------------------------+ */
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    std::copy(initial, initial + 8, state);
+    pending.reserve(algorithm == SHA256 ? SHA256_BLOCK : FINGERPRINT_BLOCK);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * update()
+ * Adds the next size bytes of the save
+ *
+ * +--------------------------------------------------------------------+ */
+void SaveDigest::update(const char *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t block = algorithm == SHA256 ? SHA256_BLOCK : FINGERPRINT_BLOCK;
+    length += size;
+
+    // Top up a part block first, then take whole blocks straight from data
+    if (!pending.empty()) {
+        size_t take = std::min(size, block - pending.size());
+        pending.insert(pending.end(), data, data + take);
+        data += take;
+        size -= take;
+
+        if (pending.size() < block)
+            return;
+
+        consume(&pending[0]);
+        pending.clear();
+    }
+
+    for (; size >= block; data += block, size -= block)
+        consume(data);
+
+    pending.assign(data, data + size);
+}
+
+/* +--------------------------------------------------------------------+ */
+void SaveDigest::consume(const char *block) {
+/* +--------------------------------------------------------------------+ */
+    if (algorithm == SHA256)
+        sha256_block(reinterpret_cast<const unsigned char *>(block));
+    else
+        hashes.push_back(xxh64(block, FINGERPRINT_BLOCK));
+}
+
+/* +--------------------------------------------------------------------+ */
+void SaveDigest::sha256_block(const unsigned char *block) {
+/* +--------------------------------------------------------------------+ */
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = uint32_t(block[i * 4]) << 24 | uint32_t(block[i * 4 + 1]) << 16 | uint32_t(block[i * 4 + 2]) << 8 | block[i * 4 + 3];
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) finish()
+ * The digest of everything added, in hex
+ *
+ * +--------------------------------------------------------------------+ */
+std::string SaveDigest::finish() {
+/* +--------------------------------------------------------------------+ */
+    char hex[65];
+
+    if (algorithm == FINGERPRINT) {
+        if (!pending.empty())
+            hashes.push_back(xxh64(&pending[0], pending.size()));
+        pending.clear();
+
+        result = hashes.empty() ? 0 : xxh64(&hashes[0], hashes.size() * sizeof(uint64_t));
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) result);
+        return hex;
+    }
+
+    // Padding: a 1 bit, zeros up to 56 bytes into a block, then the length in bits
+    uint64_t bits = length * 8;
+    char tail[SHA256_BLOCK * 2] = { (char) 0x80 };
+    size_t pad = (pending.size() < 56 ? 56 : 120) - pending.size();
+
+    for (int i = 0; i < 8; i++)
+        tail[pad + i] = char(bits >> (56 - i * 8));
+
+    update(tail, pad + 8);
+
+    for (int i = 0; i < 8; i++)
+        snprintf(hex + i * 8, 9, "%08x", state[i]);
+
+    return hex;
+}
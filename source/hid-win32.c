@@ -261,7 +261,38 @@ int HID_API_EXPORT hid_exit(void)
 	return 0;
 }
 
+/* Returns 1 if the VID/PID matches any entry of ids. A NULL list
+   matches every device. */
+static int match_device_id(const struct hid_device_id *ids, size_t count,
+                           unsigned short vendor_id, unsigned short product_id)
+{
+	size_t i;
+
+	if (ids == NULL)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		if (ids[i].vendor_id == vendor_id && ids[i].product_id == product_id)
+			return 1;
+	}
+
+	return 0;
+}
+
 struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_device_id id;
+
+	if (vendor_id == 0x0 && product_id == 0x0)
+		return hid_enumerate_ids(NULL, 0);
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+
+	return hid_enumerate_ids(&id, 1);
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ids(const struct hid_device_id *ids, size_t count)
 {
 	BOOL res;
 	struct hid_device_info *root = NULL; // return object
@@ -354,8 +385,7 @@ struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned shor
 
 		// Check the VID/PID to see if we should add this
 		// device to the enumeration list.
-		if ((vendor_id == 0x0 && product_id == 0x0) || 
-			(attrib.VendorID == vendor_id && attrib.ProductID == product_id)) {
+		if (match_device_id(ids, count, attrib.VendorID, attrib.ProductID)) {
 
 			#define WSTR_LEN 512
 			const char *str;
@@ -677,6 +707,12 @@ int HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *dev, int nonbloc
 	return 0; /* Success */
 }
 
+int HID_API_EXPORT HID_API_CALL hid_set_reconnect(hid_device *dev, int timeout_ms)
+{
+	/* Not implemented on Windows yet, a disconnected device stays that way */
+	return -1;
+}
+
 int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
 	BOOL res = HidD_SetFeature(dev->device_handle, (PVOID)data, length);
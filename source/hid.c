@@ -104,6 +104,14 @@ struct hid_device_ {
 
 	/* List of received input reports. */
 	struct input_report *input_reports;
+
+	/* What we need to find the device again after a disconnect,
+	   see hid_set_reconnect(). */
+	int reconnect_ms;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	char *path;
+	wchar_t *serial_number;
 };
 
 static int initialized = 0;
@@ -126,6 +134,11 @@ static hid_device *new_hid_device(void)
 	dev->shutdown_thread = 0;
 	dev->transfer = NULL;
 	dev->input_reports = NULL;
+	dev->reconnect_ms = 0;
+	dev->vendor_id = 0;
+	dev->product_id = 0;
+	dev->path = NULL;
+	dev->serial_number = NULL;
 
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
@@ -141,6 +154,9 @@ static void free_hid_device(hid_device *dev)
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	free(dev->path);
+	free(dev->serial_number);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -403,7 +419,38 @@ int HID_API_EXPORT hid_exit(void)
 	return 0;
 }
 
+/* Returns 1 if the VID/PID matches any entry of ids. A NULL list
+   matches every device. */
+static int match_device_id(const struct hid_device_id *ids, size_t count,
+                           unsigned short vendor_id, unsigned short product_id)
+{
+	size_t i;
+
+	if (ids == NULL)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		if (ids[i].vendor_id == vendor_id && ids[i].product_id == product_id)
+			return 1;
+	}
+
+	return 0;
+}
+
 struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_device_id id;
+
+	if (vendor_id == 0x0 && product_id == 0x0)
+		return hid_enumerate_ids(NULL, 0);
+
+	id.vendor_id = vendor_id;
+	id.product_id = product_id;
+
+	return hid_enumerate_ids(&id, 1);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_ids(const struct hid_device_id *ids, size_t count)
 {
 	libusb_device **devs;
 	libusb_device *dev;
@@ -449,8 +496,7 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 						interface_num = intf_desc->bInterfaceNumber;
 
 						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 && product_id == 0x0) ||
-						    (vendor_id == dev_vid && product_id == dev_pid)) {
+						if (match_device_id(ids, count, dev_vid, dev_pid)) {
 							struct hid_device_info *tmp;
 
 							/* VID/PID match. Create the record. */
@@ -737,6 +783,98 @@ static void *read_thread(void *param)
 }
 
 
+/* Opens usb_dev, claims the HID interface described by intf_desc and
+   starts the read thread. Used by hid_open_path(), and again by
+   reconnect_device() after a disconnect. Returns 0 on success. */
+static int open_interface(hid_device *dev, libusb_device *usb_dev,
+                          const struct libusb_interface_descriptor *intf_desc)
+{
+	struct libusb_device_descriptor desc;
+	int res;
+	int i;
+
+	libusb_get_device_descriptor(usb_dev, &desc);
+
+	res = libusb_open(usb_dev, &dev->device_handle);
+	if (res < 0) {
+		LOG("can't open device\n");
+		dev->device_handle = NULL;
+		return -1;
+	}
+
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+		if (res < 0) {
+			libusb_close(dev->device_handle);
+			dev->device_handle = NULL;
+			LOG("Unable to detach Kernel Driver\n");
+			return -1;
+		}
+	}
+
+	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+		libusb_close(dev->device_handle);
+		dev->device_handle = NULL;
+		return -1;
+	}
+
+	/* Store off the string descriptor indexes */
+	dev->manufacturer_index = desc.iManufacturer;
+	dev->product_index      = desc.iProduct;
+	dev->serial_index       = desc.iSerialNumber;
+
+	/* Store off the IDs and interface number */
+	dev->vendor_id = desc.idVendor;
+	dev->product_id = desc.idProduct;
+	dev->interface = intf_desc->bInterfaceNumber;
+
+	/* Find the INPUT and OUTPUT endpoints. An
+	   OUTPUT endpoint is not required. */
+	dev->input_endpoint = 0;
+	dev->output_endpoint = 0;
+	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep
+			= &intf_desc->endpoint[i];
+
+		/* Determine the type and direction of this
+		   endpoint. */
+		int is_interrupt =
+			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		int is_output =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_OUT;
+		int is_input =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_IN;
+
+		/* Decide whether to use it for intput or output. */
+		if (dev->input_endpoint == 0 &&
+		    is_interrupt && is_input) {
+			/* Use this endpoint for INPUT */
+			dev->input_endpoint = ep->bEndpointAddress;
+			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		}
+		if (dev->output_endpoint == 0 &&
+		    is_interrupt && is_output) {
+			/* Use this endpoint for OUTPUT */
+			dev->output_endpoint = ep->bEndpointAddress;
+		}
+	}
+
+	dev->shutdown_thread = 0;
+	pthread_create(&dev->thread, NULL, read_thread, dev);
+
+	// Wait here for the read thread to be initialized.
+	pthread_barrier_wait(&dev->barrier);
+
+	return 0;
+}
+
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
 {
 	hid_device *dev = NULL;
@@ -745,8 +883,6 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 	libusb_device **devs;
 	libusb_device *usb_dev;
-	ssize_t num_devs;
-	int res;
 	int d = 0;
 	int good_open = 0;
 
@@ -755,12 +891,10 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	if (!initialized)
 		hid_init();
 
-	num_devs = libusb_get_device_list(NULL, &devs);
+	libusb_get_device_list(NULL, &devs);
 	while ((usb_dev = devs[d++]) != NULL) {
-		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
-		libusb_get_device_descriptor(usb_dev, &desc);
+		int j,k;
 
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
 			continue;
@@ -773,83 +907,16 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
 					if (!strcmp(dev_path, path)) {
 						/* Matched Paths. Open this device */
-
-						// OPEN HERE //
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
- 							break;
-						}
-						good_open = 1;
-
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
-						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+						good_open = open_interface(dev, usb_dev, intf_desc) == 0;
+						if (!good_open) {
 							free(dev_path);
-							libusb_close(dev->device_handle);
-							good_open = 0;
 							break;
 						}
 
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for intput or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
-						}
-
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						// Wait here for the read thread to be initialized.
-						pthread_barrier_wait(&dev->barrier);
-
+						/* Remember how to find it again */
+						dev->path = strdup(path);
+						if (dev->serial_index > 0)
+							dev->serial_number = get_usb_string(dev->device_handle, dev->serial_index);
 					}
 					free(dev_path);
 				}
@@ -872,6 +939,141 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	}
 }
 
+/* Returns 1 if the device reports the given serial number. */
+static int serial_matches(libusb_device *usb_dev, uint8_t serial_index, const wchar_t *serial_number)
+{
+	libusb_device_handle *handle;
+	wchar_t *str;
+	int match;
+
+	if (libusb_open(usb_dev, &handle) < 0)
+		return 0;
+
+	str = get_usb_string(handle, serial_index);
+	match = str != NULL && wcscmp(str, serial_number) == 0;
+
+	free(str);
+	libusb_close(handle);
+
+	return match;
+}
+
+/* Looks for the device on the bus again and reopens it. A device with
+   a serial number has to report the same one (it may have come back
+   on a different port); otherwise it has to be at the same path. */
+static int reopen_device(hid_device *dev)
+{
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	int d = 0;
+	int res = -1;
+
+	if (libusb_get_device_list(NULL, &devs) < 0)
+		return -1;
+
+	while (res < 0 && (usb_dev = devs[d++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int j;
+
+		libusb_get_device_descriptor(usb_dev, &desc);
+		if (desc.idVendor != dev->vendor_id || desc.idProduct != dev->product_id)
+			continue;
+
+		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+			continue;
+
+		for (j = 0; j < conf_desc->bNumInterfaces && res < 0; j++) {
+			const struct libusb_interface_descriptor *intf_desc;
+			char *dev_path;
+			int same;
+
+			intf_desc = &conf_desc->interface[j].altsetting[0];
+			if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID ||
+			    intf_desc->bInterfaceNumber != dev->interface)
+				continue;
+
+			dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
+
+			if (dev->serial_number)
+				same = serial_matches(usb_dev, desc.iSerialNumber, dev->serial_number);
+			else
+				same = !strcmp(dev_path, dev->path);
+
+			if (same && open_interface(dev, usb_dev, intf_desc) == 0) {
+				free(dev->path);
+				dev->path = dev_path;
+				dev_path = NULL;
+				res = 0;
+			}
+			free(dev_path);
+		}
+		libusb_free_config_descriptor(conf_desc);
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return res;
+}
+
+/* Called from hid_read_timeout() and hid_write() when the device has
+   gone away. Without a reconnect policy this just reports the error.
+   Otherwise the old connection is torn down, as hid_close() would, and
+   the bus is polled until the device comes back or the policy's time
+   runs out. This happens on the calling thread, so the device must not
+   be used from other threads at the same time. */
+static int reconnect_device(hid_device *dev)
+{
+	struct timespec start, now;
+	long elapsed = 0;
+
+	if (dev->reconnect_ms <= 0 || dev->device_handle == NULL)
+		return -1;
+
+	/* Stop the read thread, if the disconnect hasn't already */
+	dev->shutdown_thread = 1;
+	libusb_cancel_transfer(dev->transfer);
+	pthread_join(dev->thread, NULL);
+
+	free(dev->transfer->buffer);
+	libusb_free_transfer(dev->transfer);
+	dev->transfer = NULL;
+
+	libusb_release_interface(dev->device_handle, dev->interface);
+	libusb_close(dev->device_handle);
+	dev->device_handle = NULL;
+
+	/* Anything still queued came from the old connection */
+	pthread_mutex_lock(&dev->mutex);
+	while (dev->input_reports) {
+		return_data(dev, NULL, 0);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	LOG("device disconnected, waiting %d ms for it to come back\n", dev->reconnect_ms);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (elapsed < dev->reconnect_ms) {
+		if (reopen_device(dev) == 0)
+			return HID_RECONNECTED;
+
+		usleep(100 * 1000);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+	}
+
+	/* Gave up, from now on every call fails */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_reconnect(hid_device *dev, int timeout_ms)
+{
+	dev->reconnect_ms = timeout_ms > 0 ? timeout_ms : 0;
+
+	return 0;
+}
+
 
 int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
@@ -879,6 +1081,13 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	int report_number = data[0];
 	int skipped_report_id = 0;
 
+	if (dev->device_handle == NULL)
+		return -1;
+
+	/* The read thread has seen the device disappear */
+	if (dev->shutdown_thread)
+		return reconnect_device(dev);
+
 	if (report_number == 0x0) {
 		data++;
 		length--;
@@ -896,6 +1105,8 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			(unsigned char *)data, length,
 			1000/*timeout millis*/);
 
+		if (res == LIBUSB_ERROR_NO_DEVICE)
+			return reconnect_device(dev);
 		if (res < 0)
 			return -1;
 
@@ -913,6 +1124,8 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 			length,
 			&actual_length, 1000);
 
+		if (res == LIBUSB_ERROR_NO_DEVICE)
+			return reconnect_device(dev);
 		if (res < 0)
 			return -1;
 
@@ -1028,6 +1241,10 @@ ret:
 	pthread_mutex_unlock(&dev->mutex);
 	pthread_cleanup_pop(0);
 
+	/* The device went away while we were waiting */
+	if (bytes_read < 0 && dev->shutdown_thread)
+		bytes_read = reconnect_device(dev);
+
 	return bytes_read;
 }
 
@@ -1110,22 +1327,25 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	/* A failed reconnect has already cleaned up the connection */
+	if (dev->device_handle) {
+		/* Cause read_thread() to stop. */
+		dev->shutdown_thread = 1;
+		libusb_cancel_transfer(dev->transfer);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+		/* Clean up the Transfer objects allocated in read_thread(). */
+		free(dev->transfer->buffer);
+		libusb_free_transfer(dev->transfer);
 
-	/* release the interface */
-	libusb_release_interface(dev->device_handle, dev->interface);
+		/* release the interface */
+		libusb_release_interface(dev->device_handle, dev->interface);
 
-	/* Close the handle */
-	libusb_close(dev->device_handle);
+		/* Close the handle */
+		libusb_close(dev->device_handle);
+	}
 
 	/* Clear out the queue of received reports. */
 	pthread_mutex_lock(&dev->mutex);
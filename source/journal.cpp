@@ -0,0 +1,235 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "journal.h"
+#include "savefile.h"
+
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #define fsync _commit
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+/* +--------------------------------------------------------------------+ */
+static uint32_t fnv1a(const void *data, size_t size, uint32_t hash = 2166136261u) {
+/* +--------------------------------------------------------------------+ */
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+
+    return hash;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * TransferJournal()
+ * Describes the transfer; nothing touches the disk until begin()/resume()
+ *
+ * +--------------------------------------------------------------------+ */
+TransferJournal::TransferJournal(const std::string &target, char op, const HIDDevice *dev)
+    : target_path(target), journal_path(target + ".journal"), data(NULL),
+      fd(-1), pass(0), committed(0), pending(0), written_pass(0) {
+/* +--------------------------------------------------------------------+ */
+    memcpy(header.magic, "005J", 4);
+    header.version = 1;
+    header.op = op;
+    header.save_size = dev->save_size;
+
+    // A journal only applies to the card it was written for
+    header.fingerprint = fnv1a(&dev->card_header[0], dev->card_header.size());
+}
+
+/* +--------------------------------------------------------------------+ */
+TransferJournal::~TransferJournal() {
+/* +--------------------------------------------------------------------+ */
+    if (fd >= 0)
+        close(fd);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (uint32_t) record_check()
+ * Checksum over a record's fields, so a half-written one is ignored
+ *
+ * +--------------------------------------------------------------------+ */
+uint32_t TransferJournal::record_check(const Record &rec) {
+/* +--------------------------------------------------------------------+ */
+    return fnv1a(&rec, offsetof(Record, check));
+}
+
+/* +--------------------------------------------------------------------+ */
+bool TransferJournal::append(const void *buf, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    if (write(fd, buf, size) != (int) size)
+        return false;
+
+    // No point syncing the journal if the data it describes isn't
+    return (data && !data->durable()) || fsync(fd) == 0;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) begin()
+ * Starts a fresh journal, throwing away any previous one
+ *
+ * +--------------------------------------------------------------------+ */
+bool TransferJournal::begin() {
+/* +--------------------------------------------------------------------+ */
+    fd = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+        return false;
+
+    pass = committed = pending = written_pass = 0;
+    return append(&header, sizeof(header));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) resume()
+ * Loads an existing journal and reports where the transfer got up to
+ *
+ * +--------------------------------------------------------------------+ */
+bool TransferJournal::resume(int &resume_pass, int &resume_offset) {
+/* +--------------------------------------------------------------------+ */
+    Header old;
+    Record rec;
+
+    fd = open(journal_path.c_str(), O_RDWR | O_BINARY);
+    if (fd < 0)
+        return false;
+
+    if (::read(fd, &old, sizeof(old)) != sizeof(old) || memcmp(&old, &header, sizeof(old)) != 0) {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    // Transfers are sequential, so the committed ranges form a prefix of each pass
+    long valid = sizeof(old);
+    while (::read(fd, &rec, sizeof(rec)) == sizeof(rec) && rec.check == record_check(rec)) {
+        if ((int) rec.pass != pass) {
+            pass = rec.pass;
+            committed = 0;
+        }
+
+        if ((int) rec.start <= committed && (int) rec.end > committed)
+            committed = rec.end;
+
+        valid += sizeof(rec);
+    }
+
+    // Drop anything torn off the end by a crash before we append to it
+    if (ftruncate(fd, valid) != 0 || lseek(fd, valid, SEEK_SET) != valid)
+        return false;
+
+    pending = committed;
+    written_pass = pass;
+
+    resume_pass = pass;
+    resume_offset = committed;
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * attach()
+ * Output file to sync before each commit (downloads only)
+ *
+ * +--------------------------------------------------------------------+ */
+void TransferJournal::attach(SaveFile &file) {
+/* +--------------------------------------------------------------------+ */
+    data = &file;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * complete()
+ * Marks everything up to end in the given pass as transferred
+ *
+ * +--------------------------------------------------------------------+ */
+void TransferJournal::complete(int new_pass, int end) {
+/* +--------------------------------------------------------------------+ */
+    if (new_pass != pass) {
+        commit();
+        pass = new_pass;
+        committed = 0;
+    }
+
+    pending = end;
+
+    if (pass != written_pass || pending - committed >= COMMIT_BYTES)
+        commit();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * commit()
+ * Makes the pending range durable, data first and then the journal
+ *
+ * +--------------------------------------------------------------------+ */
+void TransferJournal::commit() {
+/* +--------------------------------------------------------------------+ */
+    if (fd < 0 || (pending <= committed && pass == written_pass))
+        return;
+
+    if (data && !data->sync(committed, pending))
+        return;
+
+    Record rec = { (uint32_t) pass, (uint32_t) committed, (uint32_t) pending, 0 };
+    rec.check = record_check(rec);
+
+    if (append(&rec, sizeof(rec))) {
+        committed = pending;
+        written_pass = pass;
+    }
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * finish()
+ * The transfer completed, so the journal is no longer needed
+ *
+ * +--------------------------------------------------------------------+ */
+void TransferJournal::finish() {
+/* +--------------------------------------------------------------------+ */
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    remove(journal_path.c_str());
+}
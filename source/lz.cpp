@@ -0,0 +1,342 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+/*
+    A small LZ77 codec in the LZ4 block format: each sequence is a token
+    (literal count, match length - 4), the literals, and a 2 byte offset
+    back into what has already been decoded.  Nowhere near the ratio of
+    zlib, but it packs save blocks at several hundred MB/s and unpacks them
+    faster still, which is what matters with a USB device on the other end.
+
+    Given a dictionary, matches can also reach back into it as though it
+    came just before the data.  Small blocks have little history of their
+    own to match against, so a dictionary of what saves of one game tend
+    to contain is worth far more to them than to a whole save.
+*/
+
+static const int HASH_BITS = 12, DICT_HASH_BITS = 16;
+static const size_t MIN_MATCH = 4, LAST_LITERALS = 5, MATCH_LIMIT = 12, MAX_OFFSET = 65535;
+
+// Dictionaries are made of pieces this big
+static const size_t TRAIN_SEGMENT = 64;
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash_sequence(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline uint32_t hash_dict(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - DICT_HASH_BITS);
+}
+
+// Writes a 15-or-more length as 255s and a remainder, false if it won't fit
+static inline bool put_length(unsigned char *&op, const unsigned char *oend, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (op >= oend)
+            return false;
+        *op++ = 255;
+    }
+
+    if (op >= oend)
+        return false;
+
+    *op++ = (unsigned char) length;
+    return true;
+}
+
+// Emits one sequence: literals [anchor, ip) and, unless match is 0, a match
+static bool put_sequence(unsigned char *&op, const unsigned char *oend, const unsigned char *anchor,
+                         const unsigned char *ip, size_t offset, size_t match) {
+    size_t literals = ip - anchor;
+    unsigned char *token = op++;
+
+    if (token >= oend)
+        return false;
+
+    *token = (unsigned char) ((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15 && !put_length(op, oend, literals - 15))
+        return false;
+
+    if ((size_t) (oend - op) < literals)
+        return false;
+
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (match == 0)
+        return true;
+
+    if (oend - op < 2)
+        return false;
+
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) (offset >> 8);
+
+    match -= MIN_MATCH;
+    *token |= match >= 15 ? 15 : match;
+    return match < 15 || put_length(op, oend, match - 15);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (void) lz_prepare()
+ * Indexes a dictionary's sequences so every compress can start from it
+ *
+ * +--------------------------------------------------------------------+ */
+void lz_prepare(LzDictionary &dict) {
+/* +--------------------------------------------------------------------+ */
+    // Only the last 64kB can be reached by an offset
+    if (dict.data.size() > MAX_OFFSET)
+        dict.data.erase(dict.data.begin(), dict.data.end() - MAX_OFFSET);
+
+    // Position + 1 of the latest of each sequence, 0 for none
+    dict.table.assign(1 << DICT_HASH_BITS, 0);
+    const unsigned char *d = reinterpret_cast<const unsigned char *>(dict.data.data());
+
+    for (size_t pos = 0; pos + MIN_MATCH <= dict.data.size(); pos++)
+        dict.table[hash_dict(read32(d + pos))] = pos + 1;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (size_t) lz_compress()
+ * Packs size bytes into dst, 0 if it won't fit in capacity
+ *
+ * +--------------------------------------------------------------------+ */
+size_t lz_compress(const char *source, size_t size, char *dest, size_t capacity, const LzDictionary *dict) {
+/* +--------------------------------------------------------------------+ */
+    const unsigned char *src = reinterpret_cast<const unsigned char *>(source);
+    const unsigned char *ip = src, *anchor = src, *end = src + size;
+    unsigned char *op = reinterpret_cast<unsigned char *>(dest), *oend = op + capacity;
+
+    // A dictionary sits just before the data, as if it had been decoded already
+    const unsigned char *dstart = dict ? reinterpret_cast<const unsigned char *>(dict->data.data()) : NULL;
+    const unsigned char *dend = dict ? dstart + dict->data.size() : NULL;
+    bool use_dict = dict && dict->data.size() >= MIN_MATCH && !dict->table.empty();
+
+    // Positions of recent 4 byte sequences, stale entries just fail the compare
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    // As in LZ4, no match starts in the last 12 bytes or runs into the last 5
+    if (size > MATCH_LIMIT) {
+        const unsigned char *match_limit = end - MATCH_LIMIT, *match_end = end - LAST_LITERALS;
+
+        while (ip < match_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash_sequence(seq);
+            const unsigned char *ref = src + table[h];
+            table[h] = ip - src;
+
+            size_t offset = ip - ref;
+            const unsigned char *mp = ip, *rp = ref;
+
+            if (ref < ip && offset <= MAX_OFFSET && read32(ref) == seq) {
+                mp = ip + MIN_MATCH;
+                rp = ref + MIN_MATCH;
+                while (mp < match_end && *mp == *rp) {
+                    mp++;
+                    rp++;
+                }
+            }
+            else if (use_dict) {
+                // Nothing earlier in the data, so try the dictionary
+                uint32_t at = dict->table[hash_dict(seq)];
+                ref = dstart + at - 1;
+                offset = (ip - src) + (dend - ref);
+
+                if (at != 0 && offset <= MAX_OFFSET && read32(ref) == seq) {
+                    mp = ip + MIN_MATCH;
+                    rp = ref + MIN_MATCH;
+                    while (mp < match_end && rp < dend && *mp == *rp) {
+                        mp++;
+                        rp++;
+                    }
+                }
+            }
+
+            if (mp == ip) {
+                ip++;
+                continue;
+            }
+
+            if (!put_sequence(op, oend, anchor, ip, offset, mp - ip))
+                return 0;
+
+            ip = anchor = mp;
+        }
+    }
+
+    if (!put_sequence(op, oend, anchor, end, 0, 0))
+        return 0;
+
+    return op - reinterpret_cast<unsigned char *>(dest);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) lz_decompress()
+ * Unpacks exactly size bytes into dst, false if the input is damaged
+ *
+ * +--------------------------------------------------------------------+ */
+bool lz_decompress(const char *source, size_t length, char *dest, size_t size, const LzDictionary *dict) {
+/* +--------------------------------------------------------------------+ */
+    const unsigned char *ip = reinterpret_cast<const unsigned char *>(source), *iend = ip + length;
+    unsigned char *start = reinterpret_cast<unsigned char *>(dest), *op = start, *oend = op + size;
+    const unsigned char *dend = dict ? reinterpret_cast<const unsigned char *>(dict->data.data()) + dict->data.size() : NULL;
+    size_t dict_size = dict ? dict->data.size() : 0;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+
+        if (literals == 15) {
+            unsigned char b;
+            do {
+                if (ip >= iend)
+                    return false;
+                b = *ip++;
+                literals += b;
+            }
+            while (b == 255);
+        }
+
+        if ((size_t) (iend - ip) < literals || (size_t) (oend - op) < literals)
+            return false;
+
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence is only literals
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t) (op - start) + dict_size)
+            return false;
+
+        size_t match = token & 15;
+        if (match == 15) {
+            unsigned char b;
+            do {
+                if (ip >= iend)
+                    return false;
+                b = *ip++;
+                match += b;
+            }
+            while (b == 255);
+        }
+
+        match += MIN_MATCH;
+        if ((size_t) (oend - op) < match)
+            return false;
+
+        // Anything from before the start of the data comes out of the dictionary
+        if (offset > (size_t) (op - start)) {
+            size_t back = offset - (op - start);
+            const unsigned char *ref = dend - back;
+
+            for (; match > 0 && ref < dend; match--)
+                *op++ = *ref++;
+        }
+
+        // Byte at a time, a match may overlap what it's copying
+        const unsigned char *ref = op - offset;
+        while (match--)
+            *op++ = *ref++;
+    }
+
+    return op == oend;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (void) lz_train()
+ * Builds a dictionary of up to capacity bytes from what samples share
+ *
+ * +--------------------------------------------------------------------+ */
+void lz_train(const std::vector<LzSample> &samples, size_t capacity, LzDictionary &dict) {
+/* +--------------------------------------------------------------------+ */
+    struct Segment {
+        const char *data;
+        size_t count;
+    };
+
+    // Saves of one game keep things at the same places, so aligned segments line up across them
+    std::unordered_map<uint64_t, Segment> segments;
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        for (size_t pos = 0; pos + TRAIN_SEGMENT <= samples[i].size; pos += TRAIN_SEGMENT) {
+            const char *data = samples[i].data + pos;
+
+            // Runs of one byte value pack down to nothing anyway, they'd only take up room
+            size_t same = 1;
+            while (same < TRAIN_SEGMENT && data[same] == data[0])
+                same++;
+            if (same == TRAIN_SEGMENT)
+                continue;
+
+            Segment &segment = segments.insert(std::make_pair(xxh64(data, TRAIN_SEGMENT), Segment { data, 0 })).first->second;
+            segment.count++;
+        }
+    }
+
+    // Whatever turns up most often goes in, the commonest nearest the end where it's cheapest to reach
+    std::vector<Segment> ranked;
+    for (std::unordered_map<uint64_t, Segment>::const_iterator it = segments.begin(); it != segments.end(); ++it) {
+        if (it->second.count > 1)
+            ranked.push_back(it->second);
+    }
+
+    std::sort(ranked.begin(), ranked.end(), [](const Segment &a, const Segment &b) {
+        return a.count > b.count || (a.count == b.count && a.data < b.data);
+    });
+
+    capacity = std::min<size_t>(capacity, MAX_OFFSET);
+    size_t used = std::min(ranked.size(), capacity / TRAIN_SEGMENT);
+
+    dict.data.resize(used * TRAIN_SEGMENT);
+    for (size_t i = 0; i < used; i++)
+        memcpy(&dict.data[(used - 1 - i) * TRAIN_SEGMENT], ranked[i].data, TRAIN_SEGMENT);
+
+    lz_prepare(dict);
+}
@@ -31,11 +31,31 @@
 /* +--------------------------------------------------------------------+ */
 
 #include <clocale>
+#include <ctime>
 #include <iomanip>
 #include <typeinfo>
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <unordered_set>
+#include <dirent.h>
 #include "main.h"
+#include "archive.h"
+#include "catalog.h"
+#include "container.h"
+#include "daemon.h"
+#include "fdstream.h"
+#include "journal.h"
+#include "memstream.h"
+#include "pipeline.h"
+#include "progress.h"
 #include "r4isd.h"
+#include "savefile.h"
+#include "sidecar.h"
+#include "sketch.h"
 
 #ifdef __linux__
   #include <csignal>
@@ -75,99 +95,2724 @@ using namespace std;
 // Our HID device
 HIDDevice *dev;
 
+// Set when Ctrl+C is pressed
+CancelToken cancel_token;
+
+// Where a download to "-" goes, everything we print is sent to stderr instead
+int stdout_fd = STDOUT_FILENO;
+
+// How hard downloads try to reach the disk, see --fsync
+static SaveFile::Durability durability = SaveFile::SYNC_PERIODIC;
+
+// How saves are cut up for the --archive, see --chunking
+static Archive::Chunking chunking = Archive::FIXED;
+
+// How new chunks are stored in the --archive, see --compress
+static Archive::Compression compression = Archive::STORE;
+
+// Keys found in 3DS saves, by card, see --decrypt
+static PadCache pad_cache;
+
+// What checksum hashes the save with, see --hash
+static SaveDigest::Algorithm digest_algorithm = SaveDigest::FINGERPRINT;
+
+// What configure_device() gives every device, see --timeout, --retries and --reconnect;
+// -1 leaves the device's own default
+static int timeout_ms = -1, retry_limit = -1, reconnect_seconds = 0;
+
+// Every adapter we have a driver for, matched by probe_devices()
+static const HIDDriver *const hid_drivers[] = {
+    &R4iSaveDongle::driver,
+};
+
 // Commands
 const int ARG_INFO     = 1;
 const int ARG_DOWNLOAD = 2;
 const int ARG_UPLOAD   = 3;
 const int ARG_ERASE    = 4;
+const int ARG_VERIFY   = 5;
+const int ARG_BATCH    = 6;
+const int ARG_DAEMON   = 7;
+const int ARG_CLIENT   = 8;
+const int ARG_WATCH    = 9;
+const int ARG_ARCHIVE  = 10;
+const int ARG_IMPORT   = 11;
+const int ARG_EXPORT   = 12;
+const int ARG_CATALOG  = 13;
+const int ARG_TRAIN    = 14;
+const int ARG_CHECKSUM = 15;
+const int ARG_DIFF     = 16;
+const int ARG_DECRYPT  = 17;
+const int ARG_ENCRYPT  = 18;
+const int ARG_ANALYZE  = 19;
+
+int arg_passed;
+string arg_filename;
+string arg_filename2;
+int arg_client_command;
+
+struct cmd_opt {
+    string short_name;
+    string description;
+    string value_desc;
+    bool value_required;
+    bool specified;
+    string value;
+};
+
+map<string, cmd_opt> opts_in = {
+    { "--help",           { "-?", "Shows this help", "", NULL } },
+    { "--all",            { "-a", "Upload to every attached device at once", "", false } },
+    { "--archive",        { "-A", "Keep saves in the deduplicating archive at DIR, <filename> names a save in it", "DIR", true } },
+    { "--compress",       { "-z", "Compress new --archive chunks with none, lz, or dict against the game's dictionary (default none)", "MODE", true } },
+    { "--container",      { "-Z", "Write downloads as a compressed container that keeps the card's details (default for .005 files)", "", false } },
+    { "--incremental",    { "-I", "Only store what changed since the last container download of this card next to <filename>", "", false } },
+    { "--chunking",       { "-C", "Cut saves for the archive into fixed 512 byte or cdc (content-defined) chunks (default fixed)", "MODE", true } },
+    { "--output-header",  { "-h", "Save game header from device to FILE", "FILE", true } },
+    { "--output-firmware",{ "-f", "Save firmware information from device to FILE", "FILE", true } },
+    { "--key-file",       { "-k", "Save the key a downloaded 3DS save is encrypted with to FILE, or use the one in FILE to decrypt and encrypt", "FILE", true } },
+    { "--decrypt",        { "-X", "Decrypt a 3DS download with its key, cached per card once it's been found", "", false } },
+    { "--save-size",      { "-s", "Override detected save size with BYTES", "BYTES", true } },
+    { "--resume",         { "-r", "Continue an interrupted download or upload from its journal", "", false } },
+    { "--progress",       { "-g", "Report progress as a bar, jsonl events or none (default bar)", "MODE", true } },
+    { "--progress-fd",    { "-d", "Write --progress=jsonl events to file descriptor FD (default 2)", "FD", true } },
+    { "--socket",         { "-S", "Unix socket for daemon and client (default $XDG_RUNTIME_DIR/005tools.sock)", "PATH", true } },
+    { "--device",         { "-D", "Send client requests to the daemon's device N (default 1)", "N", true } },
+    { "--interval",       { "-i", "Check for a new card every MS milliseconds when watching (default 50)", "MS", true } },
+    { "--fsync",          { "-y", "Sync downloads to disk never, at the end, or as the journal commits (default periodic)", "MODE", true } },
+    { "--paranoid",       { "-p", "Read the save twice and re-read any block the two reads disagree on", "", false } },
+    { "--verify",         { "-V", "Read each block back as soon as it's written when uploading", "", false } },
+    { "--first-mismatch", { "-m", "Stop verifying at the first block that differs", "", false } },
+    { "--repair",         { "-P", "Re-read only the blocks of <filename> that no longer match its .crc checksums", "", false } },
+    { "--reconnect",      { "-c", "Wait up to SECONDS for the device to come back after a USB disconnect", "SECONDS", true } },
+    { "--timeout",        { "-t", "Give up on a command after MS milliseconds (default 1000, 0 waits forever)", "MS", true } },
+    { "--json",           { "-j", "Print what diff finds as JSON on stdout", "", false } },
+    { "--hash",           { "-H", "Hash saves for checksum with fast (the catalog's fingerprint) or sha256 (default fast)", "MODE", true } },
+    { "--rebuild",        { "-R", "Make the catalog afresh from the dumps in its directory", "", false } },
+    { "--find",           { "-F", "Only list dumps whose card ID, title or header hash is KEY", "KEY", true } },
+    { "--retries",        { "-n", "Resync and retry a failed block up to N times (default 3)", "N", true } },
+};
+
+struct command {
+    string description;
+    string file1;
+    string file2;
+};
+
+map<string, command> cmd_in = {
+    { "info", { "Display information about the currently inserted game card" } },
+    { "download", { "Downloads the currently inserted game card's save data and writes it to <filename>" } },
+    { "upload", { "Overwrites the currently inserted game card's save data with data from <filename> (see --all)" } },
+    { "erase", { "Erase the save data stored on the currently inserted game card" } },
+    { "verify", { "Compares the currently inserted game card's save data with <filename>" } },
+    { "checksum", { "Hashes the currently inserted game card's save without writing it anywhere, and looks for it in the catalog in the directory <filename>, if given" } },
+    { "batch", { "Runs the jobs listed in <filename> (or stdin) one after another, e.g. \"download a.sav; erase\"" } },
+    { "daemon", { "Keeps every device open and serves requests on a Unix socket (see --socket)" } },
+    { "watch", { "Downloads every card inserted to <filename>, which may use {card_id}, {card_title} and {timestamp}" } },
+    { "import", { "Packs the raw save <filename> into the container <filename2>" } },
+    { "export", { "Unpacks the container <filename> into the raw save <filename2>" } },
+    { "decrypt", { "Decrypts the 3DS save <filename> into <filename2>, with --key-file or the key cached for its card" } },
+    { "encrypt", { "Encrypts the decrypted 3DS save <filename> into <filename2>, ready to upload" } },
+    { "diff", { "Lists the byte ranges the saves (or containers) <filename> and <filename2> differ in, see --json" } },
+    { "archive", { "Copies the save file <filename> into the --archive, under its file name" } },
+    { "catalog", { "Lists the dumps catalogued in the directory <filename> (see --find and --rebuild)" } },
+    { "analyze", { "Counts blank chunks, keys and the most common chunks in the dumps in the directory <filename>, per save and overall" } },
+    { "train", { "Trains a compression dictionary per game on the dumps in the directory <filename>, for the --archive" } },
+    { "client", { "Sends another command, e.g. \"client download <filename>\", to a running daemon" } }
+};
+
+/* +-Functions----------------------------------------------------------+ */
+std::vector<HIDMatch> probe_devices();
+bool configure_device(HIDDevice *);
+void print_transfer_stats(HIDDevice *);
+bool device_ops();
+bool client_ops();
+bool archive_file(const std::string &filename);
+bool convert_file(int command, const std::string &from, const std::string &to);
+bool diff_files(const std::string &a, const std::string &b);
+bool crypt_file(int command, const std::string &from, const std::string &to);
+bool list_catalog(const std::string &dir);
+bool train_dictionaries(const std::string &dir);
+bool analyze_dir(const std::string &dir);
+bool upload_all();
+void handle_sigint();
+int write_save_data();
+int read_save_data();
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::vector<HIDMatch>) probe_devices()
+ * Finds every attached device that one of our drivers can handle
+ *
+ * +--------------------------------------------------------------------+ */
+std::vector<HIDMatch> probe_devices() {
+/* +--------------------------------------------------------------------+ */
+    const size_t count = sizeof(hid_drivers) / sizeof(hid_drivers[0]);
+    std::vector<HIDMatch> matches;
+    hid_device_id ids[count];
+
+    for (size_t i = 0; i < count; i++)
+        ids[i] = hid_drivers[i]->id;
+
+    // One pass over the bus, however many drivers we have
+    hid_device_info *devs = hid_enumerate_ids(ids, count);
+
+    for (hid_device_info *cur = devs; cur != NULL; cur = cur->next) {
+        for (size_t i = 0; i < count; i++) {
+            if (cur->vendor_id == ids[i].vendor_id && cur->product_id == ids[i].product_id) {
+                HIDMatch match = { hid_drivers[i], cur->path };
+                matches.push_back(match);
+                break;
+            }
+        }
+    }
+
+    hid_free_enumeration(devs);
+    return matches;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) configure_device()
+ * Applies the timeout, retry and reconnect options to an open device
+ *
+ * +--------------------------------------------------------------------+ */
+bool configure_device(HIDDevice *device) {
+/* +--------------------------------------------------------------------+ */
+    // Upload workers call this all at once, so it only reads what main() worked out
+    if (timeout_ms >= 0)
+        device->timeout_ms = timeout_ms;
+
+    if (retry_limit >= 0)
+        device->retry_limit = retry_limit;
+
+    // Ride out USB glitches instead of failing the transfer, if asked to
+    return reconnect_seconds <= 0 || hid_set_reconnect(device->device, reconnect_seconds * 1000) == 0;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * print_transfer_stats()
+ * Summarises any trouble we had talking to the device
+ *
+ * +--------------------------------------------------------------------+ */
+void print_transfer_stats(HIDDevice *device) {
+/* +--------------------------------------------------------------------+ */
+    if (device->timeouts + device->retries + device->reconnects == 0)
+        return;
+
+    cout << "\n" << device->retries << " block(s) retried, "
+         << device->timeouts << " timeout(s), "
+         << device->reconnects << " reconnect(s).";
+}
+
+// The bytes of a save to upload or compare, from a file or out of the --archive
+struct save_image {
+    SaveFile mapped;
+    buffer_t restored;
+    std::string path;   // where a journal for it goes
+    const char *data;
+    size_t size;
+};
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) load_image()
+ * Maps filename, or restores it from the --archive if there is one
+ *
+ * +--------------------------------------------------------------------+ */
+static bool load_image(const std::string &filename, save_image &image) {
+/* +--------------------------------------------------------------------+ */
+    if (opts_in["--archive"].specified) {
+        Archive archive;
+
+        if (!archive.open(opts_in["--archive"].value, false) || !archive.restore(filename, image.restored)) {
+            cerr << archive.error() << ".\n";
+            return false;
+        }
+
+        image.path = archive.manifest_path(filename);
+        image.data = image.restored.empty() ? NULL : &image.restored[0];
+        image.size = image.restored.size();
+        return true;
+    }
+
+    if (!image.mapped.open(filename)) {
+        cerr << "Unable to open " << filename << " for reading, check your permissions.\n";
+        return false;
+    }
+
+    image.path = filename;
+    image.data = image.mapped.data();
+    image.size = image.mapped.size();
+
+    // Containers are unpacked (and checked) up front, raw saves are used as they are
+    if (ContainerReader::is_container(image.data, image.size)) {
+        ContainerReader container;
+
+        if (!container.open(filename) || !container.read_all(image.restored)) {
+            cerr << filename << ": " << container.error() << ".\n";
+            return false;
+        }
+
+        image.data = image.restored.empty() ? NULL : &image.restored[0];
+        image.size = image.restored.size();
+    }
+
+    return true;
+}
+
+struct upload_job {
+    HIDMatch match;
+    std::atomic<int> written;
+    std::atomic<bool> done;
+    std::string status;
+};
+
+static void upload_worker(upload_job *job, const char *image, size_t image_size, int override_save_size) {
+    HIDDevice *device = job->match.driver->create(job->match.path.c_str());
+
+    if (device->found)
+        configure_device(device);
+
+    if (!device->found)
+        job->status = "unable to open device";
+    else if (!device->has_card)
+        job->status = "no card inserted";
+    else {
+        if (override_save_size > 0)
+            device->save_size = override_save_size;
+        else if (device->save_size <= 0)
+            device->save_size = image_size;
+
+        if (device->save_size != (int) image_size)
+            job->status = "mismatched save size";
+        else {
+            // Each device gets its own stream position over the shared image
+            imemstream is(image, image_size);
+
+            do {
+                device->write(is);
+                job->written = is.tellg();
+            }
+            while (!device->io_error && !cancel_token.requested() && is.tellg() < device->save_size);
+
+            if (device->io_error)
+                job->status = "device stopped responding";
+            else
+                job->status = is.tellg() < device->save_size ? "cancelled" : "written";
+
+            if (device->retries > 0) {
+                std::ostringstream stats;
+                stats << " (" << device->retries << " block(s) retried)";
+                job->status += stats.str();
+            }
+        }
+    }
+
+    delete device;
+    job->done = true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) upload_all()
+ * Writes the same save image to every attached device in parallel
+ *
+ * +--------------------------------------------------------------------+ */
+bool upload_all() {
+/* +--------------------------------------------------------------------+ */
+    std::vector<HIDMatch> devices = probe_devices();
+    int override_save_size = atoi(opts_in["--save-size"].value.c_str());
+
+    if (devices.empty()) {
+        cout << "Device not found (protip: make sure the device is plugged in, and permissions are set)\n";
+        return false;
+    }
+
+    // Every device reads from the same copy, stdin has to be read in once for that
+    save_image source;
+
+    if (arg_filename == "-") {
+        ipipestream in (STDIN_FILENO);
+        source.restored.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        source.data = source.restored.empty() ? NULL : &source.restored[0];
+        source.size = source.restored.size();
+    }
+    else if (!load_image(arg_filename, source))
+        return false;
+
+    const char *image = source.data;
+    const size_t image_size = source.size;
+
+    if (image_size == 0) {
+        cerr << arg_filename << " is empty.\n";
+        return false;
+    }
+
+    cout << "Writing " << arg_filename << " to " << devices.size() << " device(s).\n\n";
+
+    std::vector<upload_job> jobs(devices.size());
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].match = devices[i];
+        jobs[i].written = 0;
+        jobs[i].done = false;
+        workers.push_back(std::thread(upload_worker, &jobs[i], image, image_size, override_save_size));
+    }
+
+    // Machine-readable progress covers every device as one transfer, the bar
+    // below stays per device so a slow or stuck dongle is easy to spot
+    bool draw_bar = ProgressRenderer::current_style() == ProgressRenderer::BAR;
+    std::unique_ptr<ProgressRenderer> progress;
+    if (!draw_bar)
+        progress.reset(new ProgressRenderer("upload", (long long) image_size * jobs.size()));
+
+    // A device that fails only stops its own worker, the rest carry on
+    size_t finished = 0;
+    while (finished < jobs.size()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        finished = 0;
+        long long total_written = 0;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (jobs[i].done)
+                finished++;
+
+            total_written += jobs[i].written;
+            if (draw_bar)
+                printf("#%u %3.0f%%  ", (unsigned) i + 1, jobs[i].written * 100.0 / image_size);
+        }
+
+        if (draw_bar)
+            cout << "\r" << flush;
+        else
+            progress->update(total_written);
+    }
+
+    if (draw_bar)
+        cout << "\n\n";
+    else
+        progress->finish(cancel_token.requested() ? "interrupted" : "done");
+
+    int written = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        workers[i].join();
+        cout << "#" << i + 1 << " (" << jobs[i].match.path << "): " << jobs[i].status << "\n";
+
+        if (jobs[i].status.compare(0, 7, "written") == 0)
+            written++;
+    }
+
+    cout << "\nData successfully written to " << written << " of " << jobs.size() << " game card(s).\n";
+
+    return written == (int) jobs.size();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * paranoid_download()
+ * Reads the save twice, re-reading any 512 byte block the passes disagree on
+ *
+ * +--------------------------------------------------------------------+ */
+static bool paranoid_download(buffer_t &image) {
+/* +--------------------------------------------------------------------+ */
+    /*
+        Dirty contacts give us the odd bad block without any error from the
+        SD, so the only way to notice is to read everything twice. Only the
+        first pass is kept, the second pass is just hashed against it.
+
+        A block the passes disagree on is read again until a read matches
+        one we've already seen, that copy is the one we keep.
+    */
+    const int BLOCK_SIZE = 512, MAX_REREADS = 8;
+    const int blocks = (dev->save_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint64_t> hashes (blocks);
+    std::vector<std::pair<int, uint64_t> > mismatched;     // block, and what the second pass read
+    char scratch[BLOCK_SIZE];
+    omemstream block (scratch, BLOCK_SIZE);
+
+    // Sized in whole blocks, the caller only writes out save_size bytes
+    image.assign(blocks * BLOCK_SIZE, 0);
+    omemstream os (&image[0], image.size());
+
+    ProgressRenderer progress ("download", (long long) dev->save_size * 2);
+
+    // First pass, this is the copy we keep
+    for (int b = 0; b < blocks; b++) {
+        if (cancel_token.requested())
+            return false;
+
+        dev->read(os, b * BLOCK_SIZE);
+        if (dev->io_error)
+            return false;
+
+        hashes[b] = xxh64(&image[b * BLOCK_SIZE], BLOCK_SIZE);
+        progress.update((b + 1) * BLOCK_SIZE);
+    }
+
+    // Second pass only remembers which blocks didn't match
+    for (int b = 0; b < blocks; b++) {
+        if (cancel_token.requested())
+            return false;
+
+        block.seekp(0);
+        dev->read(block, b * BLOCK_SIZE);
+        if (dev->io_error)
+            return false;
+
+        uint64_t hash = xxh64(scratch, BLOCK_SIZE);
+        if (hash != hashes[b])
+            mismatched.push_back(std::make_pair(b, hash));
+
+        progress.update(dev->save_size + (b + 1) * BLOCK_SIZE);
+    }
+
+    progress.finish("done");
+
+    int rereads = 0, unverified = 0;
+    for (size_t i = 0; i < mismatched.size(); i++) {
+        int b = mismatched[i].first;
+        std::vector<uint64_t> seen;
+        bool agreed = false;
+
+        seen.push_back(hashes[b]);
+        seen.push_back(mismatched[i].second);
+
+        for (int attempt = 0; attempt < MAX_REREADS && !agreed; attempt++) {
+            if (cancel_token.requested())
+                return false;
+
+            block.seekp(0);
+            dev->read(block, b * BLOCK_SIZE);
+            if (dev->io_error)
+                return false;
+            rereads++;
+
+            uint64_t hash = xxh64(scratch, BLOCK_SIZE);
+            agreed = std::find(seen.begin(), seen.end(), hash) != seen.end();
+
+            if (agreed && hash != hashes[b])
+                memcpy(&image[b * BLOCK_SIZE], scratch, BLOCK_SIZE);
+            else if (!agreed)
+                seen.push_back(hash);
+        }
+
+        if (!agreed)
+            unverified++;
+    }
+
+    cout << "\n" << mismatched.size() << " block(s) differed between passes, " << rereads << " re-read(s).";
+    if (unverified > 0)
+        cout << "\nWARNING: " << unverified << " block(s) never read the same way twice, the dump may be bad.";
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * print_card_info()
+ * Describes the inserted card and its save size
+ *
+ * +--------------------------------------------------------------------+ */
+static void print_card_info(int override_save_size) {
+/* +--------------------------------------------------------------------+ */
+    // Dump some info about the game
+    if (dev->card_title.size() > 0) {
+        cout << "Detected game: " << dev->card_id << " " << dev->card_title;
+        cout << " (" << dev->card_size << "Mb" << ")\n";
+    }
+    else // only neimod can decrypt the 3DS headers :-/
+        cout << "Detected unknown CTR-005 game (encrypted 3DS card)\n";
+
+    // Output game save size
+    cout << "Save game size: ";
+
+    if (override_save_size > 0)
+        dev->save_size = override_save_size;
+
+    if (dev->save_size > 0) {
+        if (dev->save_size > 1048576)
+            cout << (dev->save_size / 1048576.00) << "MB";
+        else
+            cout << (dev->save_size / 1024.00) << "kB";
+
+        cout << (override_save_size > 0 ? " (user defined)\n" : "\n");
+    }
+    else {
+        cout << "(unknown)\n";
+    }
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) erase_save()
+ * Fills the card's save memory with 0xFF
+ *
+ * +--------------------------------------------------------------------+ */
+static bool erase_save() {
+/* +--------------------------------------------------------------------+ */
+    char buff[128];
+    std::fill(&buff[0], &buff[0] + 128, 0xFF);
+
+    // We create an istrstream that can behave like istream and
+    // fill it with 128 bytes of zeros before passing to dev->write()
+    std::istringstream is (std::string(buff, 128), ios::binary);
+
+    ProgressRenderer progress ("erase", dev->save_size);
+
+    int i=0, written=0;
+    do {
+        dev->write(is, written);
+        written = ++i * is.tellg();
+        is.seekg(0); // Reset the position in the stream for the next iteration
+        progress.update(written);
+    }
+    while (written < dev->save_size && !dev->io_error && !cancel_token.requested());
+
+    progress.finish(written < dev->save_size ? "interrupted" : "done");
+
+    if (written < dev->save_size) {
+        cout << "\nErase interrupted, the card is only partially erased.\n";
+        return false;
+    }
+
+    cout << "\nData successfully written to game card.\n";
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) pipeline_download()
+ * The device end of a download, reading from offset into pipeline blocks
+ *
+ * +--------------------------------------------------------------------+ */
+static bool pipeline_download(Pipeline &pipeline, int offset) {
+/* +--------------------------------------------------------------------+ */
+    ProgressRenderer progress ("download", dev->save_size, offset);
+    int pos = offset;
+
+    while (pos < dev->save_size && !cancel_token.requested()) {
+        PipelineBlock *block = pipeline.acquire();
+        if (!block)
+            break;
+
+        // Fill the whole block before handing it on, a read at a time
+        omemstream os (block->data, PipelineBlock::SIZE);
+        int filled = 0;
+
+        while (filled < (int) PipelineBlock::SIZE && pos + filled < dev->save_size && !cancel_token.requested()) {
+            dev->read(os, pos + filled);
+            if (dev->io_error)
+                break;
+
+            filled = os.tellp();
+            progress.update(pos + filled);
+        }
+
+        block->offset = pos;
+        block->length = std::min(filled, dev->save_size - pos);
+        pipeline.submit(block);
+        pos += block->length;
+
+        if (dev->io_error)
+            break;
+    }
+
+    progress.finish(pos < dev->save_size ? "interrupted" : "done");
+    return pos >= dev->save_size;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (ContainerInfo) card_details()
+ * What's known about the inserted card, as a container or catalog keeps it
+ *
+ * +--------------------------------------------------------------------+ */
+static ContainerInfo card_details() {
+/* +--------------------------------------------------------------------+ */
+    ContainerInfo info;
+
+    info.save_size = dev->save_size;
+    info.card_type = dev->card_title.empty() ? ContainerInfo::CTR : ContainerInfo::NTR;
+    info.created = time(NULL);
+    info.firmware = dev->name + " v" + dev->version;
+    info.card_id = dev->card_id;
+    info.card_title = dev->card_title;
+    info.card_header = dev->card_header;
+    return info;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) download_archive()
+ * Reads the card's save into the --archive as name
+ *
+ * +--------------------------------------------------------------------+ */
+static bool download_archive(const std::string &name) {
+/* +--------------------------------------------------------------------+ */
+    std::string card = CatalogRecord::describe("", card_details(), 0).key();
+    Archive archive;
+
+    if (opts_in["--resume"].specified) {
+        cerr << "Downloads into the archive can't be resumed, start the download again.\n";
+        return false;
+    }
+
+    if (!Archive::valid_name(name)) {
+        cerr << "'" << name << "' can't be used as a name in the archive.\n";
+        return false;
+    }
+
+    if (!archive.open(opts_in["--archive"].value, true)) {
+        cerr << archive.error() << ".\n";
+        return false;
+    }
+
+    if (opts_in["--paranoid"].specified) {
+        buffer_t image;
+        if (!paranoid_download(image)) {
+            cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted")
+                 << ", nothing was added to the archive.";
+            return false;
+        }
+
+        archive.begin(chunking, compression, card);
+        archive.append(&image[0], dev->save_size);
+
+        if (!archive.commit(name)) {
+            cerr << "\n" << archive.error() << ".\n";
+            return false;
+        }
+    }
+    else {
+        // Chunked, hashed and stored off the device thread as the blocks come in
+        ArchiveSink sink (archive, name, chunking, compression, card);
+        Pipeline pipeline (Pipeline::DOWNLOAD);
+
+        pipeline.add(&sink);
+        pipeline.start();
+
+        bool done = pipeline_download(pipeline, 0) && pipeline.finish(true);
+        pipeline.finish(false);
+
+        if (!done) {
+            cout << "\n" << (dev->io_error ? "Device stopped responding" : pipeline.failed() ? pipeline.failure() : "Interrupted")
+                 << ", nothing was added to the archive.";
+            return false;
+        }
+    }
+
+    cout << "\nData successfully downloaded to " << name << " in " << opts_in["--archive"].value << " ("
+         << archive.chunks_added << " of " << archive.chunks_seen << " chunk(s) new, " << archive.bytes_stored << " bytes stored).";
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (void) catalog_dump()
+ * Adds a finished download to the catalog in the directory it went to
+ *
+ * +--------------------------------------------------------------------+ */
+static void catalog_dump(const std::string &filename, const ContainerInfo &info, uint32_t flags) {
+/* +--------------------------------------------------------------------+ */
+    size_t slash = filename.find_last_of("/\\");
+    std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash);
+    Catalog catalog;
+
+    // A new catalog starts with whatever was already there, then this dump with everything we know about it
+    bool done = catalog.open(dir, true) &&
+                (catalog.size() > 0 || catalog.rebuild(dir, std::thread::hardware_concurrency())) &&
+                catalog.append(CatalogRecord::describe(filename.substr(slash + 1), info, flags));
+
+    if (!done)
+        cout << "\n" << catalog.error() << ", the catalog wasn't updated.";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) download_container()
+ * Reads the card's save into a container at filename
+ *
+ * +--------------------------------------------------------------------+ */
+static bool download_container(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    ContainerInfo info = card_details();
+    ContainerWriter writer;
+    bool sync = durability != SaveFile::SYNC_NONE;
+
+    if (opts_in["--resume"].specified) {
+        cerr << "Downloads into a container can't be resumed, start the download again.\n";
+        return false;
+    }
+
+    if (!writer.create(filename, info)) {
+        cerr << writer.error() << ".\n";
+        return false;
+    }
+
+    // Build on the newest dump of this card alongside, unless the chain is due a full image
+    if (opts_in["--incremental"].specified) {
+        size_t slash = filename.find_last_of("/\\");
+        std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash);
+        std::string skip = filename.substr(slash + 1), latest;
+        ContainerReader parent;
+        ContainerInfo found;
+        Catalog catalog;
+
+        // The catalog knows without opening every dump, unless it's missing one or out of date
+        const CatalogRecord *entry = catalog.open(dir, false) ? catalog.latest(info, skip) : NULL;
+        if (entry && ContainerReader::peek(dir + "/" + entry->name(), found) && found.same_card(info))
+            latest = dir + "/" + entry->name();
+        else
+            latest = ContainerReader::latest_dump(dir, info, skip);
+
+        if (latest.empty())
+            cout << "No earlier dump of this card next to " << filename << ", writing a full image.\n";
+        else if (!parent.open(latest))
+            cout << parent.error() << ", writing a full image.\n";
+        else if (parent.details().depth + 1 >= ContainerWriter::REBASE_DEPTH)
+            cout << "Writing a full image, " << latest << " is " << parent.details().depth << " dumps from the last one.\n";
+        else if (writer.set_parent(latest, parent))
+            cout << "Storing only the changes since " << latest << ".\n";
+    }
+
+    if (opts_in["--paranoid"].specified) {
+        buffer_t image;
+        if (!paranoid_download(image)) {
+            cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted")
+                 << ", nothing was written.";
+            return false;
+        }
+
+        if (!writer.append(&image[0], dev->save_size) || !writer.finish(sync)) {
+            cerr << "\n" << writer.error() << ".\n";
+            return false;
+        }
+    }
+    else {
+        // Blocks are packed off the device thread as they come in
+        ContainerSink sink (writer, sync);
+        Pipeline pipeline (Pipeline::DOWNLOAD);
+
+        pipeline.add(&sink);
+        pipeline.start();
+
+        bool done = pipeline_download(pipeline, 0) && pipeline.finish(true);
+        pipeline.finish(false);
+
+        if (!done) {
+            cout << "\n" << (dev->io_error ? "Device stopped responding" : pipeline.failed() ? pipeline.failure() : "Interrupted")
+                 << ", nothing was written.";
+            return false;
+        }
+    }
+
+    cout << "\nData successfully downloaded to " << filename << " (" << writer.stored_size()
+         << " of " << dev->save_size << " bytes";
+
+    if (!writer.details().parent.empty())
+        cout << ", " << writer.blocks_reused() << " block(s) unchanged since " << writer.details().parent;
+
+    cout << ").";
+    catalog_dump(filename, writer.details(), CatalogRecord::CONTAINER |
+                 (writer.details().parent.empty() ? 0 : CatalogRecord::INCREMENTAL));
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+static void write_sidecar(Sidecar &sidecar, const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    if (!sidecar.write(Sidecar::path_for(filename), durability != SaveFile::SYNC_NONE))
+        cout << "\n" << sidecar.error() << ", " << filename << " has no checksums to check it by later.";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) repair_save()
+ * Re-reads the blocks of filename that don't match its checksums
+ *
+ * +--------------------------------------------------------------------+ */
+static bool repair_save(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    Sidecar sidecar;
+    SaveFile file (durability);
+
+    if (!sidecar.load(Sidecar::path_for(filename))) {
+        cerr << sidecar.error() << ", only a download made with checksums can be repaired.\n";
+        return false;
+    }
+
+    if (sidecar.save_size() != (size_t) dev->save_size) {
+        cerr << filename << " is a " << sidecar.save_size() << " byte save, this card's is "
+             << dev->save_size << " bytes.\n";
+        return false;
+    }
+
+    if (!file.create(filename, dev->save_size, true)) {
+        cerr << "Unable to open " << filename << " for writing, check your permissions.\n";
+        return false;
+    }
+
+    // Only the file is read to find the damage
+    std::vector<size_t> damaged = sidecar.damaged(file.data(), file.size());
+    if (damaged.empty()) {
+        cout << filename << " matches its checksums, there's nothing to repair.";
+        return file.finish();
+    }
+
+    cout << damaged.size() << " block(s) of " << filename << " don't match their checksums, reading them again.\n\n";
+
+    char block[Sidecar::BLOCK_SIZE];
+    omemstream os (block, sizeof(block));
+    size_t done = 0, changed = 0;
+    ProgressRenderer progress ("repair", damaged.size() * Sidecar::BLOCK_SIZE);
+
+    for (; done < damaged.size() && !cancel_token.requested(); done++) {
+        size_t offset = damaged[done] * Sidecar::BLOCK_SIZE;
+        size_t len = std::min(Sidecar::BLOCK_SIZE, dev->save_size - offset);
+
+        os.seekp(0);
+        dev->read(os, offset);
+        if (dev->io_error)
+            break;
+
+        // A block that doesn't match either means the save on the card has moved on since
+        if (crc32c(block, len) == sidecar.sum(damaged[done]))
+            memcpy(file.data() + offset, block, len);
+        else
+            changed++;
+
+        progress.update((done + 1) * Sidecar::BLOCK_SIZE);
+    }
+
+    progress.finish(done < damaged.size() ? "interrupted" : "done");
+
+    if (!file.finish()) {
+        cerr << "\nUnable to write " << filename << ", the disk may be full.\n";
+        return false;
+    }
+
+    if (done < damaged.size()) {
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted") << ", "
+             << done - changed << " of " << damaged.size() << " block(s) were repaired.";
+        return false;
+    }
+
+    if (changed > 0) {
+        cout << "\n" << changed << " block(s) on the card no longer match " << filename
+             << ", download the save again instead.";
+        return false;
+    }
+
+    cout << "\n" << filename << " was repaired (" << damaged.size() << " block(s) read again).";
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+static bool save_key_file(const std::string &path, const std::string &key) {
+/* +--------------------------------------------------------------------+ */
+    SaveFile out (durability);
+    if (!out.create(path, key.size(), false)) {
+        cerr << "\nUnable to open " << path << " for writing, check your permissions.\n";
+        return false;
+    }
+
+    memcpy(out.data(), key.data(), key.size());
+    if (!out.finish()) {
+        cerr << "\nUnable to write to " << path << ", the disk may be full.\n";
+        return false;
+    }
+
+    return true;
+}
+
+// Decrypts each block of a download on its way through, see --decrypt
+class PadStage : public PipelineStage {
+    public:
+        PadStage(const std::string &pad) : pad(pad) {}
+
+        bool process(PipelineBlock &block) {
+            apply_pad(block.data, block.length, pad.data(), block.offset);
+            return true;
+        }
+
+    private:
+        const std::string &pad;
+};
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) decrypt_download()
+ * Finds the key in a download that's already on disk and decrypts it there
+ *
+ * +--------------------------------------------------------------------+ */
+static bool decrypt_download(const std::string &filename, const std::string &card, Sidecar &sidecar, std::string &pad) {
+/* +--------------------------------------------------------------------+ */
+    SaveFile file (durability);
+    KeyFinder finder;
+
+    if (!file.create(filename, dev->save_size, true)) {
+        cerr << "\nUnable to open " << filename << " for writing, check your permissions.\n";
+        return false;
+    }
+
+    finder.chunk_data(file.data(), file.size());
+    if (!finder.get_key(pad)) {
+        cout << "\nNo part of the save repeats, so its key couldn't be found, " << filename << " is left encrypted.";
+        return false;
+    }
+
+    apply_pad(file.data(), file.size(), pad.data(), 0);
+
+    // The sums were taken on the way in, they have to match what's on disk
+    sidecar.reset(file.size());
+    sidecar.add(0, file.data(), file.size());
+
+    if (!file.finish()) {
+        cerr << "\nUnable to write " << filename << ", the disk may be full.\n";
+        return false;
+    }
+
+    if (!pad_cache.store(card, pad))
+        cerr << "\nUnable to cache the key in " << PadCache::default_dir() << ", it'll be looked for again next time.\n";
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) download_save()
+ * Reads the card's save into filename, journaled so it can be resumed
+ *
+ * +--------------------------------------------------------------------+ */
+static bool download_save(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    bool resume = opts_in["--resume"].specified;
+    bool to_stdout = filename == "-";
+    bool decrypt = opts_in["--decrypt"].specified;
+    std::string pad, card;
+    int pass = 0, offset = 0;
+
+    // A key used on this card before is applied as the data streams past, otherwise it's found afterwards
+    if (decrypt) {
+        if (card_details().card_type != ContainerInfo::CTR) {
+            cerr << "Only 3DS saves are encrypted, there's nothing to --decrypt.\n";
+            return false;
+        }
+
+        if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".005") == 0) {
+            cerr << "--decrypt only works on plain downloads, containers keep the save as the card has it.\n";
+            return false;
+        }
+
+        card = CatalogRecord::describe("", card_details(), 0).key();
+        if (!pad_cache.find(card, pad) && to_stdout) {
+            cerr << "No key is cached for this card yet, download it to a file with --decrypt once first.\n";
+            return false;
+        }
+    }
+
+    PadStage decrypter (pad);
+
+    if (opts_in["--archive"].specified)
+        return download_archive(filename);
+
+    if (opts_in["--repair"].specified)
+        return repair_save(filename);
+
+    if (!to_stdout && (opts_in["--container"].specified || opts_in["--incremental"].specified ||
+                       (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".005") == 0)))
+        return download_container(filename);
+
+    if (to_stdout && resume) {
+        cerr << "Downloads to stdout can't be resumed, start the download again.\n";
+        return false;
+    }
+
+    if (opts_in["--paranoid"].specified) {
+        if (resume) {
+            cerr << "--paranoid downloads can't be resumed, start the download again.\n";
+            return false;
+        }
+
+        // Open the file first so we don't find out about permissions after the reads
+        SaveFile file (durability);
+        std::unique_ptr<ofdstream> out;
+
+        if (to_stdout)
+            out.reset(new ofdstream(stdout_fd));
+        else if (!file.create(filename, dev->save_size, false)) {
+            cerr << "Unable to create " << filename << " at " << dev->save_size
+                 << " bytes, check your permissions and free space.\n";
+            return false;
+        }
+
+        buffer_t image;
+        if (!paranoid_download(image)) {
+            cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted")
+                 << ", nothing was written.";
+            return false;
+        }
+
+        if (to_stdout) {
+            out->write(&image[0], dev->save_size);
+            out->flush();
+        }
+        else {
+            memcpy(file.data(), &image[0], dev->save_size);
+            if (!file.finish()) {
+                cerr << "\nUnable to write " << filename << ", the disk may be full.\n";
+                return false;
+            }
+        }
+
+        cout << "\nData successfully downloaded to " << (to_stdout ? "stdout" : filename) << ".";
+
+        if (!to_stdout) {
+            ContainerInfo info = card_details();
+            Sidecar sidecar;
+
+            sidecar.reset(dev->save_size);
+            sidecar.add(0, &image[0], dev->save_size);
+            write_sidecar(sidecar, filename);
+
+            info.save_hash = save_fingerprint(&image[0], dev->save_size);
+            catalog_dump(filename, info, 0);
+        }
+        return true;
+    }
+
+    // A pipe can't be journaled or rewound, so it just gets the save front to back
+    if (to_stdout) {
+        ofdstream out (stdout_fd);
+        StreamSink sink (out, "stdout");
+        Pipeline pipeline (Pipeline::DOWNLOAD);
+
+        if (decrypt)
+            pipeline.add(&decrypter);
+        pipeline.add(&sink);
+        pipeline.start();
+
+        bool done = pipeline_download(pipeline, 0) && pipeline.finish(true);
+        pipeline.finish(false);
+
+        if (!done) {
+            cout << "\n" << (dev->io_error ? "Device stopped responding" : pipeline.failed() ? pipeline.failure() : "Interrupted")
+                 << ", the download is incomplete.";
+            return false;
+        }
+
+        cout << "\nData successfully downloaded to stdout.";
+        return true;
+    }
+
+    TransferJournal journal (filename, TransferJournal::DOWNLOAD, dev);
+
+    if (resume && !journal.resume(pass, offset)) {
+        cerr << "No journal for this card at " << journal.path() << ", unable to resume.\n";
+        return false;
+    }
+    else if (!resume && !journal.begin()) {
+        cerr << "Unable to create " << journal.path() << ", check your permissions.\n";
+        return false;
+    }
+
+    // Allocated at full size up front, keeping what we already have when resuming
+    SaveFile file (durability);
+    if (!file.create(filename, dev->save_size, resume)) {
+        cerr << "Unable to create " << filename << " at " << dev->save_size
+             << " bytes, check your permissions and free space.\n";
+        return false;
+    }
+
+    journal.attach(file);
+
+    // Block checksums are worked out as the data streams past, what's already here is summed up front
+    Sidecar sidecar;
+    sidecar.reset(dev->save_size);
+    sidecar.add(0, file.data(), offset);
+
+    if (offset > 0)
+        cout << "Resuming from " << offset << " bytes.\n";
+
+    // Copying into the mapping, journaling and syncing all happen off the device thread
+    SidecarSink summer (sidecar);
+    SaveFileSink sink (file, &journal, pass);
+    Pipeline pipeline (Pipeline::DOWNLOAD);
+    bool streamed = decrypt && !pad.empty();
+
+    if (streamed)
+        pipeline.add(&decrypter);
+    pipeline.add(&summer);
+    pipeline.add(&sink);
+    pipeline.start();
+
+    bool done = pipeline_download(pipeline, offset) && pipeline.finish(true);
+    pipeline.finish(false);
+
+    if (!done) {
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : pipeline.failed() ? pipeline.failure() : "Interrupted")
+             << ", continue the download with --resume.";
+        return false;
+    }
+
+    journal.finish();
+    cout << "\nData successfully downloaded to " << filename << ".";
+
+    if (decrypt && !streamed && !decrypt_download(filename, card, sidecar, pad))
+        return false;
+
+    if (decrypt) {
+        cout << "\nDecrypted with " << (streamed ? "the key cached for this card." : "the key found in the save, cached for next time.");
+        if (opts_in["--key-file"].specified && save_key_file(opts_in["--key-file"].value, pad))
+            cout << "\nKey written to " << opts_in["--key-file"].value << ".";
+    }
+
+    write_sidecar(sidecar, filename);
+
+    // The sink has let go of the download's mapping by now, so it's hashed from the file
+    SaveFile written (SaveFile::SYNC_NONE);
+    if (written.open(filename)) {
+        ContainerInfo info = card_details();
+        info.save_hash = save_fingerprint(written.data(), written.size());
+        catalog_dump(filename, info, 0);
+    }
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) upload_stdin()
+ * Writes a save arriving on stdin, which needs the size known up front
+ *
+ * +--------------------------------------------------------------------+ */
+static bool upload_stdin() {
+/* +--------------------------------------------------------------------+ */
+    if (dev->save_size <= 0) {
+        cerr << "Unable to tell how big the save on stdin is, use --save-size=BYTES.\n";
+        return false;
+    }
+
+    if (opts_in["--resume"].specified) {
+        cerr << "Uploads from stdin can't be resumed, start the upload again.\n";
+        return false;
+    }
+
+    // stdin is read ahead on another thread, only the first 16kB is kept for the 3DS rewrite pass
+    FdSource source (STDIN_FILENO, dev->save_size);
+    Pipeline pipeline (Pipeline::UPLOAD);
+
+    pipeline.add(&source);
+    pipeline.start();
+
+    PipelineReader in (pipeline, dev->save_size);
+    ProgressRenderer progress ("upload", dev->save_size);
+
+    bool done = false;
+    while (!done && !cancel_token.requested()) {
+        dev->write(in);
+        if (dev->io_error || !in)
+            break;
+
+        progress.update(in.tellg());
+        done = in.tellg() >= dev->save_size;
+    }
+
+    progress.finish(done ? "done" : "interrupted");
+
+    if (!done) {
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : pipeline.failed() ? pipeline.failure()
+                          : !in && !cancel_token.requested() ? "stdin ended early" : "Interrupted")
+             << ", the card is only partially written.";
+        return false;
+    }
+
+    cout << "\nData successfully written to game card.";
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) compare_block()
+ * Notes where block n of the card differs from the file, false if it does
+ *
+ * +--------------------------------------------------------------------+ */
+static bool compare_block(size_t n, const char *expected, const char *actual, size_t len,
+                          std::vector<int> &first, std::vector<int> &last) {
+/* +--------------------------------------------------------------------+ */
+    size_t at = first_difference(expected, actual, len);
+
+    first[n] = at < len ? (int) at : -1;
+    last[n] = at < len ? (int) last_difference(expected, actual, len) : -1;
+    return at >= len;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * print_ranges()
+ * Lists byte ranges as offsets and lengths, up to max_shown of them
+ *
+ * +--------------------------------------------------------------------+ */
+static void print_ranges(const std::vector<DiffRange> &ranges, size_t max_shown) {
+/* +--------------------------------------------------------------------+ */
+    for (size_t i = 0; i < ranges.size() && i < max_shown; i++) {
+        cout << "  0x" << hex << setw(6) << setfill('0') << ranges[i].start << " - 0x" << setw(6) << ranges[i].end - 1
+             << setfill(' ') << dec << "  (" << ranges[i].end - ranges[i].start << " bytes)\n";
+    }
+
+    if (ranges.size() > max_shown)
+        cout << "  and " << ranges.size() - max_shown << " more.\n";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) print_mismatches()
+ * Lists the byte ranges that differed, false if there weren't any
+ *
+ * +--------------------------------------------------------------------+ */
+static bool print_mismatches(const std::vector<int> &first, const std::vector<int> &last, int block_size, const std::string &name) {
+/* +--------------------------------------------------------------------+ */
+    std::vector<DiffRange> ranges;
+    int blocks = 0;
+
+    for (size_t n = 0; n < first.size(); n++) {
+        if (first[n] < 0)
+            continue;
+
+        DiffRange range = { n * block_size + first[n], n * block_size + last[n] + 1 };
+        blocks++;
+
+        // A difference running on over the edge of a block is one range
+        if (!ranges.empty() && ranges.back().end == range.start)
+            ranges.back().end = range.end;
+        else
+            ranges.push_back(range);
+    }
+
+    if (ranges.empty())
+        return false;
+
+    cout << "\n" << blocks << " block(s) differ from " << name << ", in " << ranges.size() << " range(s):\n";
+    print_ranges(ranges, 16);
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) upload_save()
+ * Writes filename to the card's save, journaled so it can be resumed
+ *
+ * +--------------------------------------------------------------------+ */
+static bool upload_save(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    bool resume = opts_in["--resume"].specified;
+    int pass = 0, offset = 0;
+
+    if (filename == "-") {
+        if (opts_in["--verify"].specified) {
+            cerr << "Uploads from stdin can't be read back as they're written, use verify afterwards.\n";
+            return false;
+        }
+        return upload_stdin();
+    }
+
+    save_image image;
+    if (!load_image(filename, image))
+        return false;
+
+    // The card is written straight out of the mapping
+    imemstream file (image.data, image.size);
+    long file_size = image.size;
+
+    // We can guess the save size from the passed file's size
+    if (dev->save_size <= 0)
+        dev->save_size = file_size;
+    else if (dev->save_size != (file_size)) {
+        cerr << "Mismatched file size is " << file_size
+             << " bytes, save size is " << dev->save_size << " bytes.\n";
+
+        return false;
+    }
+
+    TransferJournal journal (image.path, TransferJournal::UPLOAD, dev);
+
+    if (resume) {
+        if (!journal.resume(pass, offset)) {
+            cerr << "No journal for this card at " << journal.path() << ", unable to resume.\n";
+            return false;
+        }
+
+        cout << "Resuming from " << offset << " bytes" << (pass > 0 ? " (second pass).\n" : ".\n");
+        dev->resume_write(pass);
+        file.seekg(offset);
+    }
+    else if (!journal.begin()) {
+        cerr << "Unable to create " << journal.path() << ", check your permissions.\n";
+        return false;
+    }
+
+    // Each block is read back once the last write touching it has gone out
+    const int BLOCK_SIZE = 512;
+    char actual[BLOCK_SIZE];
+    omemstream block (actual, BLOCK_SIZE);
+    std::vector<int> first ((dev->save_size + BLOCK_SIZE - 1) / BLOCK_SIZE, -1), last (first.size(), -1);
+    bool verify = opts_in["--verify"].specified, deferred = false;
+
+    ProgressRenderer progress ("upload", dev->save_size, offset);
+
+    bool done = false;
+    while (!done && !cancel_token.requested()) {
+        long before = file.tellg();
+        dev->write(file);
+        if (dev->io_error)
+            break;
+
+        long after = file.tellg(), end = (before / BLOCK_SIZE + 1) * BLOCK_SIZE;
+        journal.complete(dev->write_pass(), after);
+        progress.update(after);
+        done = after >= dev->save_size;
+
+        // The stream jumps when a pass changes, so the block it was in is the one finished
+        if (verify && after > before && after < end)
+            continue;
+        if (verify && end > dev->save_size)
+            end = dev->save_size;
+
+        if (verify && end % BLOCK_SIZE == 0) {
+            // Reading the last block ends the transfer, which would throw away the pass we're in
+            if (end == dev->save_size && !done) {
+                deferred = true;
+                continue;
+            }
+
+            block.seekp(0);
+            dev->read(block, end - BLOCK_SIZE);
+            if (dev->io_error)
+                break;
+
+            compare_block(end / BLOCK_SIZE - 1, image.data + end - BLOCK_SIZE, actual, BLOCK_SIZE, first, last);
+        }
+    }
+
+    if (done && deferred) {
+        block.seekp(0);
+        dev->read(block, dev->save_size - BLOCK_SIZE);
+        if (!dev->io_error)
+            compare_block(first.size() - 1, image.data + dev->save_size - BLOCK_SIZE, actual, BLOCK_SIZE, first, last);
+    }
+
+    progress.finish(done ? "done" : "interrupted");
+
+    if (!done) {
+        journal.commit();
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted")
+             << ", continue the upload with --resume.";
+        return false;
+    }
+
+    journal.finish();
+
+    // Every block went out, but a read back that failed would only look like a mismatch
+    if (dev->io_error) {
+        cout << "\nDevice stopped responding, the save was written but couldn't be checked.";
+        return false;
+    }
+
+    if (verify && print_mismatches(first, last, BLOCK_SIZE, filename)) {
+        cout << "The card didn't keep what was written, try the upload again.";
+        return false;
+    }
+
+    cout << "\nData successfully written to game card" << (verify ? (resume ? ", the resumed part verified." : " and verified.") : ".");
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) find_dump()
+ * Tells whether the catalog in dir already has a save with this fingerprint
+ *
+ * +--------------------------------------------------------------------+ */
+static bool find_dump(const std::string &dir, uint64_t fingerprint, int save_size) {
+/* +--------------------------------------------------------------------+ */
+    Catalog catalog;
+
+    if (!catalog.open(dir, false)) {
+        cout << "\n" << catalog.error() << " to look the save up in.";
+        return false;
+    }
+
+    // Newest first, that's the one anyone would want
+    for (size_t i = catalog.size(); i-- > 0;) {
+        const CatalogRecord &record = catalog.at(i);
+
+        if (record.save_hash == fingerprint && (int) record.save_size == save_size) {
+            cout << "\nAlready dumped as " << record.name() << ", no need to download it again.";
+            return true;
+        }
+    }
+
+    cout << "\nNot in the catalog in " << dir << ", download it to keep it.";
+    return false;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) checksum_save()
+ * Hashes the card's save as it's read, nothing touches the disk
+ *
+ * +--------------------------------------------------------------------+ */
+static bool checksum_save(const std::string &dir) {
+/* +--------------------------------------------------------------------+ */
+    const int BLOCK_SIZE = 512;
+    char block[BLOCK_SIZE];
+    omemstream os (block, BLOCK_SIZE);
+    SaveDigest digest (digest_algorithm), fingerprint (SaveDigest::FINGERPRINT);
+    bool look_up = !dir.empty();
+    int offset = 0;
+
+    ProgressRenderer progress ("checksum", dev->save_size);
+
+    for (; offset < dev->save_size && !cancel_token.requested(); offset += BLOCK_SIZE) {
+        os.seekp(0);
+        dev->read(os, offset);
+        if (dev->io_error)
+            break;
+
+        int len = std::min(BLOCK_SIZE, dev->save_size - offset);
+        digest.update(block, len);
+        progress.update(offset + len);
+
+        // The catalog only knows fingerprints, so that's worked out alongside a sha256
+        if (look_up && digest_algorithm != SaveDigest::FINGERPRINT)
+            fingerprint.update(block, len);
+    }
+
+    progress.finish(offset < dev->save_size ? "interrupted" : "done");
+
+    if (offset < dev->save_size) {
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted") << ", the save wasn't hashed.";
+        return false;
+    }
+
+    // The same layout as sha256sum, card first would break anyone's awk
+    cout << "\n" << digest.finish() << "  " << CatalogRecord::describe("", card_details(), 0).key();
+
+    if (look_up && digest_algorithm != SaveDigest::FINGERPRINT)
+        fingerprint.finish();
+    if (look_up)
+        find_dump(dir, (digest_algorithm == SaveDigest::FINGERPRINT ? digest : fingerprint).fingerprint(), dev->save_size);
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) verify_save()
+ * Reads the card's save back and compares it against filename
+ *
+ * +--------------------------------------------------------------------+ */
+static bool verify_save(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    bool from_stdin = filename == "-";
+    const std::string name = from_stdin ? "stdin" : filename;
+    save_image image;
+
+    if (!from_stdin && !load_image(filename, image))
+        return false;
+
+    std::unique_ptr<std::istream> input (from_stdin ? static_cast<std::istream *>(new ipipestream(STDIN_FILENO, dev->save_size))
+                                                    : new imemstream(image.data, image.size));
+    std::istream &file = *input;
+
+    // stdin is checked as it's read instead
+    long file_size = from_stdin ? dev->save_size : (long) image.size;
+    if (file_size != dev->save_size) {
+        cerr << "Mismatched file size is " << file_size
+             << " bytes, save size is " << dev->save_size << " bytes.\n";
+        return false;
+    }
+
+    // Checksums from the download tell damage to the file apart from changes on the card
+    Sidecar sidecar;
+    if (!from_stdin && !opts_in["--archive"].specified && sidecar.load(Sidecar::path_for(filename)) &&
+        sidecar.save_size() == image.size) {
+        size_t damaged = sidecar.damaged(image.data, image.size).size();
+        if (damaged > 0)
+            cout << damaged << " block(s) of " << filename << " don't match its checksums, download --repair can fix them.\n";
+    }
+
+    const int BLOCK_SIZE = 512;
+    char expected[BLOCK_SIZE], actual[BLOCK_SIZE];
+    omemstream block (actual, BLOCK_SIZE);
+    std::vector<int> first ((dev->save_size + BLOCK_SIZE - 1) / BLOCK_SIZE, -1), last (first.size(), -1);
+    bool first_only = opts_in["--first-mismatch"].specified, stopped = false;
+    int offset = 0;
+
+    ProgressRenderer progress ("verify", dev->save_size);
+
+    for (; offset < dev->save_size && !cancel_token.requested(); offset += BLOCK_SIZE) {
+        block.seekp(0);
+        dev->read(block, offset);
+        if (dev->io_error)
+            break;
+
+        int len = std::min(BLOCK_SIZE, dev->save_size - offset);
+        if (!file.read(expected, len))
+            break;
+
+        progress.update(offset + len);
+
+        if (!compare_block(offset / BLOCK_SIZE, expected, actual, len, first, last) && first_only) {
+            stopped = true;
+            break;
+        }
+    }
+
+    progress.finish(stopped ? "mismatch" : offset < dev->save_size ? "interrupted" : "done");
+
+    if (stopped) {
+        cout << "\nThe card's save differs from " << name << " at offset 0x" << hex << offset + first[offset / BLOCK_SIZE]
+             << dec << ", stopped there.";
+        return false;
+    }
+
+    if (offset < dev->save_size) {
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : !file ? name + " ended early" : "Interrupted")
+             << ", the save was only partially verified.";
+        return false;
+    }
+
+    if (print_mismatches(first, last, BLOCK_SIZE, name))
+        return false;
+
+    cout << "\nThe card's save matches " << name << ".";
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) write_key()
+ * Finds the key the save in filename is encrypted with, for --key-file
+ *
+ * +--------------------------------------------------------------------+ */
+static bool write_key(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    const std::string &path = opts_in["--key-file"].value;
+    save_image image;
+    KeyFinder finder;
+    std::string key;
+    size_t count;
+
+    if (!load_image(filename, image))
+        return false;
+
+    finder.chunk_data(image.data, image.size);
+
+    if (!finder.get_key(key, &count)) {
+        cout << "\nNo part of the save repeats, so there's no key to write to " << path << ".";
+        return false;
+    }
+
+    if (!save_key_file(path, key))
+        return false;
+
+    cout << "\nKey written to " << path << ", " << count << " of the save's "
+         << finder.chunks() - finder.blank_chunks() << " non-blank chunks are it.";
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) run_command()
+ * Runs one of the save commands against the current card
+ *
+ * +--------------------------------------------------------------------+ */
+static bool run_command(int command, const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    if (command == ARG_INFO)
+        return dev->has_card;
+
+    if (!dev->has_card) {
+        cerr << "No card inserted!\n";
+        return false;
+    }
+
+    // Most other commands need us to know the save size
+    if (command != ARG_UPLOAD && dev->save_size <= 0) {
+        cerr << "Unable to detect save size (override with --save-size=BYTES).\n";
+        return false;
+    }
+
+    cout << endl;
+
+    switch (command) {
+        case ARG_ERASE:    return erase_save();
+        case ARG_DOWNLOAD: return download_save(filename) && (!opts_in["--key-file"].specified || opts_in["--decrypt"].specified ||
+                                                              write_key(filename));
+        case ARG_UPLOAD:   return upload_save(filename);
+        case ARG_VERIFY:   return verify_save(filename);
+        case ARG_CHECKSUM: return checksum_save(filename);
+    }
+
+    return false;
+}
+
+// One line (or ;-separated part of a line) of a batch file
+struct batch_job {
+    std::string text;
+    int command;
+    std::string filename;
+    bool ok;
+    double seconds;
+};
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse_batch()
+ * Reads a job list, checking every job before any of them runs
+ *
+ * +--------------------------------------------------------------------+ */
+static bool parse_batch(std::istream &in, std::vector<batch_job> &jobs) {
+/* +--------------------------------------------------------------------+ */
+    static const map<string, int> commands = {
+        { "info", ARG_INFO }, { "download", ARG_DOWNLOAD }, { "upload", ARG_UPLOAD },
+        { "erase", ARG_ERASE }, { "verify", ARG_VERIFY }, { "checksum", ARG_CHECKSUM }
+    };
+
+    // Jobs are separated by newlines or semicolons, # starts a comment
+    std::string line;
+    for (int line_no = 1; getline(in, line); line_no++) {
+        line = line.substr(0, line.find('#'));
+
+        istringstream lines (line);
+        std::string text;
+        while (getline(lines, text, ';')) {
+            istringstream words (text);
+            batch_job job;
+            std::string name, extra;
+
+            if (!(words >> name))
+                continue;
+
+            words >> job.filename >> extra;
+
+            auto cmd = commands.find(name);
+            if (cmd == commands.end()) {
+                cerr << "ERROR: line " << line_no << ": '" << name << "' is not a valid batch command.\n";
+                return false;
+            }
+
+            job.command = cmd->second;
+            bool needs_file = job.command != ARG_INFO && job.command != ARG_ERASE && job.command != ARG_CHECKSUM;
+            bool takes_file = needs_file || job.command == ARG_CHECKSUM;
+
+            if ((needs_file && job.filename.empty()) || (!takes_file && !job.filename.empty()) || !extra.empty()) {
+                cerr << "ERROR: line " << line_no << ": " << name
+                     << (needs_file ? " takes exactly one <filename>.\n" : takes_file ? " takes at most one <filename>.\n"
+                                                                        : " doesn't take a <filename>.\n");
+                return false;
+            }
+
+            job.text = name + (job.filename.empty() ? "" : " " + job.filename);
+            job.ok = false;
+            job.seconds = 0;
+            jobs.push_back(job);
+        }
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) run_batch()
+ * Runs a list of jobs from a file (or stdin) against the one device
+ *
+ * +--------------------------------------------------------------------+ */
+static bool run_batch(const std::string &source, int override_save_size) {
+/* +--------------------------------------------------------------------+ */
+    std::vector<batch_job> jobs;
+
+    if (source.empty() || source == "-") {
+        if (!parse_batch(cin, jobs))
+            return false;
+    }
+    else {
+        ifstream file (source);
+        if (!file.is_open()) {
+            cerr << "Unable to open " << source << " for reading, check your permissions.\n";
+            return false;
+        }
+
+        if (!parse_batch(file, jobs))
+            return false;
+    }
+
+    if (dev->has_card)
+        print_card_info(override_save_size);
+
+    size_t ran = 0;
+    for (; ran < jobs.size() && !dev->io_error && !cancel_token.requested(); ran++) {
+        batch_job &job = jobs[ran];
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+        cout << "\n[" << ran + 1 << "/" << jobs.size() << "] " << job.text << "\n";
+
+        // The constructor just read the header, after that only look again
+        // in case someone swapped the card between jobs
+        bool changed = ran > 0 && dev->refresh_card();
+        if (changed)
+            cout << "Card changed.\n";
+
+        if ((changed || job.command == ARG_INFO) && dev->has_card)
+            print_card_info(override_save_size);
+
+        job.ok = run_command(job.command, job.filename);
+        job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+        cout << "\n";
+    }
+
+    // Per job timings, so slow cards or steps stand out
+    int succeeded = 0;
+    cout << "\n";
+    for (size_t i = 0; i < jobs.size(); i++) {
+        printf("%3u  %-40s  ", (unsigned) i + 1, jobs[i].text.c_str());
+
+        if (i >= ran)
+            printf("skipped\n");
+        else
+            printf("%-6s  %8.2f s\n", jobs[i].ok ? "ok" : "failed", jobs[i].seconds);
+
+        succeeded += jobs[i].ok;
+    }
+
+    cout << "\n" << succeeded << " of " << jobs.size() << " job(s) succeeded.";
+
+    if (ran < jobs.size())
+        cout << "\n" << (dev->io_error ? "Device stopped responding" : "Interrupted")
+             << ", the remaining jobs were skipped.";
+
+    print_transfer_stats(dev);
+
+    cout << endl;
+
+    return succeeded == (int) jobs.size();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) expand_template()
+ * Fills in {card_id}, {card_title} and {timestamp} for the current card
+ *
+ * +--------------------------------------------------------------------+ */
+static std::string expand_template(const std::string &tmpl) {
+/* +--------------------------------------------------------------------+ */
+    char timestamp[32];
+    time_t now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+    // 3DS headers are encrypted, so those cards get a placeholder
+    map<string, string> fields = {
+        { "{card_id}", dev->card_id.empty() ? "CTR" : dev->card_id },
+        { "{card_title}", dev->card_title.empty() ? "unknown" : dev->card_title },
+        { "{timestamp}", timestamp }
+    };
+
+    std::string path;
+    for (size_t i = 0; i < tmpl.size(); ) {
+        bool matched = false;
+
+        for (auto &field : fields) {
+            if (tmpl.compare(i, field.first.size(), field.first) != 0)
+                continue;
+
+            // Titles are padded and may hold anything, keep them filename safe
+            for (char c : field.second)
+                path += isalnum((unsigned char) c) || c == '-' || c == '.' ? c : '_';
+
+            i += field.first.size();
+            matched = true;
+            break;
+        }
+
+        if (!matched)
+            path += tmpl[i++];
+    }
+
+    // Never overwrite an earlier dump, the same card can come back within a second
+    std::string unique = path;
+    for (int n = 2; ifstream(unique).good(); n++) {
+        size_t dot = path.rfind('.');
+        size_t slash = path.rfind('/');
+        if (dot == string::npos || (slash != string::npos && dot < slash))
+            dot = path.size();
+
+        unique = path.substr(0, dot) + "-" + to_string(n) + path.substr(dot);
+    }
+
+    return unique;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) watch_cards()
+ * Kiosk mode, downloads every card as soon as it's inserted
+ *
+ * +--------------------------------------------------------------------+ */
+static bool watch_cards(const std::string &tmpl, int override_save_size) {
+/* +--------------------------------------------------------------------+ */
+    /*
+        Polling is just CMD_GET_HEADER and a byte compare against the last
+        header (refresh_card() only parses a header that changed), so it's
+        cheap enough to do every few tens of milliseconds.  A card that's
+        already in when we start gets dumped straight away.
+    */
+    int interval = opts_in["--interval"].value.length() ? atoi(opts_in["--interval"].value.c_str()) : 50;
+    bool changed = dev->has_card;
+    int dumped = 0;
+
+    cout << "Watching for cards, Ctrl+C to stop.\n";
+
+    while (!cancel_token.requested() && !dev->io_error) {
+        std::chrono::steady_clock::time_point polled = std::chrono::steady_clock::now();
+
+        if (!changed) {
+            changed = dev->refresh_card();
+            if (changed && !dev->has_card)
+                cout << "\nCard removed.\n";
+        }
+
+        if (!changed || !dev->has_card) {
+            changed = false;
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+            continue;
+        }
+
+        changed = false;
+        cout << "\n";
+        print_card_info(override_save_size);
+
+        std::string path = expand_template(tmpl);
+        int latency = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - polled).count();
+
+        cout << "Dumping to " << path << " (" << latency << " ms after the card was seen).\n";
+
+        if (run_command(ARG_DOWNLOAD, path))
+            dumped++;
+
+        cout << "\n";
+    }
+
+    cout << "\n" << dumped << " card(s) dumped.";
+    if (dev->io_error)
+        cout << "\nDevice stopped responding, stopped watching.";
+
+    print_transfer_stats(dev);
+
+    cout << endl;
+
+    return !dev->io_error;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) client_ops()
+ * Hands the command to a running daemon instead of opening the device
+ *
+ * +--------------------------------------------------------------------+ */
+bool client_ops() {
+/* +--------------------------------------------------------------------+ */
+#ifndef _WIN32
+    static const map<int, uint8_t> requests = {
+        { ARG_INFO, REQ_INFO }, { ARG_DOWNLOAD, REQ_DOWNLOAD }, { ARG_UPLOAD, REQ_UPLOAD },
+        { ARG_ERASE, REQ_ERASE }, { ARG_VERIFY, REQ_VERIFY }, { ARG_CHECKSUM, REQ_CHECKSUM }
+    };
+
+    std::string socket_path = opts_in["--socket"].value.length() ? opts_in["--socket"].value : default_socket_path();
+    int device = opts_in["--device"].value.length() ? atoi(opts_in["--device"].value.c_str()) : 1;
+    int save_size = atoi(opts_in["--save-size"].value.c_str());
+    bool ok;
+
+    if (device < 1) {
+        cerr << "Devices are numbered from 1, as the daemon lists them.\n";
+        return false;
+    }
+
+    // The daemon hashes the save, the catalog it's looked up in is ours
+    if (arg_client_command == ARG_CHECKSUM) {
+        ClientDigest checksum = { uint8_t(digest_algorithm), "", 0, 0 };
+        ok = run_client(socket_path, REQ_CHECKSUM, "", device - 1, save_size, &checksum);
+        if (ok && !arg_filename.empty())
+            find_dump(arg_filename, checksum.fingerprint, checksum.save_size);
+    }
+    else
+        ok = run_client(socket_path, requests.at(arg_client_command), arg_filename, device - 1, save_size);
+
+    cout << endl;
+    return ok;
+#else
+    cerr << "The daemon isn't supported on this platform.\n";
+    return false;
+#endif
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) archive_file()
+ * Copies a save file into the --archive, no device needed
+ *
+ * +--------------------------------------------------------------------+ */
+bool archive_file(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    size_t slash = filename.find_last_of("/\\");
+    std::string name = filename.substr(slash + 1);
+    std::string card;
+    SaveFile mapped;
+    Archive archive;
+    Catalog catalog;
+    ContainerInfo info;
+
+    if (!mapped.open(filename)) {
+        cerr << "Unable to open " << filename << " for reading, check your permissions.\n";
+        return false;
+    }
+
+    if (!archive.open(opts_in["--archive"].value, true)) {
+        cerr << archive.error() << ".\n";
+        return false;
+    }
+
+    // The dictionary to use goes by the card, which a container knows and the catalog may
+    if (ContainerReader::peek(filename, info))
+        card = CatalogRecord::describe("", info, 0).key();
+    else if (catalog.open(slash == std::string::npos ? "." : filename.substr(0, slash), false) && catalog.lookup(name))
+        card = catalog.lookup(name)->key();
+
+    archive.begin(chunking, compression, card);
+    archive.append(mapped.data(), mapped.size());
+
+    if (!archive.commit(name)) {
+        cerr << archive.error() << ".\n";
+        return false;
+    }
+
+    cout << "Archived " << filename << " as " << name << ": " << archive.chunks_seen << " chunk(s), "
+         << archive.chunks_added << " new (" << archive.bytes_stored << " of " << archive.bytes_seen << " bytes stored).\n";
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) convert_file()
+ * Packs a raw save into a container (import) or unpacks one (export)
+ *
+ * +--------------------------------------------------------------------+ */
+bool convert_file(int command, const std::string &from, const std::string &to) {
+/* +--------------------------------------------------------------------+ */
+    SaveFile mapped;
+
+    if (!mapped.open(from)) {
+        cerr << "Unable to open " << from << " for reading, check your permissions.\n";
+        return false;
+    }
+
+    bool is_container = ContainerReader::is_container(mapped.data(), mapped.size());
+
+    if (command == ARG_IMPORT) {
+        if (is_container) {
+            cerr << from << " is already a container.\n";
+            return false;
+        }
+
+        // Nothing but the size is known about a raw save
+        ContainerInfo info;
+        ContainerWriter writer;
+        info.save_size = mapped.size();
+        info.created = time(NULL);
+
+        if (!writer.create(to, info) || !writer.append(mapped.data(), mapped.size()) || !writer.finish(durability != SaveFile::SYNC_NONE)) {
+            cerr << writer.error() << ".\n";
+            return false;
+        }
+
+        cout << "Packed " << from << " into " << to << " (" << writer.stored_size() << " of " << mapped.size() << " bytes).\n";
+        return true;
+    }
+
+    ContainerReader container;
+    buffer_t image;
+
+    if (!is_container) {
+        cerr << from << " isn't a container.\n";
+        return false;
+    }
+
+    if (!container.open(from) || !container.read_all(image)) {
+        cerr << from << ": " << container.error() << ".\n";
+        return false;
+    }
+
+    SaveFile out (durability);
+    if (!out.create(to, image.size(), false)) {
+        cerr << "Unable to open " << to << " for writing, check your permissions.\n";
+        return false;
+    }
+
+    if (!image.empty())
+        memcpy(out.data(), &image[0], image.size());
+
+    if (!out.finish()) {
+        cerr << "Unable to write to " << to << ", the disk may be full.\n";
+        return false;
+    }
+
+    const ContainerInfo &info = container.details();
+    cout << "Unpacked " << from << " into " << to << " (" << image.size() << " bytes).\n";
+
+    if (!info.parent.empty())
+        cout << "Built on " << info.parent << " (" << info.depth << " dump(s) from a full image).\n";
+
+    if (!info.card_id.empty() || !info.firmware.empty())
+        cout << "Dumped from " << (info.card_id.empty() ? "an encrypted 3DS card" : info.card_id + " " + info.card_title)
+             << (info.firmware.empty() ? "" : " with " + info.firmware) << ".\n";
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) card_of()
+ * The catalog key of the card a save came from, empty if it's not known
+ *
+ * +--------------------------------------------------------------------+ */
+static std::string card_of(const std::string &filename) {
+/* +--------------------------------------------------------------------+ */
+    size_t slash = filename.find_last_of("/\\");
+    std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash);
+    const CatalogRecord *record;
+    Catalog catalog;
+
+    if (opts_in["--archive"].specified || !catalog.open(dir, false) || !(record = catalog.lookup(filename.substr(slash + 1))))
+        return "";
+
+    return record->key();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) crypt_file()
+ * Decrypts a 3DS save with its key, or encrypts a decrypted one again
+ *
+ * +--------------------------------------------------------------------+ */
+bool crypt_file(int command, const std::string &from, const std::string &to) {
+/* +--------------------------------------------------------------------+ */
+    bool decrypt = command == ARG_DECRYPT;
+    std::string card = card_of(from), pad, source;
+    save_image image;
+
+    if (!load_image(from, image))
+        return false;
+
+    // A key file says exactly which key, after that whatever this card used before
+    if (opts_in["--key-file"].specified) {
+        const std::string &path = opts_in["--key-file"].value;
+        SaveFile key;
+
+        if (!key.open(path) || key.size() != KeyFinder::CHUNK_SIZE) {
+            cerr << path << " isn't a key, they're " << KeyFinder::CHUNK_SIZE << " bytes long.\n";
+            return false;
+        }
+
+        pad.assign(key.data(), key.size());
+        source = path;
+    }
+    else if (pad_cache.find(card, pad))
+        source = "the key cached for " + card;
+    else if (decrypt) {
+        KeyFinder finder;
+
+        finder.chunk_data(image.data, image.size);
+        if (!finder.get_key(pad)) {
+            cerr << "No part of " << from << " repeats, so its key couldn't be found (give it with --key-file).\n";
+            return false;
+        }
+
+        source = "the key found in it";
+        if (pad_cache.store(card, pad))
+            source += ", cached for " + card;
+    }
+    else {
+        cerr << "No key is known for " << from << ", give it with --key-file or decrypt a save from the same card first.\n";
+        return false;
+    }
+
+    SaveFile out (durability);
+    if (!out.create(to, image.size, false)) {
+        cerr << "Unable to open " << to << " for writing, check your permissions.\n";
+        return false;
+    }
+
+    if (image.size > 0) {
+        memcpy(out.data(), image.data, image.size);
+        apply_pad(out.data(), image.size, pad.data(), 0);
+    }
+
+    if (!out.finish()) {
+        cerr << "Unable to write to " << to << ", the disk may be full.\n";
+        return false;
+    }
+
+    cout << (decrypt ? "Decrypted " : "Encrypted ") << from << " into " << to << " with " << source << ".\n";
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+static std::string json_string(const std::string &text) {
+/* +--------------------------------------------------------------------+ */
+    std::string out = "\"";
+    char escaped[8];
+
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+            out += std::string("\\") + char(c);
+        else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+            out += char(c);
+    }
+
+    return out + "\"";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) diff_files()
+ * Compares two save images block by block and lists where they differ
+ *
+ * +--------------------------------------------------------------------+ */
+bool diff_files(const std::string &a, const std::string &b) {
+/* +--------------------------------------------------------------------+ */
+    const size_t BLOCK_SIZE = 512;
+    save_image first, second;
+
+    if (!load_image(a, first) || !load_image(b, second))
+        return false;
+
+    std::vector<DiffRange> ranges;
+    size_t common = std::min(first.size, second.size);
+    size_t blocks = diff_blocks(first.data, second.data, common, BLOCK_SIZE, ranges);
+
+    // Whatever one image has past the end of the other counts as changed
+    if (first.size != second.size) {
+        size_t longer = std::max(first.size, second.size);
+        bool counted = common % BLOCK_SIZE && !ranges.empty() && ranges.back().end > common / BLOCK_SIZE * BLOCK_SIZE;
+        blocks += (longer + BLOCK_SIZE - 1) / BLOCK_SIZE - common / BLOCK_SIZE - (counted ? 1 : 0);
+
+        if (!ranges.empty() && ranges.back().end == common)
+            ranges.back().end = longer;
+        else {
+            DiffRange tail = { common, longer };
+            ranges.push_back(tail);
+        }
+    }
+
+    if (opts_in["--json"].specified) {
+        ofdstream out (stdout_fd);
+
+        out << "{\"a\":" << json_string(a) << ",\"b\":" << json_string(b) << ",\"size_a\":" << first.size
+            << ",\"size_b\":" << second.size << ",\"block_size\":" << BLOCK_SIZE << ",\"blocks\":" << blocks
+            << ",\"ranges\":[";
+
+        for (size_t i = 0; i < ranges.size(); i++)
+            out << (i ? "," : "") << "{\"offset\":" << ranges[i].start << ",\"length\":" << ranges[i].end - ranges[i].start << "}";
+
+        out << "]}" << endl;
+        return ranges.empty();
+    }
+
+    if (ranges.empty()) {
+        cout << a << " and " << b << " are identical.\n";
+        return true;
+    }
+
+    if (first.size != second.size)
+        cout << a << " is " << first.size << " bytes, " << b << " is " << second.size << " bytes.\n";
+
+    cout << blocks << " block(s) differ, in " << ranges.size() << " range(s):\n";
+    print_ranges(ranges, ranges.size());
+
+    return false;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) list_catalog()
+ * Prints the dumps catalogued in dir, oldest first, no device needed
+ *
+ * +--------------------------------------------------------------------+ */
+bool list_catalog(const std::string &dir) {
+/* +--------------------------------------------------------------------+ */
+    Catalog catalog;
+    std::vector<const CatalogRecord *> entries;
+
+    if (opts_in["--rebuild"].specified) {
+        if (!catalog.rebuild(dir, std::thread::hardware_concurrency())) {
+            cerr << catalog.error() << ".\n";
+            return false;
+        }
+        cout << "Catalogued " << catalog.size() << " dump(s) in " << dir << ".\n";
+    }
+    else if (!catalog.open(dir, false)) {
+        cerr << catalog.error() << ", make one with --rebuild.\n";
+        return false;
+    }
+
+    if (opts_in["--find"].specified)
+        entries = catalog.find(opts_in["--find"].value);
+    else
+        entries = catalog.since(0);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const CatalogRecord &entry = *entries[i];
+        time_t created = entry.created;
+        char when[32];
+        char header[17];
+
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+        snprintf(header, sizeof(header), "%016llx", (unsigned long long) entry.header_hash);
+
+        cout << when << "  " << (entry.card_id[0] ? entry.id() : entry.header_hash ? "CTR" : "-")
+             << "  " << (entry.card_title[0] ? entry.title() : "-")
+             << "  " << (entry.header_hash ? header : "-")
+             << "  " << entry.save_size << " bytes"
+             << "  " << (entry.flags & CatalogRecord::INCREMENTAL ? "incremental" : entry.flags & CatalogRecord::CONTAINER ? "container" : "raw")
+             << "  " << entry.name() << "\n";
+    }
+
+    if (entries.empty())
+        cout << (opts_in["--find"].specified ? "Nothing catalogued matches " + opts_in["--find"].value : "Nothing catalogued in " + dir) << ".\n";
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+static bool read_dump(const std::string &path, buffer_t &image) {
+/* +--------------------------------------------------------------------+ */
+    ContainerReader container;
+    SaveFile mapped (SaveFile::SYNC_NONE);
+
+    if (!mapped.open(path))
+        return false;
+
+    if (!ContainerReader::is_container(mapped.data(), mapped.size())) {
+        image.assign(mapped.data(), mapped.data() + mapped.size());
+        return !image.empty();
+    }
 
-int arg_passed;
-string arg_filename;
+    return container.open(path) && container.read_all(image);
+}
 
-struct cmd_opt {
-    string short_name;
-    string description;
-    string value_desc;
-    bool value_required;
-    bool specified;
-    string value;
+// What one way of compressing the held back dumps came to
+struct TrialResult {
+    long long in, out;
+    double seconds;
 };
 
-map<string, cmd_opt> opts_in = {
-    { "--help",           { "-?", "Shows this help", "", NULL } },
-    { "--output-header",  { "-h", "Save game header from device to FILE", "FILE", true } },
-    { "--output-firmware",{ "-f", "Save firmware information from device to FILE", "FILE", true } },
-//  { "--key-file",       { "-k", "Specifies the encryption key file to either save to or use", "FILE", true } },
-    { "--save-size",      { "-s", "Override detected save size with BYTES", "BYTES", true } },
-};
+/* +--------------------------------------------------------------------+
+ *
+ * (TrialResult) compression_trial()
+ * Compresses every save in images, whole or in 512 byte chunks
+ *
+ * +--------------------------------------------------------------------+ */
+static TrialResult compression_trial(const std::vector<const buffer_t *> &images, bool chunked,
+                                     const std::vector<const LzDictionary *> &dicts,
+                                     const std::vector<const std::unordered_set<uint64_t> *> &known) {
+/* +--------------------------------------------------------------------+ */
+    const size_t CHUNK = 512;
+    std::vector<long long> in (images.size()), out (images.size());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-struct command {
-    string description;
-    string file1;
-    string file2;
-};
+    run_parallel(images.size(), std::thread::hardware_concurrency(), [&](size_t i) {
+        const buffer_t &image = *images[i];
+        size_t step = chunked ? CHUNK : image.size();
+        buffer_t packed (step + step / 255 + 16);
 
-map<string, command> cmd_in = {
-    { "info", { "Display information about the currently inserted game card" } },
-    { "download", { "Downloads the currently inserted game card's save data and writes it to <filename>" } },
-    { "upload", { "Overwrites the currently inserted game card's save data with data from <filename>" } },
-    { "erase", { "Erase the save data stored on the currently inserted game card" } }
-};
+        for (size_t pos = 0; pos < image.size(); pos += step) {
+            size_t len = std::min(step, image.size() - pos);
 
-/* +-Functions----------------------------------------------------------+ */
-void device_ops();
-void draw_progress();
-void handle_sigint();
-int write_save_data();
-int read_save_data();
+            // As the archive would, chunks an earlier dump already had cost nothing
+            if (known[i] && known[i]->count(xxh64(&image[pos], len)))
+                continue;
+
+            size_t n = lz_compress(&image[pos], len, &packed[0], packed.size(), dicts[i]);
+            in[i] += len;
+            out[i] += n > 0 && n < len ? n : len;
+        }
+    });
+
+    TrialResult result = { 0, 0, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() };
+    for (size_t i = 0; i < images.size(); i++) {
+        result.in += in[i];
+        result.out += out[i];
+    }
+    return result;
+}
 
 /* +--------------------------------------------------------------------+
  *
- * int draw_progress ()
- * Draw a progress bar to stdout
+ * (bool) train_dictionaries()
+ * Trains a dictionary per game on the dumps in dir, into the --archive
  *
  * +--------------------------------------------------------------------+ */
-void draw_progress(double total, double current) {
+bool train_dictionaries(const std::string &dir) {
 /* +--------------------------------------------------------------------+ */
-    int width = 40;
-    double fraction = current / total;
-    int chars = round(fraction * width);
+    unsigned threads = std::thread::hardware_concurrency();
+    Catalog catalog;
+    Archive archive;
 
-    printf("%4.0f%% [",fraction*100);
+    if (!catalog.open(dir, false) && !catalog.rebuild(dir, threads)) {
+        cerr << catalog.error() << ".\n";
+        return false;
+    }
 
-    int i=0;
-    for (; i < chars-1; i++)
-        cout << "=";
+    if (!archive.open(opts_in["--archive"].value, true)) {
+        cerr << archive.error() << ".\n";
+        return false;
+    }
 
-    cout << ">";
+    // Every dump we know the game of, oldest first
+    std::vector<const CatalogRecord *> dumps;
+    std::map<std::string, std::vector<size_t> > games;
 
-    for (; i < width-1; i++)
-        cout << " ";
+    for (size_t i = 0; i < catalog.size(); i++) {
+        if (!catalog.at(i).key().empty()) {
+            games[catalog.at(i).key()].push_back(dumps.size());
+            dumps.push_back(&catalog.at(i));
+        }
+    }
 
-    cout << "] ";
-#ifdef __linux__
-    printf("%'u / %'u bytes", (int)current, (int)total);
-#else
-    printf("%u / %u bytes", (int)current, (int)total);
-#endif
+    std::vector<buffer_t> images (dumps.size());
+    run_parallel(dumps.size(), threads, [&](size_t i) {
+        read_dump(dir + "/" + dumps[i]->name(), images[i]);
+    });
 
-    if (current != total)
-        cout << "\b\r";
-    else
+    // Two per game: one on every dump to keep, one on all but the newest to test it against
+    std::vector<std::string> keys;
+    for (std::map<std::string, std::vector<size_t> >::const_iterator it = games.begin(); it != games.end(); ++it)
+        keys.push_back(it->first);
+
+    std::vector<LzDictionary> trained (keys.size()), held_out (keys.size());
+    std::vector<size_t> used (keys.size());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    run_parallel(keys.size() * 2, threads, [&](size_t task) {
+        const std::vector<size_t> &members = games[keys[task / 2]];
+        std::vector<LzSample> samples;
+
+        for (size_t m = 0; m + (task % 2) < members.size(); m++) {
+            if (!images[members[m]].empty())
+                samples.push_back(LzSample { &images[members[m]][0], images[members[m]].size() });
+        }
+
+        if (task % 2 == 0)
+            used[task / 2] = samples.size();
+        lz_train(samples, 64 * 1024, task % 2 == 0 ? trained[task / 2] : held_out[task / 2]);
+    });
+
+    double training = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t stored = 0;
+
+    cout << "\n";
+    for (size_t g = 0; g < keys.size(); g++) {
+        const CatalogRecord &newest = *dumps[games[keys[g]].back()];
+
+        cout << keys[g] << "  " << (newest.card_title[0] ? newest.title() : "-") << "  " << used[g] << " dump(s)  ";
+        if (trained[g].data.empty())
+            cout << "nothing in common to train on\n";
+        else if (!archive.add_dictionary(keys[g], trained[g].data))
+            cout << archive.error() << "\n";
+        else {
+            cout << trained[g].data.size() << " byte dictionary\n";
+            stored++;
+        }
+    }
+
+    cout << "\nTrained " << stored << " dictionary(s) from " << dumps.size() << " dump(s) in " << fixed << setprecision(2)
+         << training << "s, stored in " << opts_in["--archive"].value << ".\n";
+
+    // Each game's newest dump against what the ones before it would have given
+    std::vector<const buffer_t *> newest;
+    std::vector<const LzDictionary *> none, dicts;
+    std::vector<const std::unordered_set<uint64_t> *> unknown, earlier;
+    std::vector<std::unordered_set<uint64_t> > seen (keys.size());
+
+    for (size_t g = 0; g < keys.size(); g++) {
+        const std::vector<size_t> &members = games[keys[g]];
+        if (members.size() < 2 || images[members.back()].empty())
+            continue;
+
+        for (size_t m = 0; m + 1 < members.size(); m++) {
+            const buffer_t &image = images[members[m]];
+            for (size_t pos = 0; pos < image.size(); pos += 512)
+                seen[g].insert(xxh64(&image[pos], std::min<size_t>(512, image.size() - pos)));
+        }
+
+        newest.push_back(&images[members.back()]);
+        none.push_back(NULL);
+        dicts.push_back(held_out[g].data.empty() ? NULL : &held_out[g]);
+        unknown.push_back(NULL);
+        earlier.push_back(&seen[g]);
+    }
+
+    if (newest.empty()) {
+        cout << "No game has two dumps, so there's nothing to compare the dictionaries on.\n";
+        return true;
+    }
+
+    const char *names[] = { "whole save, lz", "512 byte chunks, lz", "512 byte chunks, dict", "new chunks only, dict" };
+    TrialResult trials[] = {
+        compression_trial(newest, false, none, unknown),
+        compression_trial(newest, true, none, unknown),
+        compression_trial(newest, true, dicts, unknown),
+        compression_trial(newest, true, dicts, earlier)
+    };
+
+    cout << "\nThe newest dump of " << newest.size() << " game(s), against dictionaries trained on the dumps before it:\n";
+    for (size_t t = 0; t < 4; t++) {
+        cout << "  " << left << setw(24) << names[t] << right << setw(10) << trials[t].out << " of " << setw(10) << trials[t].in
+             << " bytes  " << setw(6) << (trials[t].out ? (double) trials[t].in / trials[t].out : 0.0) << ":1  "
+             << setw(8) << (trials[t].seconds > 0 ? trials[t].in / trials[t].seconds / 1e6 : 0.0) << " MB/s\n";
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) analyze_dir()
+ * Counts what the dumps in dir are made of, each and all together
+ *
+ * +--------------------------------------------------------------------+ */
+bool analyze_dir(const std::string &dir) {
+/* +--------------------------------------------------------------------+ */
+    const size_t CHUNK = ChunkSketch::CHUNK_SIZE, TRACKED = 64, SHOWN = 10;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> names;
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        cerr << "Unable to read the directory " << dir << ".\n";
+        return false;
+    }
+
+    // As the catalog does, minus anything hidden and the keys we keep
+    while (struct dirent *entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name[0] == '.' ||
+            (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) ||
+            (name.size() > 8 && name.compare(name.size() - 8, 8, ".journal") == 0) ||
+            (name.size() > 4 && name.compare(name.size() - 4, 4, ".crc") == 0) ||
+            (name.size() > 4 && name.compare(name.size() - 4, 4, ".key") == 0))
+            continue;
+
+        names.push_back(name);
+    }
+
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    // One slot per file in each, filled in by whichever thread takes the file
+    std::vector<uint64_t> sizes (names.size()), blank (names.size()), zero (names.size());
+    std::vector<uint64_t> key_count (names.size()), key_hash (names.size());
+    std::vector<char> usable (names.size(), 0);
+    std::vector<ChunkSketch> sketches (threads, ChunkSketch(TRACKED));
+    std::atomic<size_t> next (0);
+    const std::string erased (CHUNK, (char) 0xFF), zeroed (CHUNK, 0);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    run_parallel(threads, threads, [&](size_t t) {
+        for (size_t i = next++; i < names.size(); i = next++) {
+            std::string path = dir + "/" + names[i];
+            SaveFile mapped (SaveFile::SYNC_NONE);
+            buffer_t unpacked;
+
+            if (!mapped.open(path))
+                continue;
+
+            const char *data = mapped.data();
+            size_t size = mapped.size();
+
+            if (ContainerReader::is_container(data, size)) {
+                ContainerReader container;
+                if (!container.open(path) || !container.read_all(unpacked) || unpacked.empty())
+                    continue;
+                data = &unpacked[0];
+                size = unpacked.size();
+            }
+            else if (size < CHUNK || (size & (size - 1)))
+                continue;
+
+            KeyFinder finder;
+            finder.chunk_data(data, size);
+
+            // Blank and zeroed chunks are counted here, they'd only crowd everything else out of the sketch
+            for (size_t pos = 0; pos + CHUNK <= size; pos += CHUNK) {
+                if (first_difference(data + pos, erased.data(), CHUNK) == CHUNK)
+                    blank[i]++;
+                else if (first_difference(data + pos, zeroed.data(), CHUNK) == CHUNK)
+                    zero[i]++;
+                else
+                    sketches[t].add(data + pos);
+            }
+
+            std::string key;
+            size_t count = 0;
+            // A save that's mostly zeroes isn't encrypted, however often the zeroes repeat
+            if (finder.get_key(key, &count) && key != zeroed) {
+                key_count[i] = count;
+                key_hash[i] = xxh64(key.data(), key.size());
+            }
+
+            sizes[i] = size;
+            usable[i] = 1;
+        }
+    });
+
+    ChunkSketch &all = sketches[0];
+    for (size_t t = 1; t < sketches.size(); t++)
+        all.merge(sketches[t]);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t bytes = 0, chunks = 0, blanks = 0, zeros = 0;
+    size_t files = 0;
+    std::map<uint64_t, std::vector<size_t> > keys;
+    char hash[17];
+
+    cout << "\n";
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!usable[i])
+            continue;
+
+        uint64_t n = sizes[i] / CHUNK;
+        files++;
+        bytes += sizes[i];
+        chunks += n;
+        blanks += blank[i];
+        zeros += zero[i];
+
+        cout << left << setw(32) << names[i] << right << setw(10) << sizes[i] << " bytes  " << fixed << setprecision(1)
+             << setw(5) << (n ? 100.0 * blank[i] / n : 0.0) << "% blank  " << setw(5) << (n ? 100.0 * zero[i] / n : 0.0) << "% zero  ";
+
+        if (key_count[i]) {
+            keys[key_hash[i]].push_back(i);
+            snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) key_hash[i]);
+            cout << "key " << hash << " in " << setw(5) << (n ? 100.0 * key_count[i] / n : 0.0) << "% of chunks\n";
+        }
+        else
+            cout << "no key\n";
+    }
+
+    if (!files) {
+        cout << "Nothing in " << dir << " looks like a save.\n";
+        return false;
+    }
+
+    cout << "\nRead " << files << " save(s), " << bytes << " bytes in " << fixed << setprecision(3) << seconds << "s ("
+         << setprecision(1) << (seconds > 0 ? bytes / seconds / 1e6 : 0.0) << " MB/s) on " << threads << " thread(s).\n"
+         << chunks << " chunks: " << setprecision(1) << (chunks ? 100.0 * blanks / chunks : 0.0) << "% blank, "
+         << (chunks ? 100.0 * zeros / chunks : 0.0) << "% zero, " << all.total() << " counted.\n";
+
+    // The same key in several dumps means the same pad, and usually the same game
+    bool shared = false;
+    for (std::map<uint64_t, std::vector<size_t> >::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+        if (it->second.size() < 2)
+            continue;
+
+        if (!shared)
+            cout << "\nKeys shared between saves:\n";
+        shared = true;
+
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) it->first);
+        cout << "  " << hash << "  " << it->second.size() << " saves:";
+        for (size_t j = 0; j < it->second.size(); j++)
+            cout << " " << names[it->second[j]];
+        cout << "\n";
+    }
+
+    std::vector<ChunkSketch::Heavy> common = all.top();
+    size_t shown = 0;
+
+    for (size_t i = 0; i < common.size() && shown < SHOWN; i++) {
+        const ChunkSketch::Heavy &chunk = common[i];
+        if (chunk.count < 2)
+            break;
+
+        if (!shown)
+            cout << "\nMost common chunks (counts are upper bounds):\n";
+        shown++;
+
+        char start_bytes[3 * 8 + 1];
+        for (size_t b = 0; b < 8; b++)
+            snprintf(start_bytes + b * 3, 4, "%02x ", (unsigned char) chunk.chunk[b]);
+
+        uint64_t chunk_hash = xxh64(chunk.chunk.data(), CHUNK);
+        std::map<uint64_t, std::vector<size_t> >::const_iterator key = keys.find(chunk_hash);
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) chunk_hash);
+
+        cout << "  " << setw(10) << chunk.count << "x  " << hash << "  " << start_bytes << "...";
+        if (key != keys.end())
+            cout << "  key of " << key->second.size() << " save(s)";
         cout << "\n";
+    }
+
+    if (!shown)
+        cout << "\nNo chunk turns up more than once.\n";
+
+    return true;
 }
 
 /* +--------------------------------------------------------------------+
  *
- * device_ops()
+ * (bool) device_ops()
  * Start device operations
  *
  * +--------------------------------------------------------------------+ */
-void device_ops() {
+bool device_ops() {
 /* +--------------------------------------------------------------------+ */
     // Initialize the HID API
     hid_init();
-    dev = new R4iSaveDongle;
+
+    if (arg_passed == ARG_UPLOAD && opts_in["--all"].specified) {
+        return upload_all();
+    }
+
+    if (arg_passed == ARG_DAEMON) {
+#ifndef _WIN32
+        return run_daemon(opts_in["--socket"].value.length() ? opts_in["--socket"].value : default_socket_path());
+#else
+        cerr << "The daemon isn't supported on this platform.\n";
+        return false;
+#endif
+    }
+
+    // Use the first device any of our drivers recognises
+    std::vector<HIDMatch> devices = probe_devices();
+    if (devices.empty()) {
+        cout << "Device not found (protip: make sure the device is plugged in, and permissions are set)\n";
+        return false;
+    }
+
+    dev = devices[0].driver->create(devices[0].path.c_str());
 
     int override_save_size = 0;
     std::string rom_header_output = opts_in["--output-header"].value;
@@ -177,14 +2822,18 @@ void device_ops() {
         override_save_size = atoi(opts_in["--save-size"].value.c_str());
 
     if(!dev->found) {
-        // Could try a different device here, such as the NDS Backup Adapter Plus
-        cout << "Device not found (protip: make sure the device is plugged in, and permissions are set)\n";
-        return;
+        cout << "Unable to open " << devices[0].driver->name << " (protip: make sure permissions are set)\n";
+        return false;
     }
 
+    if (!configure_device(dev))
+        cerr << "Reconnecting isn't supported on this platform, ignoring --reconnect.\n";
+
     // We found our device, let's give some confirmation
     cout << dev->name << " v" << dev->version << " found." << "\n";
 
+    // Failing to write either debug file doesn't stop the command, but it's still a failure
+    bool saved = true;
 
     // Output firmware data to file for debugging, if requested
     if (firmware_output.length() > 0) {
@@ -193,8 +2842,10 @@ void device_ops() {
             firmware_file.write(&dev->firmware_data[0], dev->firmware_data.size());
             firmware_file.close();
         }
-        else
+        else {
             cerr << "Unable to open " << firmware_output << " for writing, check your permissions.\n";
+            saved = false;
+        }
     }
 
     // Output card header to file for debugging, if requested
@@ -204,139 +2855,62 @@ void device_ops() {
             rom_header_file.write(&dev->card_header[0], dev->card_header.size());
             rom_header_file.close();
         }
-        else
+        else {
             cerr << "Unable to open " << rom_header_output << " for writing, check your permissions.\n";
+            saved = false;
+        }
     }
 
+    if (arg_passed == ARG_BATCH)
+        return run_batch(arg_filename, override_save_size) && saved;
+
+    if (arg_passed == ARG_WATCH)
+        return watch_cards(arg_filename.empty() ? "{card_id}-{timestamp}.sav" : arg_filename, override_save_size) && saved;
+
     // Can't continue without a card to work with
     if (!dev->has_card) {
         cerr << "No card inserted!\n";
-        return;
-    }
-
-    // Dump some info about the game
-    if (dev->card_title.size() > 0) {
-        cout << "Detected game: " << dev->card_id << " " << dev->card_title;
-        cout << " (" << dev->card_size << "Mb" << ")\n";
+        return false;
     }
-    else // only neimod can decrypt the 3DS headers :-/
-        cout << "Detected unknown CTR-005 game (encrypted 3DS card)\n";
-
-    // Output game save size
-    cout << "Save game size: ";
-
-    if (override_save_size > 0)
-        dev->save_size = override_save_size;
-
-    if (dev->save_size > 0) {
-        if (dev->save_size > 1048576)
-            cout << (dev->save_size / 1048576.00) << "MB";
-        else
-            cout << (dev->save_size / 1024.00) << "kB";
 
-        cout << (override_save_size > 0 ? " (user defined)\n" : "\n");
-    }
-    else {
-        cout << "(unknown)\n";
-    }
+    print_card_info(override_save_size);
 
     // If all we're doing is outputting info, let's get out now.
     if (arg_passed == ARG_INFO)
-        return;
-
-    // Most other commands need us to know the save size
-    if (arg_passed != ARG_UPLOAD && dev->save_size <= 0) {
-        cerr << "Unable to detect save size (override with --save-size=BYTES).\n";
-        return;
-    }
+        return saved;
 
-    cout << endl;
-
-    if (arg_passed == ARG_ERASE) {
-        char buff[128];
-        std::fill(&buff[0], &buff[0] + 128, 0xFF);
-
-        // We create an istrstream that can behave like istream and
-        // fill it with 128 bytes of zeros before passing to dev->write()
-        std::istringstream is (std::string(buff, 128), ios::binary);
-
-        int i=0, written=0;
-        do {
-            dev->write(is, written);
-            written = ++i * is.tellg();
-            is.seekg(0); // Reset the position in the stream for the next iteration
-            draw_progress(dev->save_size, written);
-        }
-        while (written < dev->save_size);
-
-        cout << "\nData successfully written to game card.\n";
-        return;
-    }
+    bool ok = run_command(arg_passed, arg_filename);
 
-    fstream file (arg_filename, ios::binary | (arg_passed == ARG_DOWNLOAD ? ios::out : ios::in));
-
-    if (arg_passed == ARG_DOWNLOAD) {
-        do {
-            dev->read(file);
-            draw_progress(dev->save_size, file.tellp());
-        }
-        while (file.tellp() < dev->save_size);
-        cout << "\nData successfully downloaded to " << arg_filename << ".";
-    }
-    else if (arg_passed == ARG_UPLOAD) {
-        // Get the file size by subtracting the beginning position from the end
-        long file_size = 1 + file.seekg(-1, ios::end).tellg() - file.seekg(0, ios::beg).tellg();
-
-        // We can guess the save size from the passed file's size
-        if (dev->save_size <= 0)
-            dev->save_size = file_size;
-        else if (dev->save_size != (file_size)) {
-            cerr << "Mismatched file size is " << file_size
-                 << " bytes, save size is " << dev->save_size << " bytes.\n";
-
-            return;
-        }
-
-        do {
-            dev->write(file);
-            draw_progress(dev->save_size, file.tellg());
-        }
-        while (file.tellg() < (dev->save_size));
-        cout << "\nData successfully written to game card.";
-    }
+    print_transfer_stats(dev);
 
     cout << endl;
+    return ok && saved;
 }
 
 /* +--------------------------------------------------------------------+
  *
  * handle_sigint()
- * Handler for Ctrl+C, need to clean up devices here
+ * Handler for Ctrl+C, asks the current transfer to stop at the next block
  *
  * +--------------------------------------------------------------------+ */
 void handle_sigint(int s) {
 /* +--------------------------------------------------------------------+ */
-    // Make sure the cursor is back on and input is shown
-    CURSOR_ON();
-    SHOW_INPUT();
-
-    // Let the device clean itself up
-    delete dev;
+    // The transfer loops flush their output and clean up the device themselves,
+    // but a second Ctrl+C means the user wants out right now
+    if (cancel_token.requested()) {
+        CURSOR_ON();
+        SHOW_INPUT();
+        _exit(1);
+    }
 
-    // Stick a couple of newlines in for good measure
-    cout << "\n" << endl;
-    exit(1);
+    cancel_token.request();
 }
 
 /* +--------------------------------------------------------------------+ */
 int main(int argc, char *argv[]) {
 /* +--------------------------------------------------------------------+ */
-    bool cmd_set = false;
+    bool cmd_set = false, ok = false;
     setlocale(LC_ALL, "");
-    cout << "\n" << APPNAME << " v" << APPVERSION << " by McHaggis\n";
-
-    CURSOR_OFF();
-    HIDE_INPUT();
 
     vector<string> args(argv, argv+argc);
 
@@ -348,7 +2922,7 @@ int main(int argc, char *argv[]) {
         string &arg = args[i];
 
         // If first char is -, it's an option
-        if (arg.substr(0,1) == "-") {
+        if (arg.substr(0,1) == "-" && arg != "-") {
             istringstream iss(arg);
             string opt_name;
             string opt_val;
@@ -376,7 +2950,9 @@ int main(int argc, char *argv[]) {
             else {
                 cmd_opt &opt = opts_in[opt_name];
                 opt.specified = true;
-                if (opt_val.size() == 0) {
+                if (!opt.value_required)
+                    opt.value = opt_val;
+                else if (opt_val.size() == 0) {
                     if (i == args.size() -1) {
                         cerr << "ERROR: No value specified for option '" << opt_name << "'.\n" << endl;
                         goto error;
@@ -397,6 +2973,36 @@ int main(int argc, char *argv[]) {
                 arg_passed = ARG_UPLOAD;
             else if (arg == "erase")
                 arg_passed = ARG_ERASE;
+            else if (arg == "verify")
+                arg_passed = ARG_VERIFY;
+            else if (arg == "batch")
+                arg_passed = ARG_BATCH;
+            else if (arg == "daemon")
+                arg_passed = ARG_DAEMON;
+            else if (arg == "client")
+                arg_passed = ARG_CLIENT;
+            else if (arg == "watch")
+                arg_passed = ARG_WATCH;
+            else if (arg == "archive")
+                arg_passed = ARG_ARCHIVE;
+            else if (arg == "import")
+                arg_passed = ARG_IMPORT;
+            else if (arg == "export")
+                arg_passed = ARG_EXPORT;
+            else if (arg == "catalog")
+                arg_passed = ARG_CATALOG;
+            else if (arg == "train")
+                arg_passed = ARG_TRAIN;
+            else if (arg == "checksum")
+                arg_passed = ARG_CHECKSUM;
+            else if (arg == "diff")
+                arg_passed = ARG_DIFF;
+            else if (arg == "decrypt")
+                arg_passed = ARG_DECRYPT;
+            else if (arg == "encrypt")
+                arg_passed = ARG_ENCRYPT;
+            else if (arg == "analyze")
+                arg_passed = ARG_ANALYZE;
             else {
                 cerr << "ERROR: '" << arg << "' is not a valid command for this application.\n" << endl;
                 goto error;
@@ -404,16 +3010,147 @@ int main(int argc, char *argv[]) {
 
             cmd_set = true;
         }
-        else if (arg_passed == ARG_DOWNLOAD || arg_passed == ARG_UPLOAD) {
+        else if (arg_passed == ARG_CLIENT && !arg_client_command) {
+            // The daemon does everything but batches itself
+            if (arg == "info")
+                arg_client_command = ARG_INFO;
+            else if (arg == "download")
+                arg_client_command = ARG_DOWNLOAD;
+            else if (arg == "upload")
+                arg_client_command = ARG_UPLOAD;
+            else if (arg == "erase")
+                arg_client_command = ARG_ERASE;
+            else if (arg == "verify")
+                arg_client_command = ARG_VERIFY;
+            else if (arg == "checksum")
+                arg_client_command = ARG_CHECKSUM;
+            else {
+                cerr << "ERROR: '" << arg << "' can't be sent to the daemon.\n" << endl;
+                goto error;
+            }
+        }
+        else if (arg_passed == ARG_DOWNLOAD || arg_passed == ARG_UPLOAD || arg_passed == ARG_VERIFY || arg_passed == ARG_BATCH || arg_passed == ARG_CLIENT ||
+                 arg_passed == ARG_WATCH || arg_passed == ARG_ARCHIVE || arg_passed == ARG_CATALOG ||
+                 arg_passed == ARG_TRAIN || arg_passed == ARG_CHECKSUM || arg_passed == ARG_ANALYZE) {
             arg_filename = arg;
         }
+        else if (arg_passed == ARG_IMPORT || arg_passed == ARG_EXPORT || arg_passed == ARG_DIFF ||
+                 arg_passed == ARG_DECRYPT || arg_passed == ARG_ENCRYPT) {
+            (arg_filename.empty() ? arg_filename : arg_filename2) = arg;
+        }
+    }
+
+    if (arg_passed == ARG_CLIENT && !arg_client_command) {
+        cerr << "ERROR: client needs a command to send to the daemon.\n" << endl;
+        goto error;
+    }
+
+    if ((arg_passed == ARG_DOWNLOAD || arg_passed == ARG_UPLOAD || arg_passed == ARG_VERIFY || arg_passed == ARG_ARCHIVE ||
+         (arg_passed == ARG_CLIENT && arg_client_command != ARG_INFO && arg_client_command != ARG_ERASE &&
+          arg_client_command != ARG_CHECKSUM)) && arg_filename == "") {
+        cerr << "ERROR: <filename> is required for upload, download and verify operations.\n" << endl;
+        goto error;
+    }
+
+    if ((arg_passed == ARG_IMPORT || arg_passed == ARG_EXPORT) && arg_filename2 == "") {
+        cerr << "ERROR: import and export need a file to read and a file to write.\n" << endl;
+        goto error;
+    }
+
+    if (opts_in["--key-file"].specified && arg_passed == ARG_DOWNLOAD && arg_filename == "-") {
+        cerr << "ERROR: --key-file needs the download in a file to look for the key in.\n" << endl;
+        goto error;
+    }
+
+    if ((arg_passed == ARG_DECRYPT || arg_passed == ARG_ENCRYPT) && arg_filename2 == "") {
+        cerr << "ERROR: decrypt and encrypt need a save to read and a file to write.\n" << endl;
+        goto error;
+    }
+
+    if (opts_in["--decrypt"].specified && (opts_in["--archive"].specified || opts_in["--container"].specified || opts_in["--incremental"].specified ||
+                                           opts_in["--paranoid"].specified || opts_in["--resume"].specified || opts_in["--repair"].specified)) {
+        cerr << "ERROR: --decrypt only works on plain downloads started afresh, decrypt the save afterwards instead.\n" << endl;
+        goto error;
+    }
+
+    if (arg_passed == ARG_DIFF && arg_filename2 == "") {
+        cerr << "ERROR: diff needs two saves to compare.\n" << endl;
+        goto error;
+    }
+
+    if (arg_passed == ARG_ARCHIVE && !opts_in["--archive"].specified) {
+        cerr << "ERROR: archive needs --archive=DIR to copy the save into.\n" << endl;
+        goto error;
+    }
+
+    if (arg_passed == ARG_TRAIN && !opts_in["--archive"].specified) {
+        cerr << "ERROR: train needs --archive=DIR to keep the dictionaries in.\n" << endl;
+        goto error;
+    }
+
+    if (opts_in["--repair"].specified && (arg_filename == "-" || opts_in["--archive"].specified || opts_in["--container"].specified ||
+                                          opts_in["--incremental"].specified || opts_in["--paranoid"].specified || opts_in["--resume"].specified)) {
+        cerr << "ERROR: --repair only works on a plain save file downloaded with checksums.\n" << endl;
+        goto error;
+    }
+
+    // Every transfer reports progress the same way
+    {
+        ProgressRenderer::Style style = ProgressRenderer::BAR;
+        cmd_opt &progress = opts_in["--progress"];
+
+        if (progress.specified && !ProgressRenderer::parse_style(progress.value, style)) {
+            cerr << "ERROR: '" << progress.value << "' is not a valid progress mode, use bar, jsonl or none.\n" << endl;
+            goto error;
+        }
+
+        int fd = opts_in["--progress-fd"].specified ? atoi(opts_in["--progress-fd"].value.c_str()) : 2;
+        ProgressRenderer::configure(style, fd);
+    }
+
+    if (opts_in["--fsync"].specified && !SaveFile::parse_durability(opts_in["--fsync"].value, durability)) {
+        cerr << "ERROR: '" << opts_in["--fsync"].value << "' is not a valid sync policy, use none, end or periodic.\n" << endl;
+        goto error;
+    }
+
+    if (opts_in["--chunking"].specified && !Archive::parse_chunking(opts_in["--chunking"].value, chunking)) {
+        cerr << "ERROR: '" << opts_in["--chunking"].value << "' is not a valid chunking mode, use fixed or cdc.\n" << endl;
+        goto error;
+    }
+
+    if (opts_in["--hash"].specified && !SaveDigest::parse(opts_in["--hash"].value, digest_algorithm)) {
+        cerr << "ERROR: '" << opts_in["--hash"].value << "' is not a valid hash, use fast or sha256.\n" << endl;
+        goto error;
     }
 
-    if ((arg_passed == ARG_DOWNLOAD || arg_passed == ARG_UPLOAD) && arg_filename == "") {
-        cerr << "ERROR: <filename> is required for upload and download operations.\n" << endl;
+    if (opts_in["--compress"].specified && !Archive::parse_compression(opts_in["--compress"].value, compression)) {
+        cerr << "ERROR: '" << opts_in["--compress"].value << "' is not a valid compression mode, use none, lz or dict.\n" << endl;
         goto error;
     }
 
+    // Read here, once, as devices are configured from several threads at a time
+    if (opts_in["--timeout"].value.length())
+        timeout_ms = std::max(0, atoi(opts_in["--timeout"].value.c_str()));
+
+    if (opts_in["--retries"].value.length())
+        retry_limit = std::max(0, atoi(opts_in["--retries"].value.c_str()));
+
+    reconnect_seconds = atoi(opts_in["--reconnect"].value.c_str());
+
+    // When the save itself (or diff's JSON) goes to stdout, everything we'd normally print there goes to stderr
+    if ((arg_filename == "-" && (arg_passed == ARG_DOWNLOAD || (arg_passed == ARG_CLIENT && arg_client_command == ARG_DOWNLOAD))) ||
+        (arg_passed == ARG_DIFF && opts_in["--json"].specified)) {
+        stdout_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    cout << "\n" << APPNAME << " v" << APPVERSION << " by McHaggis\n";
+
+    CURSOR_OFF();
+    {
+        HIDE_INPUT();
+    }
+
 #ifdef __linux__
     // Setup SIGINT handler
     struct sigaction sigIntHandler;
@@ -426,16 +3163,39 @@ int main(int argc, char *argv[]) {
 #endif
 
     // Finally, start dicking around with the device
-    device_ops();
+    if (arg_passed == ARG_CLIENT)
+        ok = client_ops();
+    else if (arg_passed == ARG_ARCHIVE)
+        ok = archive_file(arg_filename);
+    else if (arg_passed == ARG_IMPORT || arg_passed == ARG_EXPORT)
+        ok = convert_file(arg_passed, arg_filename, arg_filename2);
+    else if (arg_passed == ARG_DIFF)
+        ok = diff_files(arg_filename, arg_filename2);
+    else if (arg_passed == ARG_DECRYPT || arg_passed == ARG_ENCRYPT)
+        ok = crypt_file(arg_passed, arg_filename, arg_filename2);
+    else if (arg_passed == ARG_CATALOG)
+        ok = list_catalog(arg_filename.empty() ? "." : arg_filename);
+    else if (arg_passed == ARG_TRAIN)
+        ok = train_dictionaries(arg_filename.empty() ? "." : arg_filename);
+    else if (arg_passed == ARG_ANALYZE)
+        ok = analyze_dir(arg_filename.empty() ? "." : arg_filename);
+    else
+        ok = device_ops();
+
+    // Let the device clean itself up
+    delete dev;
+
     CURSOR_ON();
     SHOW_INPUT();
 
     cout << endl;
 
-    return 1;
+    // A verify or diff that finds differences counts as failing too
+    return ok ? 0 : 1;
 
 help:
     // Display help if no arguments
+    cout << "\n" << APPNAME << " v" << APPVERSION << " by McHaggis\n";
     cout << "Usage: " << APPCMD << " [OPTIONS] <command> <filename>\n\n"
          << "The following commands are available:\n\n";
 
@@ -0,0 +1,376 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "journal.h"
+#include "pipeline.h"
+#include "savefile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+
+#ifndef _WIN32
+  #include <poll.h>
+#endif
+
+const size_t PipelineBlock::SIZE;
+const size_t Pipeline::BLOCKS;
+
+/* +--------------------------------------------------------------------+
+ *
+ * backoff()
+ * Waits a little longer each time an empty queue is polled again
+ *
+ * +--------------------------------------------------------------------+ */
+static void backoff(int &spins) {
+/* +--------------------------------------------------------------------+ */
+    // A block is usually only a moment away, so spin before giving up the CPU
+    if (spins < 64)
+        spins++;
+    else if (spins < 128) {
+        spins++;
+        std::this_thread::yield();
+    }
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+/* +--------------------------------------------------------------------+ */
+Pipeline::Pipeline(Direction direction)
+    : direction(direction), blocks(BLOCKS), error(false), completed(false), running(false) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+ */
+Pipeline::~Pipeline() {
+/* +--------------------------------------------------------------------+ */
+    finish(false);
+
+    for (size_t i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * add()
+ * Appends a stage, blocks go through them in the order they're added
+ *
+ * +--------------------------------------------------------------------+ */
+void Pipeline::add(PipelineStage *stage) {
+/* +--------------------------------------------------------------------+ */
+    stages.push_back(stage);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * start()
+ * Hands out the blocks and starts a thread for each stage
+ *
+ * +--------------------------------------------------------------------+ */
+void Pipeline::start() {
+/* +--------------------------------------------------------------------+ */
+    for (size_t i = 0; i <= stages.size(); i++)
+        queues.push_back(new Queue());
+
+    Queue *idle = direction == DOWNLOAD ? queues.back() : queues.front();
+    for (size_t i = 0; i < blocks.size(); i++)
+        idle->push(&blocks[i]);
+
+    for (size_t i = 0; i < stages.size(); i++)
+        workers.push_back(std::thread(&Pipeline::run_stage, this, i));
+
+    running = true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (PipelineBlock *) acquire()
+ * Next block back from the last stage, NULL once there won't be any more
+ *
+ * +--------------------------------------------------------------------+ */
+PipelineBlock *Pipeline::acquire() {
+/* +--------------------------------------------------------------------+ */
+    PipelineBlock *block;
+    int spins = 0;
+
+    while (!queues.back()->pop(block))
+        backoff(spins);
+
+    return failed() ? NULL : block;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * submit()
+ * Passes a block on to the first stage
+ *
+ * +--------------------------------------------------------------------+ */
+void Pipeline::submit(PipelineBlock *block) {
+/* +--------------------------------------------------------------------+ */
+    queues.front()->push(block);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) finish()
+ * Lets every stage drain and wrap up, false if any of them failed
+ *
+ * +--------------------------------------------------------------------+ */
+bool Pipeline::finish(bool complete) {
+/* +--------------------------------------------------------------------+ */
+    if (running) {
+        completed.store(complete, std::memory_order_release);
+
+        // The end marker follows the last block through every stage
+        queues.front()->push(NULL);
+
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+
+        workers.clear();
+        running = false;
+    }
+
+    return !failed();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) failure()
+ * Why the first failed stage gave up
+ *
+ * +--------------------------------------------------------------------+ */
+std::string Pipeline::failure() const {
+/* +--------------------------------------------------------------------+ */
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (!stages[i]->failure.empty())
+            return stages[i]->failure;
+    }
+
+    return "";
+}
+
+/* +--------------------------------------------------------------------+ */
+void Pipeline::run_stage(size_t index) {
+/* +--------------------------------------------------------------------+ */
+    PipelineStage *stage = stages[index];
+    PipelineBlock *block;
+    int spins = 0;
+
+    for (;;) {
+        if (!queues[index]->pop(block)) {
+            backoff(spins);
+            continue;
+        }
+
+        spins = 0;
+        if (!block)
+            break;
+
+        // After a failure blocks still go round, just untouched, so nobody is left waiting
+        if (!failed() && !stage->process(*block))
+            error.store(true, std::memory_order_release);
+
+        queues[index + 1]->push(block);
+    }
+
+    if (!stage->finish(completed.load(std::memory_order_acquire) && !failed()))
+        error.store(true, std::memory_order_release);
+
+    queues[index + 1]->push(NULL);
+}
+
+/* +--------------------------------------------------------------------+ */
+bool SaveFileSink::process(PipelineBlock &block) {
+/* +--------------------------------------------------------------------+ */
+    long long end = std::min<long long>(block.offset + block.length, file.size());
+
+    if (block.offset < end)
+        memcpy(file.data() + block.offset, block.data, end - block.offset);
+
+    if (journal)
+        journal->complete(pass, end);
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool SaveFileSink::finish(bool complete) {
+/* +--------------------------------------------------------------------+ */
+    // Whatever made it this far is kept for --resume
+    if (!complete) {
+        if (journal)
+            journal->commit();
+
+        return true;
+    }
+
+    if (!file.finish()) {
+        failure = "Unable to sync the save to disk";
+        return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool StreamSink::process(PipelineBlock &block) {
+/* +--------------------------------------------------------------------+ */
+    if (!out.write(block.data, block.length)) {
+        failure = "Unable to write to " + name;
+        return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool StreamSink::finish(bool) {
+/* +--------------------------------------------------------------------+ */
+    if (!out.flush()) {
+        failure = "Unable to write to " + name;
+        return false;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) FdSource::process()
+ * Reads a whole block ahead, an empty one once the input runs out
+ *
+ * +--------------------------------------------------------------------+ */
+bool FdSource::process(PipelineBlock &block) {
+/* +--------------------------------------------------------------------+ */
+    size_t want = PipelineBlock::SIZE;
+    if (size >= 0)
+        want = std::min<long long>(want, size - done);
+
+    block.offset = done;
+    block.length = 0;
+
+    while (block.length < want) {
+#ifndef _WIN32
+        // Don't sit in read() forever on a pipe that's gone quiet once we're cancelled
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) == 0) {
+            if (cancel_token.requested())
+                break;
+            continue;
+        }
+#endif
+        ssize_t n = ::read(fd, block.data + block.length, want - block.length);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0) {
+            failure = "Unable to read the save";
+            return false;
+        }
+
+        if (n == 0)
+            break;
+
+        block.length += n;
+    }
+
+    done += block.length;
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+PipelineReader::~PipelineReader() {
+/* +--------------------------------------------------------------------+ */
+    if (block)
+        pipeline.submit(block);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (ssize_t) PipelineReader::fetch()
+ * Copies out of the current block, moving on to the next when it's used up
+ *
+ * +--------------------------------------------------------------------+ */
+ssize_t PipelineReader::fetch(char *buf, size_t max) {
+/* +--------------------------------------------------------------------+ */
+    if (ended)
+        return 0;
+
+    if (!block) {
+        block = pipeline.acquire();
+        used = 0;
+
+        if (!block || block->length == 0) {
+            if (block)
+                pipeline.submit(block);
+
+            block = NULL;
+            ended = true;
+            return 0;
+        }
+    }
+
+    size_t n = std::min(max, block->length - used);
+    memcpy(buf, block->data + used, n);
+    used += n;
+
+    // Straight back to the source to be filled again
+    if (used == block->length) {
+        pipeline.submit(block);
+        block = NULL;
+    }
+
+    return n;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * run_parallel()
+ * Calls work(i) for every i below count, a few threads at a time
+ *
+ * +--------------------------------------------------------------------+ */
+void run_parallel(size_t count, unsigned threads, const std::function<void(size_t)> &work) {
+/* +--------------------------------------------------------------------+ */
+    std::atomic<size_t> next (0);
+    std::vector<std::thread> workers;
+
+    // Each thread takes the next item as it finishes one, so slow items don't hold up the rest
+    std::function<void()> take = [&next, count, &work]() {
+        for (size_t i = next++; i < count; i = next++)
+            work(i);
+    };
+
+    threads = std::max(1u, std::min<unsigned>(threads, count));
+    for (unsigned t = 1; t < threads; t++)
+        workers.push_back(std::thread(take));
+
+    take();
+
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
@@ -0,0 +1,258 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "progress.h"
+
+#include <algorithm>
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+#endif
+
+// Thousands separators only work with glibc's printf
+#ifdef __linux__
+  #define BYTES_FMT "%'lld"
+#else
+  #define BYTES_FMT "%lld"
+#endif
+
+const int
+    ProgressRenderer::BAR_INTERVAL_MS,
+    ProgressRenderer::JSONL_INTERVAL_MS,
+    ProgressRenderer::RATE_WINDOW_MS;
+
+ProgressRenderer::Style ProgressRenderer::style = ProgressRenderer::BAR;
+int ProgressRenderer::fd = 2;
+
+/* +--------------------------------------------------------------------+ */
+static std::string format_time(double seconds) {
+/* +--------------------------------------------------------------------+ */
+    char buf[32];
+    long s = lround(seconds);
+
+    if (s >= 3600)
+        snprintf(buf, sizeof(buf), "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+    else
+        snprintf(buf, sizeof(buf), "%ld:%02ld", s / 60, s % 60);
+
+    return buf;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse_style()
+ * Maps a --progress value to a Style, false if we don't know it
+ *
+ * +--------------------------------------------------------------------+ */
+bool ProgressRenderer::parse_style(const std::string &name, Style &result) {
+/* +--------------------------------------------------------------------+ */
+    if (name == "bar")
+        result = BAR;
+    else if (name == "jsonl")
+        result = JSONL;
+    else if (name == "none")
+        result = NONE;
+    else
+        return false;
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * configure()
+ * Chooses how every transfer from now on reports its progress
+ *
+ * +--------------------------------------------------------------------+ */
+void ProgressRenderer::configure(Style new_style, int new_fd) {
+/* +--------------------------------------------------------------------+ */
+    style = new_style;
+    fd = new_fd;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * ProgressRenderer()
+ * Starts reporting a transfer of total bytes, start of which are done
+ *
+ * +--------------------------------------------------------------------+ */
+ProgressRenderer::ProgressRenderer(const char *op, long long total, long long start)
+    : op(op), total(total), start(start), bytes(start), stopping(false), finished(false) {
+/* +--------------------------------------------------------------------+ */
+    started = clock::now();
+
+    Sample first = { started, start };
+    samples.push_back(first);
+
+    if (style == JSONL) {
+        char line[256];
+        int len = snprintf(line, sizeof(line),
+            "{\"event\":\"start\",\"op\":\"%s\",\"bytes\":%lld,\"total\":%lld}\n", op, start, total);
+        emit(line, len);
+    }
+
+    if (style != NONE)
+        renderer = std::thread(&ProgressRenderer::run, this);
+}
+
+/* +--------------------------------------------------------------------+ */
+ProgressRenderer::~ProgressRenderer() {
+/* +--------------------------------------------------------------------+ */
+    // Callers that bail out early still get the renderer stopped
+    finish("stopped");
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * finish()
+ * Stops the renderer and draws the final state of the transfer
+ *
+ * +--------------------------------------------------------------------+ */
+void ProgressRenderer::finish(const char *status) {
+/* +--------------------------------------------------------------------+ */
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (finished)
+            return;
+
+        stopping = true;
+        finished = true;
+    }
+
+    wake.notify_one();
+
+    if (renderer.joinable())
+        renderer.join();
+
+    if (style != NONE)
+        render(status);
+}
+
+/* +--------------------------------------------------------------------+ */
+void ProgressRenderer::run() {
+/* +--------------------------------------------------------------------+ */
+    std::chrono::milliseconds interval (style == JSONL ? JSONL_INTERVAL_MS : BAR_INTERVAL_MS);
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (!wake.wait_for(guard, interval, [this] { return stopping; }))
+        render(NULL);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * render()
+ * Samples the counter and draws a frame, or the final one given a status
+ *
+ * +--------------------------------------------------------------------+ */
+void ProgressRenderer::render(const char *status) {
+/* +--------------------------------------------------------------------+ */
+    clock::time_point now = clock::now();
+    long long done = bytes.load(std::memory_order_relaxed);
+
+    Sample sample = { now, done };
+    samples.push_back(sample);
+
+    while (samples.size() > 2 && now - samples.front().time > std::chrono::milliseconds(RATE_WINDOW_MS))
+        samples.pop_front();
+
+    // The final frame reports the whole transfer, not just the last few seconds
+    Sample from = status ? Sample { started, start } : samples.front();
+    double span = std::chrono::duration<double>(now - from.time).count();
+    double rate = span > 0 ? (done - from.bytes) / span : 0;
+    double elapsed = std::chrono::duration<double>(now - started).count();
+
+    // A transfer can run past a --save-size that's too small, the display stops at the total
+    long long shown = total > 0 && done > total ? total : done;
+
+    char line[256];
+    int len;
+
+    if (style == JSONL) {
+        if (status)
+            len = snprintf(line, sizeof(line),
+                "{\"event\":\"end\",\"op\":\"%s\",\"status\":\"%s\",\"bytes\":%lld,\"total\":%lld,"
+                "\"rate\":%.0f,\"elapsed\":%.3f}\n",
+                op.c_str(), status, shown, total, rate, elapsed);
+        else if (rate > 0)
+            len = snprintf(line, sizeof(line),
+                "{\"event\":\"progress\",\"op\":\"%s\",\"bytes\":%lld,\"total\":%lld,\"rate\":%.0f,\"eta\":%.1f}\n",
+                op.c_str(), shown, total, rate, (total - shown) / rate);
+        else
+            len = snprintf(line, sizeof(line),
+                "{\"event\":\"progress\",\"op\":\"%s\",\"bytes\":%lld,\"total\":%lld,\"rate\":0,\"eta\":null}\n",
+                op.c_str(), shown, total);
+    }
+    else {
+        const int width = 40;
+        double fraction = total > 0 ? std::max(0.0, std::min(1.0, double(shown) / total)) : 1;
+        int chars = std::max(0, std::min(width, (int) round(fraction * width)));
+        char bar[width + 1];
+
+        int i = 0;
+        for (; i < chars - 1; i++)
+            bar[i] = '=';
+
+        bar[i++] = '>';
+
+        for (; i < width; i++)
+            bar[i] = ' ';
+
+        bar[width] = '\0';
+
+        std::string when = status ? "in " + format_time(elapsed)
+                         : rate > 0 ? "ETA " + format_time((total - shown) / rate)
+                         : "ETA --:--";
+
+        // Trailing spaces clear whatever a longer frame left behind
+        len = snprintf(line, sizeof(line), "%4.0f%% [%s] " BYTES_FMT " / " BYTES_FMT " bytes  %7.1f kB/s  %-12s%s",
+            fraction * 100, bar, shown, total, rate / 1024, when.c_str(), status ? "\n" : "\r");
+    }
+
+    if (len > 0)
+        emit(line, std::min<size_t>(len, sizeof(line) - 1));
+}
+
+/* +--------------------------------------------------------------------+ */
+void ProgressRenderer::emit(const char *line, size_t len) {
+/* +--------------------------------------------------------------------+ */
+    if (style == BAR) {
+        fwrite(line, 1, len, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    // Events go out in one write so a reader never sees half a line
+    while (len > 0) {
+        ssize_t n = ::write(fd, line, len);
+        if (n <= 0)
+            return;
+
+        line += n;
+        len -= n;
+    }
+}
@@ -0,0 +1,298 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "savefile.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #include <windows.h>
+  #define fsync _commit
+#else
+  #include <sys/file.h>
+  #include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) parse_durability()
+ * Maps an --fsync value to a Durability, false if we don't know it
+ *
+ * +--------------------------------------------------------------------+ */
+bool SaveFile::parse_durability(const std::string &name, Durability &result) {
+/* +--------------------------------------------------------------------+ */
+    if (name == "none")
+        result = SYNC_NONE;
+    else if (name == "end")
+        result = SYNC_END;
+    else if (name == "periodic")
+        result = SYNC_PERIODIC;
+    else
+        return false;
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+SaveFile::SaveFile(Durability durability)
+    : durability(durability), fd(-1), map(NULL), length(0), writable(false) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+ */
+SaveFile::~SaveFile() {
+/* +--------------------------------------------------------------------+ */
+    release();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) create()
+ * Maps path as a size byte download target, keeping what's there if asked
+ *
+ * +--------------------------------------------------------------------+ */
+bool SaveFile::create(const std::string &path, size_t size, bool keep) {
+/* +--------------------------------------------------------------------+ */
+    release();
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_BINARY | (keep ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+        return false;
+
+    // Exactly the save size, with the blocks reserved now rather than as we go
+    if (ftruncate(fd, size) != 0) {
+        release();
+        return false;
+    }
+
+#ifdef __linux__
+    // A filesystem that can't reserve blocks is let off, one that's full isn't: writing
+    // through the mapping into a hole it can't fill would be a SIGBUS halfway through
+    int err = posix_fallocate(fd, 0, size);
+    if (err != 0 && err != EINVAL && err != EOPNOTSUPP) {
+        release();
+        errno = err;
+        return false;
+    }
+#endif
+
+    length = size;
+    writable = true;
+
+#ifdef _WIN32
+    // No mapping here, a buffer written back on sync and release does the job
+    map = new char[size]();
+    if (keep && ::read(fd, map, size) < 0) {
+        release();
+        return false;
+    }
+#else
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        release();
+        return false;
+    }
+    map = static_cast<char *>(addr);
+#endif
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) open()
+ * Maps path read-only, for uploading or comparing against
+ *
+ * +--------------------------------------------------------------------+ */
+bool SaveFile::open(const std::string &path) {
+/* +--------------------------------------------------------------------+ */
+    struct stat st;
+
+    release();
+
+    fd = ::open(path.c_str(), O_RDONLY | O_BINARY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        release();
+        return false;
+    }
+
+    length = st.st_size;
+    if (length == 0)
+        return true;
+
+#ifdef _WIN32
+    map = new char[length];
+    if (::read(fd, map, length) != (int) length) {
+        release();
+        return false;
+    }
+#else
+    void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        release();
+        return false;
+    }
+    map = static_cast<char *>(addr);
+
+    // We only ever go through it once, front to back
+    madvise(addr, length, MADV_SEQUENTIAL);
+#endif
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) sync()
+ * Makes start to end durable, if the policy asks for it along the way
+ *
+ * +--------------------------------------------------------------------+ */
+bool SaveFile::sync(size_t start, size_t end) {
+/* +--------------------------------------------------------------------+ */
+    if (!writable || durability != SYNC_PERIODIC || end <= start)
+        return true;
+
+#ifdef _WIN32
+    return lseek(fd, start, SEEK_SET) == (long) start
+        && ::write(fd, map + start, end - start) == (int) (end - start)
+        && fsync(fd) == 0;
+#else
+    // msync() wants a page aligned start
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = start - start % page;
+
+    return msync(map + from, end - from, MS_SYNC) == 0 && fsync(fd) == 0;
+#endif
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) finish()
+ * The transfer is complete, sync (unless told not to) and let go
+ *
+ * +--------------------------------------------------------------------+ */
+bool SaveFile::finish() {
+/* +--------------------------------------------------------------------+ */
+    bool ok = true;
+
+    if (writable && map && durability != SYNC_NONE) {
+#ifdef _WIN32
+        ok = lseek(fd, 0, SEEK_SET) == 0 && ::write(fd, map, length) == (int) length && fsync(fd) == 0;
+#else
+        ok = msync(map, length, MS_SYNC) == 0 && fsync(fd) == 0;
+#endif
+    }
+
+    release();
+    return ok;
+}
+
+/* +--------------------------------------------------------------------+ */
+void SaveFile::release() {
+/* +--------------------------------------------------------------------+ */
+#ifdef _WIN32
+    // Whatever we got is still worth keeping for --resume
+    if (map && writable && lseek(fd, 0, SEEK_SET) == 0)
+        ::write(fd, map, length);
+
+    delete[] map;
+#else
+    if (map)
+        munmap(map, length);
+#endif
+
+    if (fd >= 0)
+        ::close(fd);
+
+    fd = -1;
+    map = NULL;
+    length = 0;
+    writable = false;
+}
+
+/* +--------------------------------------------------------------------+ */
+void FileLock::lock(int file) {
+/* +--------------------------------------------------------------------+ */
+    unlock();
+    if (file < 0)
+        return;
+
+#ifndef _WIN32
+    while (flock(file, LOCK_EX) != 0 && errno == EINTR);
+#endif
+    fd = file;
+}
+
+/* +--------------------------------------------------------------------+ */
+void FileLock::unlock() {
+/* +--------------------------------------------------------------------+ */
+#ifndef _WIN32
+    if (fd >= 0)
+        flock(fd, LOCK_UN);
+#endif
+    fd = -1;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool write_all(int fd, const void *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    const char *p = static_cast<const char *>(data);
+
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        // Any signal but Ctrl+C just means try again
+        if (n < 0 && errno == EINTR && !cancel_token.requested())
+            continue;
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool replace_file(const std::string &temp, const std::string &path) {
+/* +--------------------------------------------------------------------+ */
+#ifdef _WIN32
+    // rename() won't replace an existing file here, MoveFileEx() will
+    return MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(temp.c_str(), path.c_str()) == 0;
+#endif
+}
@@ -0,0 +1,226 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "savefile.h"
+#include "sidecar.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <io.h>
+  #define fsync _commit
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+const size_t Sidecar::BLOCK_SIZE;
+
+struct SidecarHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t save_size;
+    uint32_t sums_crc;
+    uint32_t reserved;
+};
+
+static const char SIDECAR_MAGIC[4] = { '0', '0', '5', 'S' };
+static const uint32_t SIDECAR_VERSION = 1;
+
+/* +--------------------------------------------------------------------+ */
+std::string Sidecar::path_for(const std::string &save) {
+/* +--------------------------------------------------------------------+ */
+    return save + ".crc";
+}
+
+/* +--------------------------------------------------------------------+ */
+Sidecar::Sidecar() : size(0), covered(0) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+ */
+bool Sidecar::fail(const std::string &message) {
+/* +--------------------------------------------------------------------+ */
+    last_error = message;
+    return false;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (void) reset()
+ * Starts over for a save of save_size bytes, with no blocks summed
+ *
+ * +--------------------------------------------------------------------+ */
+void Sidecar::reset(size_t save_size) {
+/* +--------------------------------------------------------------------+ */
+    size_t count = (save_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    size = save_size;
+    covered = 0;
+    sums.assign(count, 0);
+    have.assign(count, 0);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (void) add()
+ * Sums the blocks of the save in data, which starts offset bytes in
+ *
+ * +--------------------------------------------------------------------+ */
+void Sidecar::add(long long offset, const char *data, size_t length) {
+/* +--------------------------------------------------------------------+ */
+    // Only whole blocks count, or the last one when the save ends inside it
+    for (size_t pos = 0; pos < length; pos += BLOCK_SIZE) {
+        long long start = offset + pos;
+        size_t block = start / BLOCK_SIZE;
+        size_t len = std::min<size_t>(BLOCK_SIZE, size - std::min<size_t>(size, start));
+
+        if (start % BLOCK_SIZE != 0 || block >= sums.size() || pos + len > length)
+            continue;
+
+        sums[block] = crc32c(data + pos, len);
+        if (!have[block]) {
+            have[block] = 1;
+            covered++;
+        }
+    }
+}
+
+/* +--------------------------------------------------------------------+ */
+bool Sidecar::complete() const {
+/* +--------------------------------------------------------------------+ */
+    return covered == sums.size();
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) load()
+ * Reads the sidecar at path, if it's whole
+ *
+ * +--------------------------------------------------------------------+ */
+bool Sidecar::load(const std::string &path) {
+/* +--------------------------------------------------------------------+ */
+    std::ifstream file (path.c_str(), std::ios::binary);
+    SidecarHeader header;
+
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return fail("Unable to read " + path);
+
+    if (memcmp(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) != 0 || header.version != SIDECAR_VERSION ||
+        header.block_size != BLOCK_SIZE)
+        return fail(path + " isn't a checksum file (or was written by a newer version)");
+
+    reset(header.save_size);
+
+    if ((!sums.empty() && !file.read(reinterpret_cast<char *>(&sums[0]), sums.size() * sizeof(uint32_t))) ||
+        crc32c(sums.empty() ? NULL : &sums[0], sums.size() * sizeof(uint32_t)) != header.sums_crc) {
+        reset(0);
+        return fail(path + " is damaged");
+    }
+
+    have.assign(sums.size(), 1);
+    covered = sums.size();
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) write()
+ * Writes the sums to path, replacing whatever was there in one go
+ *
+ * +--------------------------------------------------------------------+ */
+bool Sidecar::write(const std::string &path, bool sync) {
+/* +--------------------------------------------------------------------+ */
+    std::string temp = path + ".tmp";
+    SidecarHeader header;
+
+    if (!complete())
+        return fail("Not every block of the save was summed");
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+    header.version = SIDECAR_VERSION;
+    header.block_size = BLOCK_SIZE;
+    header.save_size = size;
+    header.sums_crc = crc32c(sums.empty() ? NULL : &sums[0], sums.size() * sizeof(uint32_t));
+
+    // Small enough to go in one write
+    std::vector<char> out (sizeof(header) + sums.size() * sizeof(uint32_t));
+    memcpy(&out[0], &header, sizeof(header));
+    if (!sums.empty())
+        memcpy(&out[sizeof(header)], &sums[0], sums.size() * sizeof(uint32_t));
+
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    bool ok = fd >= 0 && write_all(fd, &out[0], out.size()) && (!sync || fsync(fd) == 0);
+
+    if (fd >= 0)
+        ::close(fd);
+
+    if (!ok || !replace_file(temp, path)) {
+        remove(temp.c_str());
+        return fail("Unable to write " + path);
+    }
+
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::vector<size_t>) damaged()
+ * Blocks of data that don't match their sum
+ *
+ * +--------------------------------------------------------------------+ */
+std::vector<size_t> Sidecar::damaged(const char *data, size_t length, bool first_only) const {
+/* +--------------------------------------------------------------------+ */
+    std::vector<size_t> result;
+
+    for (size_t block = 0; block < sums.size(); block++) {
+        size_t start = block * BLOCK_SIZE;
+        size_t len = std::min(BLOCK_SIZE, size - start);
+
+        // Whatever's missing off the end of a short file is damaged too
+        if (start + len > length || crc32c(data + start, len) != sums[block]) {
+            result.push_back(block);
+            if (first_only)
+                break;
+        }
+    }
+
+    return result;
+}
+
+/* +--------------------------------------------------------------------+ */
+bool SidecarSink::process(PipelineBlock &block) {
+/* +--------------------------------------------------------------------+ */
+    sidecar.add(block.offset, block.data, block.length);
+    return true;
+}
@@ -0,0 +1,190 @@
+/*
+ * +--------------------------------------------------------------------+
+ * |
+ * | 005Tools by McHaggis
+ * |
+ * | Back up and restore 3DS/DSi/DS game saves from the command line.
+ * | Designed to work with the R4i Save Dongle.
+ * |
+ * +--------------------------------------------------------------------+
+
+    This file is part of 005Tools.
+
+    005Tools is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    005Tools is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with 005Tools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "main.h"
+#include "sketch.h"
+
+#include <algorithm>
+
+const size_t ChunkSketch::CHUNK_SIZE, ChunkSketch::DEPTH, ChunkSketch::WIDTH;
+
+// The second half of a chunk's hash, as KeyFinder has it
+static const uint64_t SECOND_SEED = 0x9E3779B97F4A7C15ULL;
+
+/* +--------------------------------------------------------------------+ */
+ChunkSketch::ChunkSketch(size_t k) : k(k), added(0), counters(DEPTH * WIDTH) {
+/* +--------------------------------------------------------------------+ */
+    heap.reserve(k);
+}
+
+/* +--------------------------------------------------------------------+ */
+size_t ChunkSketch::cell(const uint64_t hash[2], size_t row) const {
+/* +--------------------------------------------------------------------+ */
+    // Rows are told apart by mixing the two halves, rather than hashing again
+    return row * WIDTH + ((hash[0] + row * hash[1]) & (WIDTH - 1));
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * add()
+ * Counts one chunk, raising only the counters that are lowest for it
+ *
+ * +--------------------------------------------------------------------+ */
+void ChunkSketch::add(const char *chunk) {
+/* +--------------------------------------------------------------------+ */
+    uint64_t hash[2] = { xxh64(chunk, CHUNK_SIZE), xxh64(chunk, CHUNK_SIZE, SECOND_SEED) };
+    uint32_t count = estimate(hash) + 1;
+
+    for (size_t row = 0; row < DEPTH; row++) {
+        uint32_t &counter = counters[cell(hash, row)];
+        if (counter < count)
+            counter = count;
+    }
+
+    added++;
+    offer(hash, count, chunk);
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (uint32_t) estimate()
+ * How many times a chunk has been seen, at least
+ *
+ * +--------------------------------------------------------------------+ */
+uint32_t ChunkSketch::estimate(const uint64_t hash[2]) const {
+/* +--------------------------------------------------------------------+ */
+    uint32_t lowest = counters[cell(hash, 0)];
+
+    for (size_t row = 1; row < DEPTH; row++)
+        lowest = std::min(lowest, counters[cell(hash, row)]);
+
+    return lowest;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * merge()
+ * Adds another sketch's counts into this one
+ *
+ * +--------------------------------------------------------------------+ */
+void ChunkSketch::merge(const ChunkSketch &other) {
+/* +--------------------------------------------------------------------+ */
+    for (size_t i = 0; i < counters.size(); i++)
+        counters[i] += other.counters[i];
+    added += other.added;
+
+    // Either side's leaders could be the leaders now, so all of them are weighed again
+    std::vector<Heavy> candidates;
+    candidates.swap(heap);
+    candidates.insert(candidates.end(), other.heap.begin(), other.heap.end());
+    in_heap.clear();
+
+    for (size_t i = 0; i < candidates.size(); i++)
+        offer(candidates[i].hash, estimate(candidates[i].hash), candidates[i].chunk.data());
+}
+
+/* +--------------------------------------------------------------------+ */
+std::vector<ChunkSketch::Heavy> ChunkSketch::top() const {
+/* +--------------------------------------------------------------------+ */
+    std::vector<Heavy> sorted (heap);
+
+    std::sort(sorted.begin(), sorted.end(), [](const Heavy &a, const Heavy &b) { return a.count > b.count; });
+    return sorted;
+}
+
+/* +--------------------------------------------------------------------+ */
+void ChunkSketch::offer(const uint64_t hash[2], uint32_t count, const char *chunk) {
+/* +--------------------------------------------------------------------+ */
+    std::unordered_map<uint64_t, size_t>::iterator it = in_heap.find(hash[0]);
+
+    if (it != in_heap.end() && heap[it->second].hash[1] == hash[1]) {
+        // Counts only go up, so a leader can only sink away from the root
+        if (count > heap[it->second].count) {
+            heap[it->second].count = count;
+            sift_down(it->second);
+        }
+        return;
+    }
+
+    if (heap.size() >= k && (k == 0 || count <= heap[0].count))
+        return;
+
+    Heavy entry;
+    entry.hash[0] = hash[0];
+    entry.hash[1] = hash[1];
+    entry.count = count;
+    entry.chunk.assign(chunk, CHUNK_SIZE);
+
+    if (heap.size() < k) {
+        heap.push_back(entry);
+        in_heap[hash[0]] = heap.size() - 1;
+        sift_up(heap.size() - 1);
+        return;
+    }
+
+    in_heap.erase(heap[0].hash[0]);
+    heap[0].hash[0] = hash[0];
+    heap[0].hash[1] = hash[1];
+    heap[0].count = count;
+    heap[0].chunk.swap(entry.chunk);
+    in_heap[hash[0]] = 0;
+    sift_down(0);
+}
+
+/* +--------------------------------------------------------------------+ */
+void ChunkSketch::sift_down(size_t i) {
+/* +--------------------------------------------------------------------+ */
+    while (true) {
+        size_t smallest = i, left = 2 * i + 1, right = left + 1;
+
+        if (left < heap.size() && heap[left].count < heap[smallest].count)
+            smallest = left;
+        if (right < heap.size() && heap[right].count < heap[smallest].count)
+            smallest = right;
+        if (smallest == i)
+            return;
+
+        swap_entries(i, smallest);
+        i = smallest;
+    }
+}
+
+/* +--------------------------------------------------------------------+ */
+void ChunkSketch::sift_up(size_t i) {
+/* +--------------------------------------------------------------------+ */
+    while (i > 0 && heap[i].count < heap[(i - 1) / 2].count) {
+        swap_entries(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* +--------------------------------------------------------------------+ */
+void ChunkSketch::swap_entries(size_t a, size_t b) {
+/* +--------------------------------------------------------------------+ */
+    std::swap(heap[a], heap[b]);
+    in_heap[heap[a].hash[0]] = a;
+    in_heap[heap[b].hash[0]] = b;
+}
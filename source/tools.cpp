@@ -25,45 +25,351 @@
 */
 
 #include "main.h"
-#include <vector>
+#include "savefile.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#ifdef _WIN32
+  #include <direct.h>
+  #include <io.h>
+  #define mkdir(path, mode) _mkdir(path)
+#endif
+
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define PAD_X86
+  #include <immintrin.h>
+#endif
+
+/*
+    Finds the key a 3DS save is encrypted with.  The save is XORed with a
+    pad that repeats every 512 bytes, so the parts of it the game never
+    wrote (zeros underneath) come out as the pad itself, and the pad is by
+    far the most common chunk in the save.  Erased flash reads back as
+    0xFF and was never encrypted, so those chunks don't count.
+
+    Chunks are streamed in, hashed to 128 bits and counted in an open
+    addressing table; only the first copy of each distinct chunk is kept,
+    so the key can be handed back without holding on to the save.
+*/
+
+const size_t KeyFinder::CHUNK_SIZE;
+
+static const size_t INITIAL_SLOTS = 256;
+static const uint64_t SECOND_SEED = 0x9E3779B97F4A7C15ULL;
+
+/* +--------------------------------------------------------------------+ */
+KeyFinder::KeyFinder() : slots(INITIAL_SLOTS), used(0), seen(0), blank(0), best(0) {
+/* +--------------------------------------------------------------------+ */
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * chunk_data()
+ * Adds the next size bytes of the save, split anywhere
+ *
+ * +--------------------------------------------------------------------+ */
+void KeyFinder::chunk_data(const char *data, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    // Finish a chunk left over from last time, then take whole ones in place
+    if (!pending.empty()) {
+        size_t take = std::min(size, CHUNK_SIZE - pending.size());
+        pending.insert(pending.end(), data, data + take);
+        data += take;
+        size -= take;
+
+        if (pending.size() < CHUNK_SIZE)
+            return;
+
+        add_chunk(&pending[0]);
+        pending.clear();
+    }
+
+    for (; size >= CHUNK_SIZE; data += CHUNK_SIZE, size -= CHUNK_SIZE)
+        add_chunk(data);
+
+    pending.assign(data, data + size);
+}
+
+/* +--------------------------------------------------------------------+ */
+void KeyFinder::chunk_data(std::istream &data) {
+/* +--------------------------------------------------------------------+ */
+    char buffer[64 * CHUNK_SIZE];
+
+    while (data.read(buffer, sizeof(buffer)) || data.gcount() > 0)
+        chunk_data(buffer, data.gcount());
+}
 
-short CHUNK_SIZE = 0x200;
-std::map<std::string, int> chunks;
 /* +--------------------------------------------------------------------+ */
-void chunk_data (std::istream data) {
+void KeyFinder::add_chunk(const char *chunk) {
 /* +--------------------------------------------------------------------+ */
+    static const std::vector<char> erased (CHUNK_SIZE, (char) 0xFF);
+
+    seen++;
+    if (first_difference(chunk, &erased[0], CHUNK_SIZE) == CHUNK_SIZE) {
+        blank++;
+        return;
+    }
+
+    uint64_t h0 = xxh64(chunk, CHUNK_SIZE), h1 = xxh64(chunk, CHUNK_SIZE, SECOND_SEED);
+    size_t mask = slots.size() - 1, i = h0 & mask;
+
+    for (; slots[i].count; i = (i + 1) & mask) {
+        if (slots[i].hash[0] == h0 && slots[i].hash[1] == h1)
+            break;
+    }
+
+    Slot &slot = slots[i];
+    if (!slot.count) {
+        slot.hash[0] = h0;
+        slot.hash[1] = h1;
+        slot.sample = samples.size() / CHUNK_SIZE;
+        samples.insert(samples.end(), chunk, chunk + CHUNK_SIZE);
+        used++;
+    }
+
+    // The leader is kept as we go, no need to look through the table at the end
+    if (++slot.count > slots[best].count)
+        best = i;
+
+    if (used * 2 > slots.size())
+        grow();
+}
+
+/* +--------------------------------------------------------------------+ */
+void KeyFinder::grow() {
+/* +--------------------------------------------------------------------+ */
+    std::vector<Slot> old (slots.size() * 2);
+    old.swap(slots);
+
+    size_t mask = slots.size() - 1;
+    uint64_t leader[2] = { old[best].hash[0], old[best].hash[1] };
+
+    for (size_t n = 0; n < old.size(); n++) {
+        if (!old[n].count)
+            continue;
+
+        size_t i = old[n].hash[0] & mask;
+        while (slots[i].count)
+            i = (i + 1) & mask;
+
+        slots[i] = old[n];
+        if (old[n].hash[0] == leader[0] && old[n].hash[1] == leader[1])
+            best = i;
+    }
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) get_key()
+ * The most common chunk, false if no chunk turned up more than once
+ *
+ * +--------------------------------------------------------------------+ */
+bool KeyFinder::get_key(std::string &key, size_t *count) const {
+/* +--------------------------------------------------------------------+ */
+    const Slot &slot = slots[best];
+
+    if (count)
+        *count = slot.count;
+
+    if (slot.count < 2)
+        return false;
+
+    key.assign(&samples[slot.sample * CHUNK_SIZE], CHUNK_SIZE);
+    return true;
+}
+
 /*
-    1. Split file into chunks of 512 bytes
-    2. Discard any containing only 0xFF
+    Applying the key.  XOR is its own inverse, so the same pass decrypts a
+    save and encrypts it again.  Erased chunks were never encrypted and are
+    left alone both ways, which means a decrypted chunk that's all 0xFF
+    stays that way when it's encrypted again.
 */
-    std::string chunk(CHUNK_SIZE, 0x00);
-    data.read(&chunk[0], CHUNK_SIZE);
 
-    for (short i=0; i<CHUNK_SIZE; i++) {
-        if (chunk.at(i) != 0xFF)
-            goto ADD;
+/* +--------------------------------------------------------------------+ */
+static void xor_words(char *data, const char *pad, size_t start, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = start;
+
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t x, y;
+        memcpy(&x, data + i, sizeof(x));
+        memcpy(&y, pad + i, sizeof(y));
+        x ^= y;
+        memcpy(data + i, &x, sizeof(x));
     }
 
-    return;
+    for (; i < size; i++)
+        data[i] ^= pad[i];
+}
+
+#ifdef PAD_X86
+/* +--------------------------------------------------------------------+ */
+static void xor_sse2(char *data, const char *pad, size_t size) {
+/* +--------------------------------------------------------------------+ */
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pad + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), _mm_xor_si128(x, y));
+    }
 
-ADD:
-    chunks[chunk]++;
-    return;
+    xor_words(data, pad, i, size);
 }
 
 /* +--------------------------------------------------------------------+ */
-std::string get_key() {
+__attribute__((target("avx2")))
+static void xor_avx2(char *data, const char *pad, size_t size) {
 /* +--------------------------------------------------------------------+ */
-    std::string key;
-    int max = 0;
+    size_t i = 0;
 
-    // 3. Iterate over the chunks map and find the key with the largest int
-    for (auto &chunk : chunks) {
-        if (chunk.second > max) {
-            max = chunk.second;
-            key = chunk.first;
+    for (; i + 32 <= size; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pad + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(data + i), _mm256_xor_si256(x, y));
+    }
+
+    xor_words(data, pad, i, size);
+}
+#endif
+
+/* +--------------------------------------------------------------------+
+ *
+ * apply_pad()
+ * XORs size bytes of save, starting offset bytes in, with the 512 byte pad
+ *
+ * +--------------------------------------------------------------------+ */
+void apply_pad(char *data, size_t size, const char *pad, size_t offset) {
+/* +--------------------------------------------------------------------+ */
+    static const std::vector<char> erased (KeyFinder::CHUNK_SIZE, (char) 0xFF);
+#ifdef PAD_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    // A chunk (or the part of one we have) at a time, so each can be checked for being blank
+    while (size > 0) {
+        size_t phase = offset % KeyFinder::CHUNK_SIZE;
+        size_t len = std::min(size, KeyFinder::CHUNK_SIZE - phase);
+
+        if (first_difference(data, &erased[0], len) < len) {
+#ifdef PAD_X86
+            if (avx2)
+                xor_avx2(data, pad + phase, len);
+            else
+                xor_sse2(data, pad + phase, len);
+#else
+            xor_words(data, pad + phase, 0, len);
+#endif
         }
+
+        data += len;
+        offset += len;
+        size -= len;
+    }
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (std::string) default_dir()
+ * Where keys are cached unless told otherwise
+ *
+ * +--------------------------------------------------------------------+ */
+std::string PadCache::default_dir() {
+/* +--------------------------------------------------------------------+ */
+#ifdef _WIN32
+    const char *local = getenv("LOCALAPPDATA");
+    return std::string(local && *local ? local : ".") + "/005tools/keys";
+#else
+    const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+    if (cache && *cache)
+        return std::string(cache) + "/005tools/keys";
+    return std::string(home && *home ? home : ".") + "/.cache/005tools/keys";
+#endif
+}
+
+/* +--------------------------------------------------------------------+ */
+std::string PadCache::path_for(const std::string &card) const {
+/* +--------------------------------------------------------------------+ */
+    std::string name = card;
+
+    // Card IDs are printable, but they end up in a file name
+    for (size_t i = 0; i < name.size(); i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '-')
+            name[i] = '_';
+    }
+
+    return dir + "/" + name + ".key";
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) find()
+ * The pad cached for card, from memory if it's been used before
+ *
+ * +--------------------------------------------------------------------+ */
+bool PadCache::find(const std::string &card, std::string &pad) {
+/* +--------------------------------------------------------------------+ */
+    if (card.empty())
+        return false;
+
+    std::map<std::string, std::string>::const_iterator it = loaded.find(card);
+    if (it != loaded.end()) {
+        pad = it->second;
+        return true;
+    }
+
+    std::string key (KeyFinder::CHUNK_SIZE, 0);
+    int fd = ::open(path_for(card).c_str(), O_RDONLY | O_BINARY);
+    bool ok = fd >= 0 && ::read(fd, &key[0], key.size()) == (ssize_t) key.size();
+
+    if (fd >= 0)
+        ::close(fd);
+
+    if (!ok)
+        return false;
+
+    pad = loaded[card] = key;
+    return true;
+}
+
+/* +--------------------------------------------------------------------+
+ *
+ * (bool) store()
+ * Keeps pad for card, replacing whatever was there in one go
+ *
+ * +--------------------------------------------------------------------+ */
+bool PadCache::store(const std::string &card, const std::string &pad) {
+/* +--------------------------------------------------------------------+ */
+    if (card.empty() || pad.size() != KeyFinder::CHUNK_SIZE)
+        return false;
+
+    loaded[card] = pad;
+
+    // Every level of it, there may not be a cache directory at all yet
+    for (size_t slash = dir.find('/', 1); slash != std::string::npos; slash = dir.find('/', slash + 1))
+        mkdir(dir.substr(0, slash).c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+
+    std::string path = path_for(card), temp = path + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    bool ok = fd >= 0 && write_all(fd, pad.data(), pad.size());
+
+    if (fd >= 0)
+        ::close(fd);
+
+    if (!ok || !replace_file(temp, path)) {
+        remove(temp.c_str());
+        return false;
     }
 
-    return key;
+    return true;
 }